@@ -0,0 +1,515 @@
+/*
+asmbench.c
+
+ Per-phase benchmark of the assembler core. The library source is compiled into this file so
+ every phase can be run and timed on its own:
+   lex     class bitmaps of the buffer, then every line split into token spans
+   pass1   syntax checks, label binding and operand decoding into the IR
+   pass2   encoding the IR
+   output  rendering the image in the chosen format, into memory
+ plus the whole assembly through the public API, two-pass and one-pass, and with --run=N the
+ assembled program executed by the simulator for at most N instructions.
+ --micro adds microbenchmarks of reading # and x literals into each immediate field and of
+ packing numbers into it, parse_<field>/pack_<field> against the toNum and check_<n>bit functions
+ they replaced.
+ The report is JSON on stdout. A typical regression run:
+   asmgen --lines=1000000 big.asm && asmgen --lines=100000 --labels=0.8 dense.asm
+   asmbench --iterations=10 big.asm dense.asm > report.json
+
+*/
+#include "../Lab1/libassembler.c"
+#include "../Lab1/simulator.c"
+#include <time.h>
+#include <sys/resource.h> /* peak RSS */
+
+enum{PH_LEX, PH_PASS1, PH_PASS2, PH_OUTPUT, PH_ASSEMBLE, PH_ONE_PASS, PH_SIMULATE, NUM_PHASES};
+
+static const char * const PHASE_NAME[NUM_PHASES] = {"lex", "pass1", "pass2", "output", "assemble", "assemble_one_pass", "simulate"};
+
+/*Timings of one input over all iterations*/
+typedef struct {
+	const char * path;
+	size_t bytes;
+	long lines; /*source lines, blank and comment lines included*/
+	int insts; /*lexed instruction lines*/
+	int words; /*image words, origin included*/
+	uint64_t executed; /*instructions simulated per run, 0 without --run*/
+	double best[NUM_PHASES];
+	double sum[NUM_PHASES];
+}bench_result;
+
+/*Reusable buffers of the staged run*/
+typedef struct {
+	parsed_line * lines;
+	int cap;
+	char * out;
+	size_t out_cap;
+	uint16_t * words;
+	size_t words_cap;
+	sim_machine * sim; /*--run only*/
+}bench_scratch;
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* **********run_staged*****************
+ One two-pass assembly of st->src, each phase timed into t[]. The lines are lexed once up front
+ so pass 1 and pass 2 measure only their own work. Return 0 or the error code
+************************************************ */
+static int run_staged(asm_state * st, bench_scratch * sc, const asm_format * fmt, int * ninsts, double * t){
+	asm_trap trap;
+	lexer lx;
+	volatile int n = 0, lRet = OK; /*changed after sigsetjmp, n is read after a failure*/
+	int i;
+	double t0;
+	asm_reset(st);
+	st->src = st->source.data;
+	st->src_len = st->source.len;
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		t0 = now();
+		scan_source(&st->scan, st->src, st->src_len);
+		lexer_init(&lx, st->src, st->src_len, &st->scan);
+		do{
+			sc->lines = grow_array(sc->lines, &sc->cap, n + 1, sizeof(parsed_line));
+			lRet = lex_line(&lx, &sc->lines[n]);
+			if (lRet == OK) n++;
+		}
+		while (lRet != DONE && !(lRet == OK && sc->lines[n - 1].op == OP_END));
+		t[PH_LEX] = now() - t0;
+
+		t0 = now();
+		for (i = 0, lRet = OK; i < n && lRet != DONE; i++) {
+			pass1_line(st, &sc->lines[i]);
+			lRet = decode_line(st, &sc->lines[i]);
+		}
+		t[PH_PASS1] = now() - t0;
+
+		t0 = now();
+		encode_ir(st, st->deferred.code ? st->deferred_at : st->ir.len);
+		if (st->deferred.code) {
+			asm_fail_at(st->deferred.where, st->deferred.code, "%s", st->deferred.msg);
+		}
+		if (lRet != DONE) {
+			asm_fail(4, "Error, no end for the program\n");
+		}
+		t[PH_PASS2] = now() - t0;
+
+		t0 = now();
+		{
+			size_t size = fmt->size(st->image, st->image_len);
+			if (size > sc->out_cap) {
+				free(sc->out);
+				sc->out = malloc(size);
+				sc->out_cap = sc->out ? size : 0;
+				if (!sc->out) asm_fail(4, "Error: out of memory\n");
+			}
+			fmt->render(sc->out, st->image, st->image_len);
+		}
+		t[PH_OUTPUT] = now() - t0;
+	}
+	cur_trap = NULL;
+	if (trap.code) printf("%s", trap.msg);
+	*ninsts = n;
+	return trap.code;
+}
+
+/* **********run_api*****************
+ Time the whole assembly through asm_assemble, the number users actually see
+************************************************ */
+static int run_api(asm_state * st, bench_scratch * sc, int one_pass, double * t){
+	asm_options opts;
+	asm_error err;
+	size_t nwords = 0;
+	double t0;
+	int code;
+	opts.one_pass = one_pass;
+	opts.threads = st->threads;
+	opts.relocatable = 0;
+	opts.include_dir = NULL;
+	opts.max_errors = 0;
+	opts.optimize = 0;
+	opts.diag_level = ASM_DIAG_QUIET;
+	opts.diag = NULL;
+	opts.stats = NULL;
+	t0 = now();
+	code = asm_assemble(st, st->source.data, st->source.len, &opts, sc->words, sc->words_cap, &nwords, &err);
+	*t = now() - t0;
+	if (code == ASM_ERR_OTHER && nwords > sc->words_cap) {
+		/*first run only: size the buffer, then time again*/
+		free(sc->words);
+		sc->words = malloc(nwords * sizeof(uint16_t));
+		sc->words_cap = sc->words ? nwords : 0;
+		return run_api(st, sc, one_pass, t);
+	}
+	if (code) printf("%s", err.message);
+	return code;
+}
+
+/* **********run_sim*****************
+ Time loading and executing the image of the last assembly, at most limit instructions
+************************************************ */
+static void run_sim(asm_state * st, bench_scratch * sc, uint64_t limit, uint64_t * executed, double * t){
+	size_t nwords;
+	const uint16_t * words = asm_get_image(st, &nwords);
+	double t0 = now();
+	sim_load(sc->sim, words, nwords);
+	sim_run(sc->sim, limit, 0);
+	*t = now() - t0;
+	*executed = sc->sim->insts;
+}
+
+/* **********legacy_toNum*****************
+ toNum and the check_<n>bit functions as they were before parse_literal and DEFINE_FIELD, the
+ baseline of --micro. Only called on valid, in range tokens
+************************************************ */
+static int legacy_toNum(const char * pStr, size_t len){
+	const char * end = pStr + len;
+	const char * orig_pStr = pStr;
+	int lNeg = 0;
+	long lNum = 0;
+	asm_mark(pStr);
+	if (len && *pStr == '#') {
+		pStr++;
+		if (pStr < end && *pStr == '-') {
+			lNeg = 1;
+			pStr++;
+		}
+		for (; pStr < end; pStr++) {
+			if (!isdigit((unsigned char)*pStr)) {
+				asm_fail_at(orig_pStr, 4, "Error: invalid decimal operand, %s\n", tok_text(orig_pStr, len));
+			}
+			if (lNum < INT_MAX) lNum = lNum * 10 + (*pStr - '0');
+		}
+	}
+	else if (len && FOLD(*pStr) == 'x') {
+		pStr++;
+		if (pStr < end && *pStr == '-') {
+			lNeg = 1;
+			pStr++;
+		}
+		for (; pStr < end; pStr++) {
+			int c = FOLD((unsigned char)*pStr);
+			if (!isxdigit(c)) {
+				asm_fail_at(orig_pStr, 4, "Error: invalid hex operand, %s\n", tok_text(orig_pStr, len));
+			}
+			if (lNum < INT_MAX) lNum = lNum * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+		}
+	}
+	else {
+		asm_fail_at(orig_pStr, 4, "Error: invalid operand, %s\n", tok_text(orig_pStr, len));
+	}
+	if (lNum > INT_MAX) lNum = INT_MAX;
+	return lNeg ? -(int)lNum : (int)lNum;
+}
+
+/*check_<n>bit: range check, then two's complement by hand*/
+#define LEGACY_CHECK(width, is_signed) \
+static int legacy_check_##width(int num){ \
+	if (num > FIELD_MAX(width, is_signed) || num < FIELD_MIN(width, is_signed)) { \
+		asm_fail(3, "Error: %d bit number overflow\n", width); \
+	} \
+	else \
+		if (num < 0) { \
+			return num + (1 << (width)); \
+		} \
+	return num; \
+} \
+static int legacy_parse_##width(const char * p, size_t len){ \
+	return legacy_check_##width(legacy_toNum(p, len)); \
+}
+
+LEGACY_CHECK(4, 0)
+LEGACY_CHECK(5, 1)
+LEGACY_CHECK(6, 1)
+LEGACY_CHECK(8, 0)
+LEGACY_CHECK(9, 1)
+LEGACY_CHECK(11, 1)
+LEGACY_CHECK(16, 1)
+
+#define MICRO_TOKENS 4096 /* literals per field */
+#define MICRO_ROUNDS 200 /* passes over them per timing */
+
+/*One immediate field of the microbenchmark, the old and the new way to fill it*/
+typedef struct {
+	const char * name;
+	int width, is_signed;
+	int (*legacy_parse)(const char * p, size_t len);
+	int (*parse)(const char * p, size_t len);
+	int (*legacy_pack)(int num);
+	int (*pack)(int num);
+}micro_field;
+
+#define MICRO_FIELD(name, width, is_signed) \
+	{#name, width, is_signed, legacy_parse_##width, parse_##name, legacy_check_##width, pack_##name}
+
+static const micro_field MICRO_FIELDS[] = {
+	MICRO_FIELD(amount4, 4, 0), MICRO_FIELD(imm5, 5, 1), MICRO_FIELD(offset6, 6, 1), MICRO_FIELD(trapvect8, 8, 0),
+	MICRO_FIELD(offset9, 9, 1), MICRO_FIELD(offset11, 11, 1), MICRO_FIELD(word16, 16, 1)
+};
+#define NUM_MICRO (int)(sizeof(MICRO_FIELDS) / sizeof(MICRO_FIELDS[0]))
+
+/*Best time per call of each field, in nanoseconds*/
+typedef struct {
+	double legacy_parse, parse, legacy_pack, pack;
+}micro_result;
+
+/*Best of iterations timings of MICRO_ROUNDS passes of fn over the tokens, per call. *sum keeps
+ the results alive*/
+static double time_parse(int (*fn)(const char *, size_t), const char * text, const int * off, int iterations, long * sum){
+	double best = 0;
+	int it, r, i;
+	for (it = 0; it < iterations; it++) {
+		double t0 = now();
+		for (r = 0; r < MICRO_ROUNDS; r++) {
+			for (i = 0; i < MICRO_TOKENS; i++) *sum += fn(text + off[i], off[i + 1] - off[i]);
+		}
+		t0 = now() - t0;
+		if (it == 0 || t0 < best) best = t0;
+	}
+	return best * 1e9 / ((double)MICRO_ROUNDS * MICRO_TOKENS);
+}
+
+static double time_pack(int (*fn)(int), const int * nums, int iterations, long * sum){
+	double best = 0;
+	int it, r, i;
+	for (it = 0; it < iterations; it++) {
+		double t0 = now();
+		for (r = 0; r < MICRO_ROUNDS; r++) {
+			for (i = 0; i < MICRO_TOKENS; i++) *sum += fn(nums[i]);
+		}
+		t0 = now() - t0;
+		if (it == 0 || t0 < best) best = t0;
+	}
+	return best * 1e9 / ((double)MICRO_ROUNDS * MICRO_TOKENS);
+}
+
+/* **********run_micro*****************
+ Time every field with random in range literals, # and x, both signs. The old and the new
+ functions must agree on every token. Return 0 or 4
+************************************************ */
+static int run_micro(int iterations, micro_result * res){
+	char * text = malloc(MICRO_TOKENS * 16);
+	int * off = malloc((MICRO_TOKENS + 1) * sizeof(int));
+	int * nums = malloc(MICRO_TOKENS * sizeof(int));
+	unsigned seed = 1;
+	long sum = 0;
+	int f, i, code = 0;
+	if (!text || !off || !nums) {
+		printf("Error: out of memory\n");
+		exit(4);
+	}
+	for (f = 0; f < NUM_MICRO && !code; f++) {
+		const micro_field * m = &MICRO_FIELDS[f];
+		int lo = FIELD_MIN(m->width, m->is_signed), hi = FIELD_MAX(m->width, m->is_signed);
+		char * p = text;
+		for (i = 0; i < MICRO_TOKENS; i++) {
+			seed = seed * 1103515245 + 12345;
+			nums[i] = lo + (int)((seed >> 8) % (unsigned)(hi - lo + 1));
+			off[i] = p - text;
+			if (seed & 0x10) p += sprintf(p, "#%d", nums[i]);
+			else p += sprintf(p, nums[i] < 0 ? "x-%X" : "x%X", nums[i] < 0 ? -nums[i] : nums[i]);
+		}
+		off[i] = p - text;
+		for (i = 0; i < MICRO_TOKENS && !code; i++) {
+			int old = m->legacy_parse(text + off[i], off[i + 1] - off[i]);
+			if (old != m->parse(text + off[i], off[i + 1] - off[i]) || old != m->pack(nums[i]) || old != m->legacy_pack(nums[i])) {
+				printf("Error: %s differs on %.*s\n", m->name, off[i + 1] - off[i], text + off[i]);
+				code = 4;
+			}
+		}
+		res[f].legacy_parse = time_parse(m->legacy_parse, text, off, iterations, &sum);
+		res[f].parse = time_parse(m->parse, text, off, iterations, &sum);
+		res[f].legacy_pack = time_pack(m->legacy_pack, nums, iterations, &sum);
+		res[f].pack = time_pack(m->pack, nums, iterations, &sum);
+	}
+	if (sum == 42) printf(" "); /*keeps the calls from being optimized away*/
+	free(text);
+	free(off);
+	free(nums);
+	return code;
+}
+
+static long count_lines(const char * buf, size_t len){
+	const char * p = buf;
+	const char * end = buf + len;
+	long n = 0;
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		n++;
+		p++;
+	}
+	return (len && buf[len - 1] != '\n') ? n + 1 : n;
+}
+
+/* **********bench_file*****************
+ Run every phase of one input iterations times. Return 0 or the first error code
+************************************************ */
+static int bench_file(asm_state * st, bench_scratch * sc, const char * path, const asm_format * fmt, int iterations,
+					  uint64_t run_limit, bench_result * r){
+	int it, ph, code = 0;
+	memset(r, 0, sizeof(*r));
+	r->path = path;
+	if (load_source(path, &st->source) != 0) {
+		printf("Error: annot open file %s\n",path);
+		return 4;
+	}
+	r->bytes = st->source.len;
+	r->lines = count_lines(st->source.data, st->source.len);
+	for (it = 0; it < iterations && !code; it++) {
+		double t[NUM_PHASES];
+		code = run_staged(st, sc, fmt, &r->insts, t);
+		r->words = st->image_len;
+		if (!code) code = run_api(st, sc, 0, &t[PH_ASSEMBLE]);
+		if (!code) code = run_api(st, sc, 1, &t[PH_ONE_PASS]);
+		t[PH_SIMULATE] = 0;
+		if (!code && run_limit) run_sim(st, sc, run_limit, &r->executed, &t[PH_SIMULATE]);
+		for (ph = 0; ph < NUM_PHASES && !code; ph++) {
+			if (it == 0 || t[ph] < r->best[ph]) r->best[ph] = t[ph];
+			r->sum[ph] += t[ph];
+		}
+	}
+	free_source(&st->source);
+	return code;
+}
+
+static void print_json_string(const char * s){
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') putchar('\\');
+		if ((unsigned char)*s >= 0x20) putchar(*s);
+	}
+	putchar('"');
+}
+
+static void print_rate(const char * name, double best, double mean, const bench_result * r, int last){
+	printf("        \"%s\": {\"best_s\": %.9f, \"mean_s\": %.9f, \"lines_per_sec\": %.0f, \"bytes_per_sec\": %.0f}%s\n",
+		   name, best, mean, best > 0 ? r->lines / best : 0, best > 0 ? r->bytes / best : 0, last ? "" : ",");
+}
+
+static long peak_rss_kb(void){
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) return -1;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024; /*bytes on macOS*/
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+static void report(const bench_result * res, int nres, const asm_format * fmt, int iterations, const micro_result * micro){
+	int i, ph;
+	printf("{\n  \"iterations\": %d,\n  \"format\": \"%s\",\n  \"files\": [\n", iterations, fmt->name);
+	for (i = 0; i < nres; i++) {
+		const bench_result * r = &res[i];
+		double best = 0, mean = 0;
+		printf("    {\n      \"file\": ");
+		print_json_string(r->path);
+		printf(",\n      \"bytes\": %zu, \"lines\": %ld, \"instructions\": %d, \"words\": %d,\n",
+			   r->bytes, r->lines, r->insts, r->words);
+		printf("      \"phases\": {\n");
+		for (ph = 0; ph < NUM_PHASES; ph++) {
+			if (ph <= PH_OUTPUT) {
+				best += r->best[ph];
+				mean += r->sum[ph] / iterations;
+			}
+			if (ph == PH_SIMULATE) {
+				if (r->executed) {
+					printf("        \"%s\": {\"best_s\": %.9f, \"mean_s\": %.9f, \"instructions\": %llu, \"instructions_per_sec\": %.0f},\n",
+						   PHASE_NAME[ph], r->best[ph], r->sum[ph] / iterations, (unsigned long long)r->executed,
+						   r->best[ph] > 0 ? r->executed / r->best[ph] : 0);
+				}
+				continue;
+			}
+			print_rate(PHASE_NAME[ph], r->best[ph], r->sum[ph] / iterations, r, 0);
+		}
+		print_rate("staged_total", best, mean, r, 1);
+		printf("      }\n    }%s\n", i + 1 < nres ? "," : "");
+	}
+	printf("  ],\n");
+	if (micro) {
+		printf("  \"micro_ns_per_call\": {\n");
+		for (i = 0; i < NUM_MICRO; i++) {
+			printf("    \"%s\": {\"legacy_parse\": %.2f, \"parse\": %.2f, \"legacy_pack\": %.2f, \"pack\": %.2f}%s\n",
+				   MICRO_FIELDS[i].name, micro[i].legacy_parse, micro[i].parse, micro[i].legacy_pack, micro[i].pack,
+				   i + 1 < NUM_MICRO ? "," : "");
+		}
+		printf("  },\n");
+	}
+	printf("  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+}
+
+static void usage(char * prgName){
+	printf("Usage: %s [--iterations=N] [--threads=N] [--format=hex|bin|obj] [--run=N] [--micro] <input.asm>...\n", prgName);
+	exit(4);
+}
+
+int main(int argc, char* argv[]) {
+	const asm_format * fmt = asm_find_format("hex");
+	bench_result * res;
+	bench_scratch sc;
+	asm_state * st;
+	int iterations = 5, nres = 0, i, code = 0;
+	uint64_t run_limit = 0;
+	micro_result micro[NUM_MICRO];
+	int want_micro = 0;
+
+	res = calloc(argc, sizeof(bench_result));
+	st = asm_ctx_create();
+	if (!res || !st) {
+		printf("Error: out of memory\n");
+		exit(4);
+	}
+	memset(&sc, 0, sizeof(sc));
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--iterations=", 13) == 0) {
+			iterations = atoi(argv[i] + 13);
+			if (iterations < 1) usage(argv[0]);
+		}
+		else if (strncmp(argv[i], "--format=", 9) == 0) {
+			fmt = asm_find_format(argv[i] + 9);
+			if (!fmt) usage(argv[0]);
+		}
+		else if (strncmp(argv[i], "--threads=", 10) == 0) {
+			st->threads = atoi(argv[i] + 10); /*pass 2 threads, 0 for one per core*/
+		}
+		else if (strncmp(argv[i], "--run=", 6) == 0) {
+			run_limit = strtoull(argv[i] + 6, NULL, 0); /*instruction limit of the simulated run*/
+			if (!run_limit) usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--micro") == 0) {
+			want_micro = 1;
+		}
+		else if (argv[i][0] == '-') {
+			usage(argv[0]);
+		}
+	}
+	if (run_limit) {
+		sc.sim = malloc(sizeof(sim_machine));
+		if (!sc.sim) {
+			printf("Error: out of memory\n");
+			exit(4);
+		}
+	}
+	for (i = 1; i < argc && !code; i++) {
+		if (argv[i][0] == '-') continue;
+		code = bench_file(st, &sc, argv[i], fmt, iterations, run_limit, &res[nres++]);
+	}
+	if (nres == 0 && !want_micro) usage(argv[0]);
+	if (!code && want_micro) code = run_micro(iterations, micro);
+	if (code) exit(code);
+
+	report(res, nres, fmt, iterations, want_micro ? micro : NULL);
+	free(sc.lines);
+	free(sc.out);
+	free(sc.words);
+	free(sc.sim);
+	asm_ctx_destroy(st);
+	free(res);
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+asmgen.c
+
+ Synthetic LC-3b program generator for the benchmarks. Every generated program assembles
+ without errors, so the same file can be timed phase by phase.
+
+*/
+#include <stdio.h> /* standard input/output library */
+#include <stdlib.h> /* Standard C Library */
+#include <string.h> /* String operations library */
+
+#define NUM_OPCODE 28
+#define BR_WINDOW 200 /* br/lea targets stay within the 9 bit offset range */
+#define JSR_WINDOW 900 /* jsr targets stay within the 11 bit offset range */
+
+static const char * const OPCODE[NUM_OPCODE] = {"add", "and","br","brn","brz","brp","brzp","brnp","brnz","brnzp","halt", "jmp","jsr", "jsrr", "ldb", "ldw", "lea", "nop", "not", "ret", "rti", "lshf", "rshfl", "rshfa", "stb", "stw", "trap", "xor"};
+
+/*Default opcode mix, roughly what hand written code looks like. Every opcode appears*/
+static int WEIGHT[NUM_OPCODE] = {12, 6, 3, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, 6, 8, 3, 1, 2, 1, 1, 2, 1, 1, 4, 6, 1, 2};
+
+typedef struct {
+	long lines; /*total lines, comments and .orig/.end included*/
+	double label_density; /*fraction of instructions carrying a label*/
+	double forward; /*fraction of label references that point forward*/
+	double comments; /*fraction of instructions with a trailing comment, a quarter as many comment-only lines*/
+	unsigned long seed;
+}gen_options;
+
+static unsigned long long rng_state;
+
+/* xorshift64*, reproducible across platforms for a given seed */
+static unsigned long rng(void){
+	unsigned long long x = rng_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rng_state = x;
+	return (unsigned long)((x * 2685821657736338717ULL) >> 33);
+}
+
+static double rng_unit(void){
+	return (rng() & 0xFFFFFF) / (double)0x1000000;
+}
+
+static int rng_range(int lo, int hi){
+	return lo + (int)(rng() % (unsigned long)(hi - lo + 1));
+}
+
+static int pick_opcode(int total){
+	int r = (int)(rng() % (unsigned long)total), i;
+	for (i = 0; i < NUM_OPCODE; i++) {
+		r -= WEIGHT[i];
+		if (r < 0) return i;
+	}
+	return 0;
+}
+
+/* **********pick_target*****************
+ Choose a labeled instruction near inst, forward or backward as the mix asks.
+ Return -1 if no label is in reach
+************************************************ */
+static long pick_target(const char * labeled, long ninst, long inst, int window, double forward){
+	int dir = rng_unit() < forward ? 1 : -1;
+	int tries;
+	for (tries = 0; tries < 2; tries++, dir = -dir) {
+		long t = inst + dir * rng_range(1, window);
+		long i;
+		if (t < 0) t = 0;
+		if (t >= ninst) t = ninst - 1;
+		/*walk back towards inst to the nearest label*/
+		for (i = t; dir > 0 ? i > inst : i < inst; i -= dir) {
+			if (labeled[i]) return i;
+		}
+	}
+	return -1;
+}
+
+static int is_label_ref(int op){
+	return (op >= 2 && op <= 9) || op == 12 || op == 16; /* br* jsr lea */
+}
+
+static void emit_operands(FILE * out, int op, long target){
+	switch (op) {
+		case 0: case 1: case 27: /* add and xor */
+			if (rng() & 1) fprintf(out, "R%d, R%d, R%d", rng_range(0, 7), rng_range(0, 7), rng_range(0, 7));
+			else fprintf(out, "R%d, R%d, #%d", rng_range(0, 7), rng_range(0, 7), rng_range(-16, 15));
+			break;
+		case 16: /* lea */
+			fprintf(out, "R%d, L%ld", rng_range(0, 7), target);
+			break;
+		case 2: case 3: case 4: case 5: case 6: case 7: case 8: case 9: case 12: /* br* jsr */
+			fprintf(out, "L%ld", target);
+			break;
+		case 11: case 13: /* jmp jsrr */
+			fprintf(out, "R%d", rng_range(0, 7));
+			break;
+		case 14: case 15: case 24: case 25: /* ldb ldw stb stw */
+			fprintf(out, "R%d, R%d, #%d", rng_range(0, 7), rng_range(0, 7), rng_range(-32, 31));
+			break;
+		case 18: /* not */
+			fprintf(out, "R%d, R%d", rng_range(0, 7), rng_range(0, 7));
+			break;
+		case 21: case 22: case 23: /* shifts */
+			fprintf(out, "R%d, R%d, #%d", rng_range(0, 7), rng_range(0, 7), rng_range(0, 15));
+			break;
+		case 26: /* trap */
+			fprintf(out, "x%02X", rng_range(0x20, 0x25));
+			break;
+		default: /* halt nop ret rti */
+			break;
+	}
+}
+
+/* **********generate*****************
+ Write one program of opt->lines lines to out. Comment-only lines and labels are placed first,
+ so every reference is known to land on a label that gets written
+************************************************ */
+static void generate(FILE * out, const gen_options * opt){
+	long nbody = opt->lines - 2; /*lines between .orig and .end*/
+	char * comment_line = calloc(nbody, 1);
+	char * labeled = calloc(nbody, 1);
+	long ninst = 0, inst = 0, i;
+	int total = 0;
+	if (!comment_line || !labeled) {
+		printf("Error: out of memory\n");
+		exit(4);
+	}
+	for (i = 0; i < NUM_OPCODE; i++) total += WEIGHT[i];
+	if (total <= 0) {
+		printf("Error: opcode mix has no weight\n");
+		exit(4);
+	}
+	rng_state = opt->seed ? opt->seed : 1;
+	for (i = 0; i < nbody; i++) {
+		comment_line[i] = rng_unit() < opt->comments / 4;
+		if (!comment_line[i]) ninst++;
+	}
+	for (i = 0; i < ninst; i++) labeled[i] = rng_unit() < opt->label_density;
+
+	fprintf(out, ".ORIG x3000\n");
+	for (i = 0; i < nbody; i++) {
+		int op;
+		long target = -1;
+		if (comment_line[i]) {
+			fprintf(out, "; block %ld\n", inst);
+			continue;
+		}
+		op = pick_opcode(total);
+		if (is_label_ref(op)) {
+			target = pick_target(labeled, ninst, inst, op == 12 ? JSR_WINDOW : BR_WINDOW, opt->forward);
+			/*nothing in reach: refer to our own label*/
+			if (target < 0) {
+				labeled[inst] = 1;
+				target = inst;
+			}
+		}
+		if (labeled[inst]) fprintf(out, "L%ld\t", inst);
+		else fputc('\t', out);
+		fprintf(out, "%s ", OPCODE[op]);
+		emit_operands(out, op, target);
+		if (rng_unit() < opt->comments) fprintf(out, "\t; op %d", op);
+		fputc('\n', out);
+		inst++;
+	}
+	fprintf(out, ".END\n");
+	free(comment_line);
+	free(labeled);
+}
+
+/* **********set_mix*****************
+ Parse "add:5,ldw:2,..." into WEIGHT. Opcodes not named keep weight 1 so all of them still appear
+************************************************ */
+static int set_mix(const char * spec){
+	char * copy = strdup(spec);
+	char * save = NULL;
+	char * item;
+	int i;
+	if (!copy) return -1;
+	for (i = 0; i < NUM_OPCODE; i++) WEIGHT[i] = 1;
+	for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		char * colon = strchr(item, ':');
+		if (!colon) break;
+		*colon = '\0';
+		for (i = 0; i < NUM_OPCODE && strcmp(OPCODE[i], item) != 0; i++);
+		if (i == NUM_OPCODE) break;
+		WEIGHT[i] = atoi(colon + 1);
+		if (WEIGHT[i] < 0) break;
+	}
+	free(copy);
+	return item ? -1 : 0;
+}
+
+static void usage(char * prgName){
+	printf("Usage: %s [--lines=N] [--labels=P] [--forward=P] [--comments=P] [--mix=op:w,...] [--seed=N] [output]\n", prgName);
+	printf("       P is a fraction in [0,1]. Defaults: 10000 lines, labels 0.3, forward 0.5, comments 0.2\n");
+	exit(4);
+}
+
+int main(int argc, char* argv[]) {
+	gen_options opt;
+	FILE * out = stdout;
+	char * oFileName = NULL;
+	int i;
+
+	opt.lines = 10000;
+	opt.label_density = 0.3;
+	opt.forward = 0.5;
+	opt.comments = 0.2;
+	opt.seed = 1;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--lines=", 8) == 0) opt.lines = atol(argv[i] + 8);
+		else if (strncmp(argv[i], "--labels=", 9) == 0) opt.label_density = atof(argv[i] + 9);
+		else if (strncmp(argv[i], "--forward=", 10) == 0) opt.forward = atof(argv[i] + 10);
+		else if (strncmp(argv[i], "--comments=", 11) == 0) opt.comments = atof(argv[i] + 11);
+		else if (strncmp(argv[i], "--seed=", 7) == 0) opt.seed = strtoul(argv[i] + 7, NULL, 10);
+		else if (strncmp(argv[i], "--mix=", 6) == 0) {
+			if (set_mix(argv[i] + 6) != 0) usage(argv[0]);
+		}
+		else if (argv[i][0] == '-' || oFileName) usage(argv[0]);
+		else oFileName = argv[i];
+	}
+	if (opt.lines < 3) usage(argv[0]);
+
+	if (oFileName) {
+		out = fopen(oFileName, "w");
+		if (!out) {
+			printf("Error: annot open file %s\n",oFileName);
+			exit(4);
+		}
+	}
+	generate(out, &opt);
+	if (out != stdout) fclose(out);
+	return 0;
+}
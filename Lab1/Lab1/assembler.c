@@ -8,766 +8,840 @@ Created by Bryan Wang on 1/28/16.
 #include <stdio.h> /* standard input/output library */
 #include <stdlib.h> /* Standard C Library */
 #include <string.h> /* String operations library */
-#include <ctype.h> /* Library for useful character operations */
-#include <limits.h> /* Library for definitions of common variable type characteristics */
-#include <stdint.h>
+#include <unistd.h> /* sysconf */
+#include <pthread.h> /* batch worker pool */
+#include <dirent.h>
+#include <fcntl.h> /* open */
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h> /* --watch */
+#endif
+#include "assembler.h"
+#include "simulator.h" /* --run */
+#include "server.h" /* --serve, --connect */
 
-#define MAX_LINE_LENGTH 255
-#define NUM_OPCODE 28
-#define NUM_PSEUDO_OP 3
-#define MAX_LABEL_LEN 20
-#define MAX_SYMBOLS 255
+#define RUN_LIMIT 10000000 /* default instruction limit of --run */
 
+/*One input of a batch run*/
+typedef struct {
+	char * in_path;
+	char * out_path;
+	int code; /*exit code of the job*/
+	asm_error err;
+	asm_error * errors; /*--max-errors: every error of the job, err first*/
+	int nerrors;
+}batch_job;
 
-/*OK: One line read finished*/
-/*DONE: Whole file read finished*/
-/*EMPTY_LINE:*/
-enum{DONE, OK, EMPTY_LINE};
+/*Work-stealing deque of job indices. The owner pops from the bottom, thieves take from the top*/
+typedef struct {
+	pthread_mutex_t lock;
+	int * items;
+	int top, bottom; /*items[top..bottom) are still pending*/
+}job_deque;
 
-static char *  OPCODE[NUM_OPCODE] = {"add", "and","br","brn","brz","brp","brzp","brnp","brnz","brnzp","halt", "jmp","jsr", "jsrr", "ldb", "ldw", "lea", "nop", "not", "ret", "rti", "lshf", "rshfl", "rshfa", "stb", "stw", "trap", "xor"};
-static char * PSEUDO_OP[NUM_PSEUDO_OP] = {".orig", ".fill", ".end"};
+typedef struct {
+	batch_job * jobs;
+	job_deque * deques;
+	int nworkers;
+	int one_pass;
+	int relocatable;
+	int max_errors;
+	const asm_format * fmt;
+	asm_stats * stats; /*one per worker, NULL if not timed*/
+}batch_pool;
 
 typedef struct {
-	char label[MAX_LABEL_LEN+1]; /*Label name*/
-	int addr; /*instruction count*/
-}label_addr_table;
+	batch_pool * pool;
+	int id;
+	pthread_t thread;
+}batch_worker;
 
-/* **********isOpcode*****************
-Check whether the string is valid OpCode, return -1 if not, return position in the list if it is.
-************************************************ */
-int isOpcode(char * const ptr){
-	if (ptr) {
-		int i;
-		for (i = 0; i < NUM_OPCODE; i++) {
-			if (strcmp(ptr, OPCODE[i]) == 0) {
-				return i;
-			}
-		}
-	}
-	return -1;
+int deque_pop(job_deque * dq){
+	int idx = -1;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->top < dq->bottom) idx = dq->items[--dq->bottom];
+	pthread_mutex_unlock(&dq->lock);
+	return idx;
 }
 
-/* **********isPseudoOp*****************
-// Check whether the string is valid PseudoOpCode, return -1 if not, return position in the list if it is.
-************************************************ */
-int isPseudoOp(char * const ptr){
-	if (ptr) {
-		int i;
-		for (i = 0; i < NUM_PSEUDO_OP; i++) {
-			if (strcmp(ptr, PSEUDO_OP[i]) == 0) {
-				return i;
-			}
-		}
-	}
-	return -1;
-	
+int deque_steal(job_deque * dq){
+	int idx = -1;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->top < dq->bottom) idx = dq->items[dq->top++];
+	pthread_mutex_unlock(&dq->lock);
+	return idx;
 }
 
-/* **********toNum*****************
- Convert string of # or x number into int
+/* **********batch_worker_main*****************
+ Drain the worker's own deque, then steal from the others until every deque is empty.
+ No jobs are added once the pool starts, so one empty sweep means the batch is done
 ************************************************ */
-int toNum( char * pStr ){
-	char * t_ptr;
-	char * orig_pStr;
-	int t_length,k;
-	int lNum, lNeg = 0;
-	long int lNumLong;
-	
-	orig_pStr = pStr;
-	if( *pStr == '#' ) /* decimal */
-	{
-		pStr++;
-		if( *pStr == '-') /* dec is negative */
-		{
-			lNeg = 1;
-			pStr++;
-		}
-		t_ptr = pStr;
-		t_length = strlen(t_ptr);
-		for(k = 0;k < t_length;k++)
-		{
-			if (!isdigit(*t_ptr))
-			{
-				printf("Error: invalid decimal operand, %s\n",orig_pStr);
-				exit(4);
-			}
-			t_ptr++;
+void * batch_worker_main(void * arg){
+	batch_worker * w = arg;
+	batch_pool * pool = w->pool;
+	asm_ctx * ctx = asm_ctx_create();
+	asm_options opts;
+	asm_error err;
+	int idx, i;
+	if (!ctx) {
+		printf("Error: out of memory\n");
+		exit(4);
+	}
+	opts.one_pass = pool->one_pass;
+	opts.threads = 1; /*the pool already keeps every core busy*/
+	opts.relocatable = pool->relocatable;
+	opts.include_dir = NULL;
+	opts.diag_level = ASM_DIAG_QUIET;
+	opts.diag = NULL;
+	opts.stats = pool->stats ? &pool->stats[w->id] : NULL;
+	opts.max_errors = pool->max_errors;
+	opts.optimize = 0;
+	for (;;) {
+		idx = deque_pop(&pool->deques[w->id]);
+		for (i = 1; idx < 0 && i < pool->nworkers; i++) {
+			idx = deque_steal(&pool->deques[(w->id + i) % pool->nworkers]);
 		}
-		lNum = atoi(pStr);
-		if (lNeg)
-			lNum = -lNum;
-			return lNum;
-			}
-		else if( *pStr == 'x' || *pStr == 'X') /* hex */
-		{
-			pStr++;
-			if( *pStr == '-') /* hex is negative */
-		{
-			lNeg = 1;
-			pStr++;
-		}
-		t_ptr = pStr;
-		t_length = strlen(t_ptr);
-		for(k = 0;k < t_length;k++)
-		{
-			if (!isxdigit(*t_ptr))
-			{
-				printf("Error: invalid hex operand, %s\n",orig_pStr);
-				exit(4);
+		if (idx < 0) break;
+		pool->jobs[idx].code = asm_assemble_file(ctx, pool->jobs[idx].in_path, pool->jobs[idx].out_path, pool->fmt, &opts, &err);
+		pool->jobs[idx].err = err;
+		if (pool->jobs[idx].code && pool->max_errors > 1) {
+			/*the list belongs to ctx and is overwritten by the next job*/
+			int n;
+			const asm_error * errors = asm_get_errors(ctx, &n);
+			pool->jobs[idx].errors = malloc(n * sizeof(asm_error));
+			if (pool->jobs[idx].errors) {
+				memcpy(pool->jobs[idx].errors, errors, n * sizeof(asm_error));
+				pool->jobs[idx].nerrors = n;
 			}
-			t_ptr++;
-		}
-		lNumLong = strtol(pStr, NULL, 16); /* convert hex string into integer */
-		lNum = (lNumLong > INT_MAX)? INT_MAX : lNumLong;
-		if( lNeg )
-			lNum = -lNum;
-			return lNum;
-			}
-		else
-		{
-			printf( "Error: invalid operand, %s\n", orig_pStr);
-			exit(4);
-			/*This has been changed from error code 3 to error code 4, see clarification 12 */
 		}
+	}
+	asm_ctx_destroy(ctx);
+	return NULL;
+}
+
+/*Add the timings of one worker to the batch total*/
+void add_stats(asm_stats * total, const asm_stats * part){
+	int i;
+	for (i = 0; i < ASM_NUM_PHASES; i++) {
+		total->seconds[i] += part->seconds[i];
+		total->cycles[i] += part->cycles[i];
+		total->instructions[i] += part->instructions[i];
+		total->cache_misses[i] += part->cache_misses[i];
+	}
+	total->have_counters |= part->have_counters;
+	total->lines += part->lines;
+	total->words += part->words;
 }
 
-/* **********check_label*****************
-// Check whether the label name is legal
+/* **********run_batch*****************
+ Assemble every job on nworkers threads. If stats is given, the workers' timings are added to it
 ************************************************ */
-void check_label(char * label){
-	if(*label == '\0') return;
-	if (label[0] == 'x' || (label[0] >= '0'&& label[0] <= '9')) {
-		printf("Error: Labels can't start with 'x' or numbers\n");/*Error 4*/
+void run_batch(batch_job * jobs, int njobs, int nworkers, int one_pass, int relocatable, int max_errors, const asm_format * fmt,
+			   asm_stats * stats){
+	batch_pool pool;
+	batch_worker * workers;
+	int i, j;
+	if (nworkers > njobs) nworkers = njobs;
+	if (nworkers < 1) nworkers = 1;
+	pool.jobs = jobs;
+	pool.nworkers = nworkers;
+	pool.one_pass = one_pass;
+	pool.relocatable = relocatable;
+	pool.max_errors = max_errors;
+	pool.fmt = fmt;
+	pool.deques = calloc(nworkers, sizeof(job_deque));
+	pool.stats = stats ? calloc(nworkers, sizeof(asm_stats)) : NULL;
+	workers = calloc(nworkers, sizeof(batch_worker));
+	if (!pool.deques || !workers || (stats && !pool.stats)) {
+		printf("Error: out of memory\n");
 		exit(4);
 	}
-	if(isOpcode(label) > -1 || isPseudoOp(label) > -1){
-		printf("Error: Label name can't contain opcode/pseudo op\n"); /*Error 4*/
-		exit(4);
+	for (i = 0; i < nworkers; i++) {
+		job_deque * dq = &pool.deques[i];
+		int lo = (int)((long)njobs * i / nworkers), hi = (int)((long)njobs * (i + 1) / nworkers);
+		pthread_mutex_init(&dq->lock, NULL);
+		dq->items = malloc((hi - lo + 1) * sizeof(int));
+		if (!dq->items) {
+			printf("Error: out of memory\n");
+			exit(4);
+		}
+		for (j = lo; j < hi; j++) dq->items[j - lo] = j;
+		dq->top = 0;
+		dq->bottom = hi - lo;
 	}
-	if(strcmp(label, "in") == 0 || strcmp(label, "out") == 0 || strcmp(label, "getc") == 0 ||strcmp(label, "puts") == 0){
-		printf("Error: Label name can't contain in/out/getc/puts\n"); /*Error 4*/
-		exit(4);
+	for (i = 0; i < nworkers; i++) {
+		workers[i].pool = &pool;
+		workers[i].id = i;
+		if (stats) pool.stats[i].counters = stats->counters;
 	}
-	if (strlen(label) == 2 && label[0] == 'r' && (label[1] < 8 && label[1]>=0 )) {
-		printf("Error, label cannot be a name of Register\n");
-		exit(4);
-	}
-	int i;
-	for (i = 0;i < strlen(label);i++){
-		if (isalnum(label[i]) == 0) { /*isalnum == 0 -> not a alphanumeric value*/
-			printf("Error: Label name can only contain alphanumeric chars\n"); /*Error 4*/
+	/*worker 0 runs on the calling thread*/
+	for (i = 1; i < nworkers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, batch_worker_main, &workers[i]) != 0) {
+			printf("Error: cannot start worker thread\n");
 			exit(4);
 		}
 	}
+	batch_worker_main(&workers[0]);
+	for (i = 1; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_mutex_destroy(&pool.deques[i].lock);
+		free(pool.deques[i].items);
+	}
+	for (i = 0; stats && i < nworkers; i++) {
+		add_stats(stats, &pool.stats[i]);
+	}
+	free(pool.stats);
+	free(pool.deques);
+	free(workers);
 }
 
-/* **********read_reg*****************
- Use the reg string pointer to extract register number and return it. (R3 -> 3)
+/* **********batch_out_path*****************
+ Output name for an input without an explicit one: the input name with its extension replaced
+ by ext, placed in out_dir if given
 ************************************************ */
-int read_reg(char * reg){
-	int reg_num = atoi(&reg[1]);
-	if (reg[0] != 'r') {
-		printf("Error: Wrong Register name\n");
+char * batch_out_path(const char * in_path, const char * out_dir, const char * ext){
+	const char * slash = strrchr(in_path, '/');
+	const char * base = (out_dir && slash) ? slash + 1 : in_path; /*out_dir keeps only the file name*/
+	const char * dot = strrchr(base, '.');
+	size_t stem = (dot && dot > strrchr(base, '/')) ? (size_t)(dot - base) : strlen(base);
+	char * out = malloc((out_dir ? strlen(out_dir) + 1 : 0) + stem + strlen(ext) + 2);
+	if (!out) {
+		printf("Error: out of memory\n");
 		exit(4);
 	}
-	if (reg[2] != '\0' || reg_num > 7) {
-		printf("Error: Reg too large\n");
-		exit(4);
+	if (out_dir) sprintf(out, "%s/%.*s.%s", out_dir, (int)stem, base, ext);
+	else sprintf(out, "%.*s.%s", (int)stem, base, ext);
+	return out;
+}
+
+batch_job * grow_jobs(batch_job * jobs, int * cap, int need){
+	if (need > *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		jobs = realloc(jobs, *cap * sizeof(batch_job));
+		if (!jobs) {
+			printf("Error: out of memory\n");
+			exit(4);
+		}
 	}
-	return reg_num;
+	return jobs;
 }
 
-/* **********check_word_align*****************
-Check whether the address is word aligned. Return 0 if aligned
-************************************************ */
-int check_word_align(int num){/* 1-> odd, not align*/
-	return num % 2;
+int cmp_job_path(const void * a, const void * b){
+	return strcmp(((const batch_job *)a)->in_path, ((const batch_job *)b)->in_path);
 }
 
-/* **********check_8bit_unsigned*****************
- Check whether the number is in the range of 8 bit unsigned int, for trap vector
+/* **********collect_batch*****************
+ Build the job list from a directory (every *.asm file in it) or a manifest file
+ (one "input [output]" per line, blank lines and lines starting with '#' are skipped)
 ************************************************ */
-void check_8bit(int num){
-	if (num > 255 || num < 0) {
-		printf("Error: 8 bit unsigned number overflow\n"); /*Error 3*/
-		exit(3);
+batch_job * collect_batch(const char * path, const char * out_dir, const char * ext, int * njobs){
+	batch_job * jobs = NULL;
+	int cap = 0, n = 0;
+	DIR * dir = opendir(path);
+	if (dir) {
+		struct dirent * de;
+		while ((de = readdir(dir)) != NULL) {
+			size_t len = strlen(de->d_name);
+			if (len <= 4 || strcmp(de->d_name + len - 4, ".asm") != 0) continue;
+			jobs = grow_jobs(jobs, &cap, n + 1);
+			memset(&jobs[n], 0, sizeof(batch_job));
+			jobs[n].in_path = malloc(strlen(path) + len + 2);
+			if (!jobs[n].in_path) {
+				printf("Error: out of memory\n");
+				exit(4);
+			}
+			sprintf(jobs[n].in_path, "%s/%s", path, de->d_name);
+			jobs[n].out_path = batch_out_path(jobs[n].in_path, out_dir, ext);
+			n++;
+		}
+		closedir(dir);
+		if (n) qsort(jobs, n, sizeof(batch_job), cmp_job_path);
 	}
+	else {
+		FILE * manifest = fopen(path, "r");
+		char * line = NULL;
+		size_t linecap = 0;
+		if (!manifest) {
+			printf("Error: annot open file %s\n",path);
+			exit(4);
+		}
+		while (getline(&line, &linecap, manifest) > 0) {
+			char * save;
+			char * in = strtok_r(line, " \t\r\n", &save);
+			char * out = in ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+			if (!in || in[0] == '#') continue;
+			jobs = grow_jobs(jobs, &cap, n + 1);
+			memset(&jobs[n], 0, sizeof(batch_job));
+			jobs[n].in_path = strdup(in);
+			jobs[n].out_path = out ? strdup(out) : batch_out_path(in, out_dir, ext);
+			if (!jobs[n].in_path || !jobs[n].out_path) {
+				printf("Error: out of memory\n");
+				exit(4);
+			}
+			n++;
+		}
+		free(line);
+		fclose(manifest);
+	}
+	*njobs = n;
+	return jobs;
 }
 
-/* **********check_4bit_unsigned*****************
- Check whether the number is in the range of 4 bit unsigned int
+/* **********read_file*****************
+ Read the whole file into *buf (grown as needed). Return its length, -1 if it cannot be read
 ************************************************ */
-void check_4bit(int num){
-	if (num > 15 || num < 0) {
-		printf("Error: 4 bit unsigned number overflow\n"); /*Error 3*/
-		exit(3);
+long read_file(const char * path, char ** buf, size_t * cap){
+	int fd = open(path, O_RDONLY);
+	size_t len = 0;
+	ssize_t n = 1;
+	if (fd < 0) return -1;
+	while (n > 0) {
+		if (len == *cap) {
+			*cap = *cap ? *cap * 2 : 1 << 16;
+			*buf = realloc(*buf, *cap);
+			if (!*buf) {
+				printf("Error: out of memory\n");
+				exit(4);
+			}
+		}
+		n = read(fd, *buf + len, *cap - len);
+		if (n > 0) len += n;
 	}
+	close(fd);
+	return n < 0 ? -1 : (long)len;
 }
 
-/* **********check_5bit*****************
- Check whether the number is in the range of 5 bit signed int
+/* **********print_errors*****************
+ --max-errors: every error of one assembly, with its place in in_path
 ************************************************ */
-int check_5bit(int num){
-	if (num >= 16 || num < -16) {
-		printf("Error: 5 bit number overflow\n");
-		exit(3);
+void print_errors(const char * in_path, const asm_error * errors, int n, int max_errors){
+	int i;
+	for (i = 0; i < n; i++) {
+		printf("%s:%d:%d: exit %d: %s", in_path, errors[i].line, errors[i].column, errors[i].code, errors[i].message);
 	}
-	else
-		if (num < 0) {
-			return num + 32;
-		}
-	return num;
+	printf("%d error%s%s\n", n, n == 1 ? "" : "s", n >= max_errors ? " (--max-errors reached)" : "");
 }
 
-/* **********check_6bit*****************
- Check whether the number is in the range of 6 bit signed int
+/* **********watch_build*****************
+ One build of watch mode: reassemble the input on ctx and write the output. Return the error code
 ************************************************ */
-int check_6bit(int num){
-	if (num >= 32 || num < -32) {
-		printf("Error: 6 bit number overflow\n");
-		exit(3);
+int watch_build(asm_ctx * ctx, const char * iFileName, const char * oFileName, const asm_format * fmt,
+				const asm_options * opts, const char * cacheFileName){
+	static char * src = NULL;
+	static size_t src_cap = 0;
+	static uint16_t * words = NULL;
+	static size_t words_cap = 0;
+	struct timespec t0, t1;
+	asm_error err;
+	size_t nwords = 0;
+	long len = read_file(iFileName, &src, &src_cap);
+	int code, fd;
+	if (len < 0) {
+		printf("Error: annot open file %s\n",iFileName);
+		return 4;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	code = asm_reassemble(ctx, src, len, opts, words, words_cap, &nwords, &err);
+	if (code == ASM_ERR_OTHER && nwords > words_cap) {
+		/*first build, or the program grew: unchanged source, so this run is cheap*/
+		words_cap = nwords * 2;
+		words = realloc(words, words_cap * sizeof(uint16_t));
+		if (!words) {
+			printf("Error: out of memory\n");
+			exit(4);
+		}
+		code = asm_reassemble(ctx, src, len, opts, words, words_cap, &nwords, &err);
 	}
-	else
-		if (num < 0) {
-			return num + 64;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (code) {
+		if (opts->diag_level >= ASM_DIAG_ERROR && opts->max_errors > 1) {
+			int n;
+			const asm_error * errors = asm_get_errors(ctx, &n);
+			print_errors(iFileName, errors, n, opts->max_errors);
 		}
-	return num;
+		else if (opts->diag_level >= ASM_DIAG_ERROR) printf("%s:%d:%d: exit %d: %s", iFileName, err.line, err.column, code, err.message);
+		fflush(stdout);
+		return code;
+	}
+	fd = open(oFileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || asm_write_image(fd, fmt, words, (int)nwords) != 0) {
+		printf("Error: annot write file %s\n",oFileName);
+		code = 4;
+	}
+	if (fd >= 0) close(fd);
+	if (cacheFileName) asm_cache_save(ctx, cacheFileName);
+	if (!code && opts->diag_level >= ASM_DIAG_ERROR) {
+		printf("Assembled %s: %zu words in %.3f ms\n", iFileName, nwords,
+			   (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6);
+	}
+	fflush(stdout);
+	return code;
 }
 
-/* **********check_9bit*****************
-Check whether the number is in the range of 9 bit signed int
+/* **********watch*****************
+ Assemble the input, then again every time it is written or replaced (editors often save by
+ renaming a new file over the old one, so the directory is watched). Runs until killed
 ************************************************ */
-int check_9bit(int num){
-	if (num >= 256 || num < -256) {
-		printf("Error: 9 bit number overflow\n");
-		exit(3);
+int watch(const char * iFileName, const char * oFileName, const asm_format * fmt,
+		  const asm_options * opts, const char * cacheFileName){
+#ifdef __linux__
+	const char * slash = strrchr(iFileName, '/');
+	const char * base = slash ? slash + 1 : iFileName;
+	char * dir = slash ? strndup(iFileName, slash - iFileName + 1) : strdup(".");
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	asm_ctx * ctx = asm_ctx_create();
+	asm_options wopts = *opts;
+	int ifd = inotify_init1(IN_CLOEXEC);
+	if (!ctx || !dir) {
+		printf("Error: out of memory\n");
+		exit(4);
+	}
+	if (ifd < 0 || inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		printf("Error: cannot watch %s\n", dir);
+		exit(4);
 	}
-	else
-		if (num < 0) {
-			return num + 512;
+	wopts.include_dir = dir; /*.include paths are relative to the watched file*/
+	if (cacheFileName) asm_cache_load(ctx, cacheFileName);
+	watch_build(ctx, iFileName, oFileName, fmt, &wopts, cacheFileName);
+	for (;;) {
+		ssize_t n = read(ifd, events, sizeof(events));
+		ssize_t off;
+		int hit = 0;
+		if (n <= 0) break;
+		for (off = 0; off < n; off += sizeof(struct inotify_event) + ((struct inotify_event *)(events + off))->len) {
+			const struct inotify_event * ev = (const struct inotify_event *)(events + off);
+			if (ev->len && strcmp(ev->name, base) == 0) hit = 1;
 		}
-	return num;
+		if (hit) watch_build(ctx, iFileName, oFileName, fmt, &wopts, cacheFileName);
+	}
+	close(ifd);
+	free(dir);
+	asm_ctx_destroy(ctx);
+	return 4;
+#else
+	printf("Error: --watch needs inotify (Linux)\n");
+	return 4;
+#endif
 }
 
-int check_11bit(int num){
-	if (num >= 1024 || num < -1024) {
-		printf("Error: 9 bit number overflow\n");
-		exit(3);
+/* **********run_program*****************
+ --run: execute the image just assembled, at most limit instructions, and print the machine state.
+ Return the exit code
+************************************************ */
+int run_program(asm_ctx * ctx, unsigned long long limit, int quiet){
+	size_t nwords;
+	const uint16_t * words = asm_get_image(ctx, &nwords);
+	sim_machine * m = malloc(sizeof(sim_machine));
+	int why;
+	if (!m) {
+		printf("Error: out of memory\n");
+		return 4;
 	}
-	else
-		if (num < 0) {
-			return num + 2048;
-		}
-	return num;
+	sim_load(m, words, nwords);
+	why = sim_run(m, limit, 0);
+	if (!quiet) {
+		sim_print_state(m, stdout);
+		if (why == SIM_ILLEGAL) printf("Error: illegal opcode at 0x%.4x\n", m->pc);
+		else if (why != SIM_HALTED) printf("Error: program did not halt in %llu instructions\n", limit);
+	}
+	free(m);
+	return why == SIM_HALTED ? 0 : 4;
 }
 
-int check_16bit(int num){
-	if (num >= 32768 || num < -32768) {
-		printf("Error: 16 bit number overflow\n");
-		exit(3);
+/* **********write_debug*****************
+ --debug: write the debug sidecar of the image just assembled and, for --listing, print the
+ listing rendered from it. Return the exit code
+************************************************ */
+int write_debug(asm_ctx * ctx, const char * debugFileName, const char * iFileName, int listing){
+	asm_debug * dbg;
+	char * src = NULL;
+	size_t src_cap = 0;
+	long len;
+	int code = 0;
+	if (asm_write_debug(ctx, debugFileName, iFileName) != 0) {
+		printf("Error: annot write file %s\n",debugFileName);
+		return 4;
 	}
-	else
-		if (num < 0) {
-			return num + 65536;
-		}
-	return num;
+	if (!listing) return 0;
+	dbg = asm_debug_open(debugFileName);
+	if (!dbg) {
+		printf("Error: annot open file %s\n",debugFileName);
+		return 4;
+	}
+	len = strcmp(iFileName, "-") == 0 ? -1 : read_file(iFileName, &src, &src_cap); /*stdin is gone, list labels*/
+	if (asm_debug_listing(dbg, len < 0 ? NULL : src, len < 0 ? 0 : (size_t)len, stdout) != 0) code = 4;
+	asm_debug_close(dbg);
+	free(src);
+	return code;
 }
 
-int find_label( label_addr_table * table, char * label, int current_inst, int num_label){
-	int label_inst = 0;
-	int i;
-	for (i = 0; i < num_label; i++) {
-		if (strcmp(table[i].label, label) == 0) {
-			label_inst = table[i].addr;
+/* **********run_client*****************
+ --connect: have the server at sock_path assemble the input (sent inline, or its absolute path
+ with by_path) and write the output, or run one of its commands. Return the exit code
+************************************************ */
+int run_client(const char * sock_path, const char * command, const char * iFileName, const char * oFileName,
+			   const asm_format * fmt, int by_path, int one_pass, int max_errors, int quiet){
+	int fd = srv_connect(sock_path);
+	srv_reply reply;
+	char * src = NULL;
+	size_t src_cap = 0;
+	long len;
+	int code, out;
+	if (fd < 0) {
+		printf("Error: no server on %s\n", sock_path);
+		return 4;
+	}
+	if (command) {
+		if (srv_command(fd, command, &reply) != 0) {
+			printf("Error: server on %s did not answer\n", sock_path);
+			close(fd);
+			return 4;
 		}
+		if (!quiet) fwrite(reply.body, 1, reply.body_len, stdout);
+		srv_reply_free(&reply);
+		close(fd);
+		return 0;
 	}
-	if (label_inst == 0) {
-		printf("Error: Label %s can't find.\n", label);
-		exit(1);
+	if (by_path) {
+		src = realpath(iFileName, NULL); /*the server need not share our working directory*/
+		len = src ? (long)strlen(src) : -1;
 	}
-	printf("Origin %d, current %d, instruction \"%s\"\n",label_inst,current_inst,label);
-	return label_inst - current_inst - 1;
-}
-
-void check_label_duplicate( label_addr_table * table, char * label, int num_label){
-	int i;
-	for (i = 0; i < num_label; i++) {
-		if(strcmp(table[i].label, label) == 0){
-			printf("Error: label duplicate in the table.\n");
-			exit(4);
+	else len = strcmp(iFileName, "-") == 0 ? -1 : read_file(iFileName, &src, &src_cap);
+	if (len < 0) {
+		printf("Error: annot open file %s\n",iFileName);
+		close(fd);
+		return 4;
+	}
+	if (srv_assemble(fd, fmt->name, by_path, src, len, one_pass, max_errors, &reply) != 0) {
+		printf("Error: server on %s did not answer\n", sock_path);
+		free(src);
+		close(fd);
+		return 4;
+	}
+	free(src);
+	close(fd);
+	code = reply.code;
+	if (code && !quiet) {
+		if (max_errors > 1) print_errors(iFileName, reply.errors, reply.nerrors, max_errors);
+		else if (reply.nerrors) printf("%s", reply.errors[0].message);
+	}
+	if (!code) {
+		out = open(oFileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out < 0 || write(out, reply.body, reply.body_len) != (ssize_t)reply.body_len) {
+			printf("Error: annot write file %s\n",oFileName);
+			code = 4;
 		}
+		if (out >= 0) close(out);
 	}
+	srv_reply_free(&reply);
+	return code;
 }
 
-int readAndParse( FILE * pInfile, char * pLine, char ** pLabel, char
-             ** pOpcode, char ** pArg1, char ** pArg2, char ** pArg3, char ** pArg4)
-{
-    char * lRet, * lPtr;
-    int i;
-    if( !fgets( pLine, MAX_LINE_LENGTH, pInfile ) )
-        return( DONE ); /*Failed to read a line*/
-	
-	for( i = 0; i < strlen( pLine ); i++ )
-		pLine[i] = tolower( pLine[i] );
-        /* convert entire line to lowercase */
-    
-	*pLabel = *pOpcode = *pArg1 = *pArg2 = *pArg3 = *pArg4 = pLine + strlen(pLine);
-        /* ignore the comments */
-	lPtr = pLine;
-	while( *lPtr != ';' && *lPtr != '\0' && *lPtr != '\n' )
-		lPtr++;
-    
-	*lPtr = '\0';
-	if( !(lPtr = strtok( pLine, "\t\n ," ) ) )
-		return( EMPTY_LINE );
-
-	if( isOpcode( lPtr ) == -1 && lPtr[0] != '.' ) /* found a label */
-		{
-			*pLabel = lPtr;
-			if( !( lPtr = strtok( NULL, "\t\n ," ) ) ) return( OK );
-		}
-	if (isOpcode(lPtr) == -1 && isPseudoOp(lPtr) == -1) {
-		printf("Error: opcode %s is not defined\n",lPtr);
-		exit(2);
-	}
-	*pOpcode = lPtr;
-	if( !( lPtr = strtok( NULL, "\t\n ," ) ) ) return( OK );
-	*pArg1 = lPtr;
-	if( !( lPtr = strtok( NULL, "\t\n ," ) ) ) return( OK );
-	*pArg2 = lPtr;
-	if( !( lPtr = strtok( NULL, "\t\n ," ) ) ) return( OK );
-	*pArg3 = lPtr;
-	if( !( lPtr = strtok( NULL, "\t\n ," ) ) ) return( OK );
-	*pArg4 = lPtr;
-	return( OK );
+/*-O: words before and after the optimize pass and what it changed*/
+void print_opt_report(const asm_opt_report * rep){
+	printf("Optimized: %d -> %d words (%d branches threaded, %d nops and %d branches to the next word dropped, %d branches relaxed)\n",
+		   rep->before, rep->after, rep->threaded, rep->nops, rep->to_next, rep->relaxed);
 }
 
-
+void usage(char * prgName){
+	printf("Usage: %s [--one-pass|-O] [--jobs=N] [--format=hex|bin|obj] [-q|-v|--trace[=FILE]] [--stats] [--run[=N]] [--max-errors=N]\n"
+		   "           [--debug=FILE [--listing]] <input.asm|-> <output>\n", prgName);
+	printf("       %s --batch=<manifest|dir> [--jobs=N] [--out-dir=DIR] [--one-pass] [--format=hex|bin|obj] [-q] [--stats] [--max-errors=N]\n", prgName);
+	printf("       %s -c|--relocatable [--format=...] <input.asm> <output.o>  (also with --batch, outputs *.o)\n", prgName);
+	printf("       %s --link [--format=hex|bin|obj] [-q] <output> <input.o>...\n", prgName);
+	printf("       %s --stream [--format=hex|bin] [-q|-v] [--stats] < input.asm > output\n", prgName);
+	printf("       %s --watch [--cache=FILE] [--format=hex|bin|obj] [-q|-v|--trace[=FILE]] <input.asm> <output>\n", prgName);
+	printf("       %s --serve=SOCKET [--jobs=N] [-q]\n", prgName);
+	printf("       %s --connect=SOCKET [--by-path] [--one-pass] [--format=hex|bin|obj] [-q] [--max-errors=N] <input.asm> <output>\n", prgName);
+	printf("       %s --connect=SOCKET --stats|--shutdown\n", prgName);
+	printf("       -q: exit code only, -v: info messages, --trace: per line trace; both to stderr or FILE\n");
+	printf("       --jobs=N: batch workers, or threads encoding a single large file; default one per core\n");
+	printf("       --max-errors=N: keep going after an error and report up to N of them; the exit code is still the first one's\n");
+	printf("       --run[=N]: execute the program after assembling it, at most N instructions (default %d), and print the registers\n", RUN_LIMIT);
+	printf("       --serve: assemble requests on a Unix socket until --shutdown; --connect --stats: its request latencies\n");
+	printf("       --debug=FILE: write the symbols and the source line of every word to FILE, --listing: print a listing from it\n");
+	printf("       -O: thread branch chains, drop nops and branches to the next word, turn out of range branches into jumps through r7\n");
+	exit(4);
+}
 
 int main(int argc, char* argv[]) {
 	
     char *prgName = NULL;
     char *oFileName = NULL;
 	char *iFileName = NULL;
-    FILE* infile = NULL;
-    FILE* outfile = NULL;
-	
-	char lLine[MAX_LINE_LENGTH+1], *lLable, *Opcode, *lArg1, *lArg2, *lArg3, *lArg4;
-	int lRet;
-	lLable = Opcode = lArg1 = lArg2 = lArg3 = lArg4 = NULL;
+	char *batchPath = NULL;
+	char *outDir = NULL;
+	const asm_format * fmt = asm_find_format("hex");
+	int one_pass = 0, nworkers = 0, i;
+	int diag_level = ASM_DIAG_ERROR, want_stats = 0;
+	char *diagFileName = NULL;
+	char *cacheFileName = NULL;
+	int want_watch = 0, relocatable = 0, want_link = 0, nlink = 0, want_stream = 0;
+	unsigned long long run_limit = 0;
+	int max_errors = 0;
+	char *debugFileName = NULL;
+	int want_listing = 0;
+	int optimize = 0;
+	char *serveSocket = NULL;
+	char *connectSocket = NULL;
+	int by_path = 0, want_shutdown = 0;
+	const char ** linkFiles = calloc(argc, sizeof(char *));
+	FILE * diag = stderr;
+	asm_stats stats;
 	
     prgName = argv[0];
-	iFileName = argv[1];
-    oFileName = argv[2];
-	
-	
-    infile = fopen(iFileName, "r");
-	outfile = fopen(oFileName, "w");
-	if (!infile) {
-		printf("Error: annot open file %s\n",argv[1]);
+	if (!linkFiles) {
+		printf("Error: out of memory\n");
 		exit(4);
 	}
-	if (!outfile) {
-		printf("Error: annot open file %s\n",argv[2]);
-		exit(4);
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--one-pass") == 0) {
+			one_pass = 1;
+		}
+		else if (strncmp(argv[i], "--format=", 9) == 0) {
+			fmt = asm_find_format(argv[i] + 9);
+			if (!fmt) usage(prgName);
+		}
+		else if (strncmp(argv[i], "--batch=", 8) == 0) {
+			batchPath = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+			nworkers = atoi(argv[i] + 7);
+		}
+		else if (strncmp(argv[i], "--out-dir=", 10) == 0) {
+			outDir = argv[i] + 10;
+		}
+		else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+			diag_level = ASM_DIAG_QUIET;
+		}
+		else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+			diag_level = ASM_DIAG_INFO;
+		}
+		else if (strcmp(argv[i], "--trace") == 0 || strncmp(argv[i], "--trace=", 8) == 0) {
+			diag_level = ASM_DIAG_TRACE;
+			if (argv[i][7] == '=') diagFileName = argv[i] + 8;
+		}
+		else if (strcmp(argv[i], "--stats") == 0) {
+			want_stats = 1;
+		}
+		else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--relocatable") == 0) {
+			relocatable = 1;
+		}
+		else if (strcmp(argv[i], "--link") == 0) {
+			want_link = 1;
+		}
+		else if (strcmp(argv[i], "--watch") == 0) {
+			want_watch = 1;
+		}
+		else if (strcmp(argv[i], "--stream") == 0) {
+			want_stream = 1;
+		}
+		else if (strcmp(argv[i], "--run") == 0 || strncmp(argv[i], "--run=", 6) == 0) {
+			run_limit = argv[i][5] == '=' ? strtoull(argv[i] + 6, NULL, 0) : RUN_LIMIT;
+			if (!run_limit) usage(prgName);
+		}
+		else if (strncmp(argv[i], "--max-errors=", 13) == 0) {
+			max_errors = atoi(argv[i] + 13);
+			if (max_errors < 1) usage(prgName);
+		}
+		else if (strncmp(argv[i], "--debug=", 8) == 0) {
+			debugFileName = argv[i] + 8;
+		}
+		else if (strcmp(argv[i], "--listing") == 0) {
+			want_listing = 1;
+		}
+		else if (strcmp(argv[i], "-O") == 0 || strcmp(argv[i], "--optimize") == 0) {
+			optimize = 1;
+		}
+		else if (strncmp(argv[i], "--serve=", 8) == 0) {
+			serveSocket = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--connect=", 10) == 0) {
+			connectSocket = argv[i] + 10;
+		}
+		else if (strcmp(argv[i], "--by-path") == 0) {
+			by_path = 1;
+		}
+		else if (strcmp(argv[i], "--shutdown") == 0) {
+			want_shutdown = 1;
+		}
+		else if (strncmp(argv[i], "--cache=", 8) == 0) {
+			cacheFileName = argv[i] + 8;
+		}
+		else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			usage(prgName);
+		}
+		else if (want_link) {
+			linkFiles[nlink++] = argv[i]; /*output, then the objects*/
+		}
+		else if (!iFileName) {
+			iFileName = argv[i];
+		}
+		else if (!oFileName) {
+			oFileName = argv[i];
+		}
+		else {
+			usage(prgName);
+		}
 	}
 	
-	uint16_t origin_mem_addr = 0;
-	
-	label_addr_table table[MAX_SYMBOLS] = {0};
+	if (want_listing && !debugFileName) usage(prgName);
+	if (optimize && (batchPath || want_link || want_stream || want_watch || relocatable || one_pass || serveSocket || connectSocket)) {
+		usage(prgName);
+	}
+	if ((serveSocket || connectSocket) && (batchPath || want_link || want_stream || want_watch || relocatable || run_limit || debugFileName)) {
+		usage(prgName);
+	}
+	if ((by_path || want_shutdown) && !connectSocket) usage(prgName);
 	
-	int inst_count = 0;
-	int label_count = 0;
+	if (serveSocket) {
+		if (connectSocket || iFileName) usage(prgName);
+		return srv_serve(serveSocket, nworkers, diag_level >= ASM_DIAG_ERROR ? stdout : NULL);
+	}
 	
+	if (connectSocket) {
+		const char * command = want_shutdown ? "shutdown" : want_stats ? "stats" : NULL;
+		if (command ? iFileName || (want_shutdown && want_stats) : !iFileName || !oFileName) usage(prgName);
+		if (by_path && (command || strcmp(iFileName, "-") == 0)) usage(prgName);
+		return run_client(connectSocket, command, iFileName, oFileName, fmt, by_path, one_pass, max_errors,
+						  diag_level < ASM_DIAG_ERROR);
+	}
+	memset(&stats, 0, sizeof(stats));
+	stats.counters = 1;
+	if (diagFileName) {
+		diag = fopen(diagFileName, "w");
+		if (!diag) {
+			printf("Error: annot open file %s\n",diagFileName);
+			exit(4);
+		}
+	}
 	
-	/*Read instructions line by line 1st Round
-	Bond label to specific address(instruction count)*/
-	do{
-		lRet = readAndParse(infile, lLine, &lLable, &Opcode, &lArg1, &lArg2, &lArg3, &lArg4);
-		if(lRet != DONE && lRet != EMPTY_LINE){
-			inst_count++;
-			printf("NUM of Label: %d\n",label_count);
-			
-			if (lLable) printf("Label : %s\n",lLable);
-			if (Opcode) printf("OP : %s\n",Opcode);
-			if (lArg1) printf("Arg 1 : %s\n",lArg1);
-			if (lArg2) printf("Arg 2 : %s\n",lArg2);
-			if (lArg3) printf("Arg 3 : %s\n",lArg3);
-			if (lArg4) printf("Arg 4 : %s\n\n",lArg4);
-			check_label(lLable);
-			if (*Opcode == '\0') {
-				printf("Error: invalid opcode\n");
-				exit(2);
-			}
-			if (*lLable == '\0' && isPseudoOp(Opcode) == 0 ) {
-				if (origin_mem_addr != 0 || !*lArg1 || *lArg2 || *lArg3 || *lArg4) {
-					printf("Error: .Orig Syntax \n");
-					exit(2);
-				}
-				else {
-					int tmpaddr = toNum(lArg1);
-					if (tmpaddr > UINT16_MAX || tmpaddr < 0) {
-						printf("Error: Address is Out of 16 bit Memory.\n");
-						exit(3);
-					}
-					if(check_word_align(tmpaddr)){
-						printf("Error: Not word alignment\n");
-						exit(3);
-					}
-					else{
-						origin_mem_addr = tmpaddr;
-						printf("Start Addr : 0x%04X\n",origin_mem_addr);
-					}
-				}
-			}
-			if (inst_count > 0 && origin_mem_addr == 0) {
-				printf("Error, ORIG syntax error\n");
-				exit(4);
-			}
-			if (inst_count > 1 && isPseudoOp(Opcode) == 0) {
-				printf("Error, duplicate .orig\n");
-				exit(3);
-			}
-			if (isPseudoOp(Opcode) == 2 ) {
-				if ( *lArg1 != '\0' || *lArg2 != '\0' || *lArg3 != '\0' || *lArg4 != '\0'|| *lLable != '\0'){
-					printf("Error END Syntax \n");
-					exit(4);
-				}
-				
-				else{
-					lRet = DONE;
-					/*printf(".END command = End of Program. Exiting...\n");*/
-				}
-			}
-			if(*lLable){
-				check_label_duplicate(table,lLable,label_count);
-				strcpy(table[label_count].label, lLable);
-				table[label_count].addr = inst_count;
-				(label_count) += 1;
+	if (batchPath) {
+		batch_job * jobs;
+		int njobs, count[5] = {0}, first_fail = 0;
+		if (iFileName || want_watch || want_stream || run_limit || debugFileName) usage(prgName);
+		if (nworkers <= 0) nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = collect_batch(batchPath, outDir, relocatable ? "o" : fmt->name, &njobs);
+		run_batch(jobs, njobs, nworkers, one_pass, relocatable, max_errors, fmt, want_stats ? &stats : NULL);
+		for (i = 0; i < njobs; i++) {
+			count[jobs[i].code]++;
+			if (jobs[i].code && diag_level >= ASM_DIAG_ERROR) {
+				if (jobs[i].nerrors) print_errors(jobs[i].in_path, jobs[i].errors, jobs[i].nerrors, max_errors);
+				else printf("%s:%d:%d: exit %d: %s", jobs[i].in_path, jobs[i].err.line, jobs[i].err.column, jobs[i].code, jobs[i].err.message);
 			}
+			free(jobs[i].errors);
+			if (jobs[i].code && !first_fail) first_fail = jobs[i].code;
+			free(jobs[i].in_path);
+			free(jobs[i].out_path);
 		}
+		printf("Assembled %d files: %d ok, exit 1: %d, exit 2: %d, exit 3: %d, exit 4: %d\n",
+			   njobs, count[0], count[1], count[2], count[3], count[4]);
+		if (want_stats) asm_print_phase_stats(&stats, stdout);
+		free(jobs);
+		return first_fail;
 	}
-	while (lRet != DONE);
 	
-	rewind(infile);
-	printf("Starting 2nd passing\n");
-	inst_count = 0;
-	
-	/*Begin 2nd pass of the file, assume error free, otherwise exit by previous pass*/
-	do{
-		lRet = readAndParse(infile, lLine, &lLable, &Opcode, &lArg1, &lArg2, &lArg3, &lArg4);
-		
-		if(lRet != DONE && lRet != EMPTY_LINE){
-			inst_count++;
-			/*.ORIG*/
-			if(isPseudoOp(Opcode) == 0){
-				fprintf(outfile,"0x%04X\n",origin_mem_addr);
-			}
-			/*.FILL*/
-			else if (isPseudoOp(Opcode) == 1) {
-				if (*lArg1 != '\0' && *lArg2 == '\0' && *lArg3 == '\0' && *lArg4 == '\0') {
-					int fill_inst = toNum(lArg1);
-					fill_inst = check_16bit(fill_inst);
-					
-					fprintf(outfile,"0x%04X\n",fill_inst);
-				}
-				else{
-					printf("Error, missing operand .fill\n");/*Error 4*/
-					exit(4);
-				}
-			}
-			/*.END*/
-			else if (isPseudoOp(Opcode) == 2) {
-				if (*lArg1 == '\0' && *lArg2 == '\0' && *lArg3 == '\0' && *lArg4 == '\0') {
-					lRet = DONE;
-				}
-				else{
-					printf("Error, missing operand .end\n");/*Error 4*/
-					exit(4);
-				}
-			}
-			else if(strcmp(Opcode, "add") == 0 || strcmp(Opcode, "and") == 0 || strcmp(Opcode, "xor") == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0' && *lArg3 != '\0' && *lArg4 == '\0') {
-					int dr = read_reg(lArg1);
-					int sr1 = read_reg(lArg2);
-					int sr2;
-					if (lArg3[0] == 'x' || lArg3[0] == '#') {
-						sr2 = toNum(lArg3);
-						sr2 = check_5bit(sr2);
-						if (strcmp(Opcode, "add") == 0) {
-							fprintf(outfile,"0x%04X\n",0x1000 + (dr<<9) + (sr1<<6) + sr2 + 32);
-						}
-						else if (strcmp(Opcode, "and") == 0){
-							fprintf(outfile,"0x%04X\n",0x5000 + (dr<<9) + (sr1<<6) + sr2 + 32);
-						}
-						else if (strcmp(Opcode, "xor") == 0){
-							fprintf(outfile,"0x%04X\n",0x9000 + (dr<<9) + (sr1<<6) + sr2 + 32);
-						}
-						
-					}
-					else{
-						sr2 = read_reg(lArg3);
-						if (strcmp(Opcode, "add") == 0) {
-							fprintf(outfile,"0x%04X\n",0x1000 + (dr<<9) + (sr1<<6) + sr2);
-						}
-						else if (strcmp(Opcode, "and") == 0){
-							fprintf(outfile,"0x%04X\n",0x5000 + (dr<<9) + (sr1<<6) + sr2);
-						}
-						else if (strcmp(Opcode, "xor") == 0){
-							fprintf(outfile,"0x%04X\n",0x9000 + (dr<<9) + (sr1<<6) + sr2);
-						}
-					}
-				}
-				else{
-					printf("Error: Wrong Syntax for and/and/xor\n");
-					exit(4);
-				}
-			}
-			
-			else if(strncmp(Opcode, "br", 2) == 0){
-				if (*lArg1 != '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0') {
-					int offset = 0;
-					offset = find_label(table, lArg1, inst_count, label_count);
-					offset = check_9bit(offset);
-					switch (strlen(Opcode)) {
-						case 2:
-							fprintf(outfile,"0x%04X\n",offset + 0x0E00);
-							break;
-						case 3:
-							if (Opcode[2] == 'n') {
-								fprintf(outfile,"0x%04X\n",offset + 0x0800);
-							}
-							else if (Opcode[2] == 'z') {
-								fprintf(outfile,"0x%04X\n",offset + 0x0400);
-							}
-							else if (Opcode[2] == 'p') {
-								fprintf(outfile,"0x%04X\n",offset + 0x0200);
-							}
-							break;
-						case 4:
-							if (Opcode[2] == 'n' && Opcode[3] == 'p') {
-								fprintf(outfile,"0x%04X\n",offset + 0x0A00);
-							}
-							else if (Opcode[2] == 'z' && Opcode[3] == 'p') {
-								fprintf(outfile,"0x%04X\n",offset + 0x0600);
-							}
-							else if (Opcode[2] == 'n'&& Opcode[3] == 'z') {
-								fprintf(outfile, "0x%04X\n",offset + 0x0C00);
-							}
-							break;
-						case 5:
-							fprintf(outfile,"0x%04X\n",offset + 0x0E00);
-							break;
-						default:
-							printf("Error: OPCODE Wrong\n");
-							exit(2);
-							break;
-					}
-				}
-				else{
-					printf("Error: Wrong Syntax for br\n");
-					exit(4);
-				}
-			}
-			else if(strcmp(Opcode, "jmp") == 0){
-				if (*lArg1 != '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					int baser = read_reg(lArg1);
-					fprintf(outfile,"0x%04X\n",(baser << 6) + 0xC000);
-				}
-				else{
-					printf("Error: Wrong Syntax for jmp\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "ret") == 0){
-				if (*lArg1 == '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					fprintf(outfile,"0xC1C0\n");
-				}
-				else{
-					printf("Error: Wrong Syntax for ret\n");
-					exit(4);
-				}
-				
-			}
-			else if(strncmp(Opcode, "jsr",3) == 0){
-				if (*lArg1 != '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					if (Opcode[3]  == '\0'){
-						int offset = find_label(table, lArg1, inst_count, label_count);
-						offset = check_11bit(offset);
-						fprintf(outfile,"0x%04X\n",offset + 0x4800);
-					}
-					else{
-						int baser = read_reg(lArg1);
-						fprintf(outfile,"0x%04X\n",(baser << 6) + 0x4000);
-					}
-				}
-				else{
-					printf("Error: Wrong Syntax for jsr/jsrr\n");
-					exit(4);
-				}
-				
-			}
-			else if(strncmp(Opcode, "ld" , 2) == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0'&& *lArg3 != '\0'&& *lArg4 == '\0'){
-					int dr = read_reg(lArg1);
-					int baser = read_reg(lArg2);
-					int offset6 = toNum(lArg3);
-					offset6 = check_6bit(offset6);
-					if (Opcode[2] == 'b') {
-						fprintf(outfile,"0x%04X\n",(dr << 9) + (baser << 6) + 0x2000 + offset6);
-					}
-					else if(Opcode[2] == 'w'){
-						fprintf(outfile,"0x%04X\n",(dr << 9) + (baser << 6) + 0x6000 + offset6);
-					}
-					
-				}
-				else{
-					printf("Error: Wrong Syntax for ldb/ldw\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "lea") == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					int dr = read_reg(lArg1);
-					int offset9 = find_label(table, lArg2, inst_count, label_count);;
-					offset9 = check_9bit(offset9);
-					fprintf(outfile,"0x%04X\n",(dr << 9) + 0xE000 + offset9);
-				}
-				else{
-					printf("Error: Wrong Syntax for lea\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "not") == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					int dr = read_reg(lArg1);
-					int sr = read_reg(lArg2);
-					fprintf(outfile,"0x%04X\n",(dr << 9) + (sr << 6) + 0x903F);
-				}
-				else{
-					printf("Error: Wrong Syntax for not\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "rti") == 0){
-				if (*lArg1 == '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					fprintf(outfile,"0x8000\n");
-				}
-				else{
-					printf("Error: Wrong Syntax for rti\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "lshf") == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0'&& *lArg3 != '\0'&& *lArg4 == '\0'){
-					int dr = read_reg(lArg1);
-					int sr = read_reg(lArg2);
-					int amount4 = toNum(lArg3);
-					check_4bit(amount4);
-					fprintf(outfile, "0x%04X\n",(dr << 9) + (sr << 6) + 0xD000 + amount4);
-					
-				}
-				else{
-					printf("Error: Wrong Syntax for lshf\n");
-					exit(4);
-				}
-				
-			}
-			else if(strncmp(Opcode, "rshf" , 4) == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0'&& *lArg3 != '\0'&& *lArg4 == '\0'){
-					int dr = read_reg(lArg1);
-					int sr = read_reg(lArg2);
-					int amount4 = toNum(lArg3);
-					check_4bit(amount4);
-					if (Opcode[4] == 'l') {
-						fprintf(outfile, "0x%04X\n",(dr << 9) + (sr << 6) + 0xD010 + amount4);
-					}
-					else if(Opcode[4] == 'a'){
-						fprintf(outfile, "0x%04X\n",(dr << 9) + (sr << 6) + 0xD030 + amount4);
-					}
-				}
-				else{
-					printf("Error: Wrong Syntax for rshfa/rshfl\n");
-					exit(4);
-				}
-				
-			}
-			else if(strncmp(Opcode, "st" , 2) == 0){
-				if (*lArg1 != '\0' && *lArg2 != '\0'&& *lArg3 != '\0'&& *lArg4 == '\0'){
-					int sr = read_reg(lArg1);
-					int baser = read_reg(lArg2);
-					int offset6 = toNum(lArg3);
-					offset6 = check_6bit(offset6);
-					if (Opcode[2] == 'b') {
-						fprintf(outfile, "0x%04X\n",(sr << 9) + (baser << 6) + 0x3000 + offset6);
-					}
-					else if(Opcode[2] == 'w'){
-						fprintf(outfile, "0x%04X\n",(sr << 9) + (baser << 6) + 0x7000 + offset6);
-					}
-					
-				}
-				else{
-					printf("Error: Wrong Syntax for stb/stw\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "trap") == 0){
-				if (*lArg1 != '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					if (lArg1[0] != 'x' && lArg1[0] != 'X') {
-						printf("Error, trap vector should be a hex.\n");
-					}
-					int trap_vector8 = toNum(lArg1);
-					check_8bit(trap_vector8);
-					fprintf(outfile, "0x%04X\n",0xF000 + trap_vector8);
-				}
-				else{
-					printf("Error: Wrong Syntax for trap\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "halt") == 0){
-				if (*lArg1 == '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					fprintf(outfile,"0x%04X\n",0xF025);
-				}
-				else{
-					printf("Error: Wrong Syntax for halt\n");
-					exit(4);
-				}
-				
-			}
-			else if(strcmp(Opcode, "nop") == 0){
-				if (*lArg1 == '\0' && *lArg2 == '\0'&& *lArg3 == '\0'&& *lArg4 == '\0'){
-					fprintf(outfile,"0x%04X\n",0x0000);
-				}
-				else{
-					printf("Error: Wrong Syntax for nop\n");
-					exit(4);
-				}
-				
-			}
-			
-			
-		
+	if (want_stream) {
+		/*stdin to stdout, so messages and stats go to stderr*/
+		asm_ctx * ctx = asm_ctx_create();
+		asm_options opts;
+		asm_error err;
+		if (iFileName || want_link || want_watch || relocatable || one_pass || run_limit || max_errors || debugFileName) usage(prgName);
+		if (!ctx) {
+			printf("Error: out of memory\n");
+			exit(4);
+		}
+		opts.one_pass = 1;
+		opts.threads = 1;
+		opts.diag_level = diag_level;
+		opts.diag = diag;
+		opts.stats = want_stats ? &stats : NULL;
+		opts.relocatable = 0;
+		opts.include_dir = NULL;
+		opts.max_errors = 0;
+		opts.optimize = 0;
+		if (asm_stream(ctx, STDIN_FILENO, STDOUT_FILENO, fmt, &opts, &err) != ASM_OK) {
+			if (diag_level >= ASM_DIAG_ERROR) fprintf(stderr, "%s", err.message);
+			exit(err.code);
 		}
-		
-		if (isPseudoOp(Opcode) != 2 && lRet == DONE) {
-			printf("Error, no end for the program\n");
+		if (want_stats) asm_print_phase_stats(&stats, stderr);
+		asm_ctx_destroy(ctx);
+		free(linkFiles);
+		return 0;
+	}
+	
+	if (want_link) {
+		asm_ctx * ctx = asm_ctx_create();
+		asm_error err;
+		if (nlink < 2 || batchPath || relocatable || want_watch || run_limit || max_errors || debugFileName) usage(prgName);
+		if (!ctx) {
+			printf("Error: out of memory\n");
 			exit(4);
 		}
-		
+		if (asm_link(ctx, linkFiles + 1, nlink - 1, linkFiles[0], fmt, &err) != ASM_OK) {
+			if (diag_level >= ASM_DIAG_ERROR) printf("%s", err.message);
+			exit(err.code);
+		}
+		asm_ctx_destroy(ctx);
+		free(linkFiles);
+		return 0;
 	}
-	while (lRet != DONE);
 	
+	if (!iFileName || !oFileName) {
+		usage(prgName);
+	}
 	
-    
-    fclose(infile);
-    fclose(outfile);
-	 
-}
\ No newline at end of file
+	{
+		asm_ctx * ctx = asm_ctx_create();
+		asm_options opts;
+		asm_error err;
+		if (!ctx) {
+			printf("Error: out of memory\n");
+			exit(4);
+		}
+		opts.one_pass = one_pass;
+		opts.threads = nworkers;
+		opts.diag_level = diag_level;
+		opts.diag = diag;
+		opts.stats = want_stats ? &stats : NULL;
+		opts.relocatable = relocatable;
+		opts.include_dir = NULL;
+		opts.max_errors = max_errors;
+		opts.optimize = optimize;
+		if ((run_limit || debugFileName) && (relocatable || want_watch)) usage(prgName);
+		if (want_watch) {
+			if (strcmp(iFileName, "-") == 0) usage(prgName);
+			opts.one_pass = 0;
+			opts.relocatable = 0;
+			opts.stats = NULL;
+			asm_ctx_destroy(ctx);
+			exit(watch(iFileName, oFileName, fmt, &opts, cacheFileName));
+		}
+		if (asm_assemble_file(ctx, iFileName, oFileName, fmt, &opts, &err) != ASM_OK) {
+			if (diag_level >= ASM_DIAG_ERROR && max_errors > 1) {
+				int n;
+				const asm_error * errors = asm_get_errors(ctx, &n);
+				print_errors(iFileName, errors, n, max_errors);
+			}
+			else if (diag_level >= ASM_DIAG_ERROR) printf("%s", err.message);
+			exit(err.code);
+		}
+		if (optimize && diag_level >= ASM_DIAG_ERROR) print_opt_report(asm_get_opt_report(ctx));
+		if (want_stats) {
+			asm_print_phase_stats(&stats, stdout);
+			asm_print_stats(ctx, stdout);
+		}
+		if (debugFileName) {
+			int code = write_debug(ctx, debugFileName, iFileName, want_listing);
+			if (code) exit(code);
+		}
+		if (run_limit) {
+			int code = run_program(ctx, run_limit, diag_level < ASM_DIAG_ERROR);
+			if (code) exit(code);
+		}
+		asm_ctx_destroy(ctx);
+	}
+	return 0;
+}
@@ -0,0 +1,209 @@
+/*
+assembler.h
+
+ LC-3b assembler library. Assembles a source buffer (or file) in process; errors are returned
+ instead of terminating the caller.
+
+*/
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASM_MAX_MSG 256
+
+/*Error codes, same values as the command line exit codes*/
+enum{ASM_OK = 0, ASM_ERR_LABEL = 1, ASM_ERR_OPCODE = 2, ASM_ERR_CONSTANT = 3, ASM_ERR_OTHER = 4};
+
+typedef struct {
+	int code; /*ASM_OK or one of ASM_ERR_* */
+	int line; /*1 based source line of the error, 0 if not tied to a line*/
+	int column; /*1 based column of the offending token, 0 if unknown*/
+	char message[ASM_MAX_MSG]; /*same text the command line tool prints*/
+}asm_error;
+
+/*Diagnostic levels, each includes the ones before it. Building with ASM_DIAG_MAX set to a
+ lower level compiles the messages above it out of the library*/
+enum{ASM_DIAG_QUIET, ASM_DIAG_ERROR, ASM_DIAG_INFO, ASM_DIAG_TRACE};
+
+/*Timed phases of one assembly. One-pass runs do all their work in ASM_PHASE_PASS1*/
+enum{ASM_PHASE_LOAD, ASM_PHASE_PASS1, ASM_PHASE_PASS2, ASM_PHASE_OUTPUT, ASM_NUM_PHASES};
+
+/*Wall clock time and, where the OS allows it, hardware counters of each phase.
+ Values add up over every run the struct is passed to*/
+typedef struct {
+	int counters; /*set by the caller to ask for hardware counters*/
+	int have_counters; /*set by the library if they could be read*/
+	double seconds[ASM_NUM_PHASES];
+	uint64_t cycles[ASM_NUM_PHASES];
+	uint64_t instructions[ASM_NUM_PHASES];
+	uint64_t cache_misses[ASM_NUM_PHASES];
+	long lines; /*source lines read*/
+	long words; /*image words, origin included*/
+	long peak_window; /*asm_stream: most words held back at once*/
+}asm_stats;
+
+typedef struct {
+	int one_pass; /*encode while reading, forward references are backpatched*/
+	int threads; /*threads encoding pass 2 of a large input, 0 for one per core, 1 for none*/
+	int diag_level; /*ASM_DIAG_*: info and trace messages up to this level go to diag*/
+	FILE * diag; /*info/trace stream, written in large blocks; NULL for none*/
+	asm_stats * stats; /*phase timings of the run, NULL to skip timing*/
+	int relocatable; /*asm_assemble_file writes a relocatable object for asm_link instead of an image.
+					  Each .orig starts another segment, .global labels are exported, .extern labels are
+					  imported and all others stay local to the file. .fill also takes a label.
+					  Always two passes. Without it .global and .extern are checked and ignored*/
+	const char * include_dir; /*directory .include paths in a buffer are relative to, NULL for the working
+							   directory. asm_assemble_file uses the input file's directory*/
+	int max_errors; /*errors to collect with asm_get_errors, 0 or 1 for the first only. After the first
+					 error the program is read again: every failing line is recorded and skipped, both
+					 passes run to the end. Not for asm_stream*/
+	int optimize; /*between the passes: thread br chains, drop nops and br to the next word, and relax a br
+				   out of offset9 range into a jsr, or lea/ldw/jmp through r7, which it overwrites
+				   (ldw also sets the condition codes).
+				   Addresses written as numbers are not adjusted. Two-pass absolute images only,
+				   not for asm_reassemble*/
+}asm_options;
+
+/*What the optimize pass changed in the last assembly*/
+typedef struct {
+	int before, after; /*words after the .orig word*/
+	int threaded; /*br sent on past unconditional brs*/
+	int nops; /*nops dropped*/
+	int to_next; /*br to the next word dropped*/
+	int relaxed; /*br rewritten into a longer jump*/
+}asm_opt_report;
+
+/*Output backend: exact size of the rendered image and a renderer into a buffer of that size*/
+typedef struct {
+	const char * name;
+	size_t (*size)(const uint16_t * image, int len);
+	void (*render)(char * dst, const uint16_t * image, int len);
+}asm_format;
+
+/*Instructions of the last assembly as parallel arrays, one entry per image word (entry 0 is the
+ .orig word). Owned by the context and valid until its next assembly. A word encodes as
+ opcode bits + regs + imm, plus the PC-relative offset to sym when sym >= 0 (its address for .fill)*/
+typedef struct {
+	int len, cap;
+	uint8_t * op; /*opcode, asm_op_name() gives its mnemonic*/
+	uint16_t * regs; /*register fields, already shifted into place*/
+	int32_t * imm; /*low field: immediate, offset6, shift amount or trap vector; the whole word for .orig/.fill*/
+	int32_t * sym; /*symbol id of a br/jsr/lea target, -1 if none*/
+	int32_t * line; /*1 based source line*/
+	int nsyms;
+	int32_t * sym_addr; /*1 based instruction number each symbol is defined at (entry index + 1), -1 if undefined*/
+	const char ** sym_name; /*lower case symbol names*/
+}asm_ir;
+
+/*Assembler state, reusable from one call to the next. Not shared between threads*/
+typedef struct asm_state asm_ctx;
+
+asm_ctx * asm_ctx_create(void);
+void asm_ctx_destroy(asm_ctx * ctx);
+
+/* **********asm_assemble*****************
+ Assemble len bytes of source into words[0..cap). The first word is the .orig address.
+ *nwords receives the number of words produced (or needed, if cap was too small).
+ Return ASM_OK or the error code, details in *err
+************************************************ */
+int asm_assemble(asm_ctx * ctx, const char * src, size_t len, const asm_options * opts,
+				 uint16_t * words, size_t cap, size_t * nwords, asm_error * err);
+
+/* **********asm_assemble_file*****************
+ Assemble the file in_path ("-" for stdin) and write it to out_path in the given format
+************************************************ */
+int asm_assemble_file(asm_ctx * ctx, const char * in_path, const char * out_path, const asm_format * fmt,
+					  const asm_options * opts, asm_error * err);
+
+/* **********asm_link*****************
+ Link n relocatable objects into one image written to out_path in the given format. Imports are
+ matched by name to the exports of the objects and segments may not overlap. The image starts at the lowest
+ segment; gaps up to the highest are filled with 0
+************************************************ */
+int asm_link(asm_ctx * ctx, const char * const * in_paths, int n, const char * out_path, const asm_format * fmt,
+			 asm_error * err);
+
+/*hex text, raw big-endian binary or object file; NULL if name is unknown*/
+const asm_format * asm_find_format(const char * name);
+
+/* **********asm_write_image*****************
+ Render words in the given format to fd (opened read/write). Return 0 on success
+************************************************ */
+int asm_write_image(int fd, const asm_format * fmt, const uint16_t * words, int len);
+
+/* **********asm_stream*****************
+ Assemble in_fd to out_fd in one pass without holding the whole program: input is read in blocks
+ of whole lines and every word no forward reference is waiting on is written out after each
+ block. Memory is one block, the words after the oldest unresolved forward reference and the
+ symbol table. hex and bin only. On an error the output stops early and the code says so
+************************************************ */
+int asm_stream(asm_ctx * ctx, int in_fd, int out_fd, const asm_format * fmt, const asm_options * opts, asm_error * err);
+
+/* **********asm_reassemble*****************
+ asm_assemble for a source that is edited and assembled again and again on the same ctx.
+ Lines that did not change since the previous asm_reassemble keep their decoded entries and
+ words; only the edited lines are decoded and only words whose label offset moved are encoded.
+ Falls back to a full assembly (same result and errors as asm_assemble) when the edit touches
+ .orig or .end, when there is nothing to reuse, or when the edited program has an error.
+ An edit still costs time linear in the whole source: every line is rehashed to find the edit,
+ the lines after it are renumbered and the symbols and entries are walked to fix addresses.
+ That is about 1.5 ms at 50k lines and 20 ms at 800k, a tenth or less of a full assembly
+************************************************ */
+int asm_reassemble(asm_ctx * ctx, const char * src, size_t len, const asm_options * opts,
+				   uint16_t * words, size_t cap, size_t * nwords, asm_error * err);
+
+/*Save the line cache of the last successful asm_reassemble, or load it into a fresh start so the
+ first asm_reassemble is already incremental. Native byte order. Return 0 on success*/
+int asm_cache_save(asm_ctx * ctx, const char * path);
+int asm_cache_load(asm_ctx * ctx, const char * path);
+
+const asm_ir * asm_get_ir(asm_ctx * ctx);
+
+/*Words of the last assembly, .orig address first, as written to the output. Owned by the context
+ and valid until its next assembly; not kept by asm_stream or for relocatable objects*/
+const uint16_t * asm_get_image(asm_ctx * ctx, size_t * nwords);
+/*Errors of the last assembly, at most max_errors. The first is the one the call returned, which
+ keeps its code; the others follow by line. Valid until the next assembly*/
+const asm_error * asm_get_errors(asm_ctx * ctx, int * n);
+/*Counts of the optimize pass of the last assembly, all 0 if it did not run*/
+const asm_opt_report * asm_get_opt_report(asm_ctx * ctx);
+
+/* **********asm_write_debug*****************
+ Write the debug sidecar of the last assembly to path: the words, the symbols sorted by name and
+ by address and the source line of every word, in a big-endian layout asm_debug_open maps and
+ searches in place. src_name is kept as the source file name. Absolute images from
+ asm_assemble_file or asm_assemble only. Return 0 on success
+************************************************ */
+int asm_write_debug(asm_ctx * ctx, const char * path, const char * src_name);
+
+/*A debug sidecar mapped read-only. Addresses are byte addresses*/
+typedef struct asm_debug asm_debug;
+
+/*Map and check the sidecar at path, NULL if it cannot be read or is not one*/
+asm_debug * asm_debug_open(const char * path);
+void asm_debug_close(asm_debug * dbg);
+/*Source file name given to asm_write_debug*/
+const char * asm_debug_source(const asm_debug * dbg);
+/*1 based source line of the word at addr, 0 if the image has none there. Words of an included
+ file are on the line of the .include*/
+int asm_debug_line(const asm_debug * dbg, int addr);
+/*Address of a label, in any case, -1 if it is not defined*/
+int asm_debug_symbol(const asm_debug * dbg, const char * name);
+/*Closest label at or before addr, *offset set to addr's distance from it; NULL if none*/
+const char * asm_debug_label(const asm_debug * dbg, int addr, int * offset);
+/*Listing of the program: address, word, line and source text, len bytes of src. Without src the
+ labels stand in for the text. Return 0 on success*/
+int asm_debug_listing(const asm_debug * dbg, const char * src, size_t len, FILE * out);
+
+const char * asm_op_name(int op);
+
+/*Symbol table statistics of the last assembly*/
+void asm_print_stats(asm_ctx * ctx, FILE * out);
+
+/*Per phase time, throughput and counters*/
+void asm_print_phase_stats(const asm_stats * stats, FILE * out);
+
+#endif
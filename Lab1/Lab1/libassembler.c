@@ -0,0 +1,4100 @@
+/*
+libassembler.c
+
+ Core of the LC-3b assembler: lexer, symbol table, encoders and output backends.
+ Everything except the public API in assembler.h is static.
+
+Created by Bryan Wang on 1/28/16.
+
+*/
+#include <stdio.h> /* standard input/output library */
+#include <stdlib.h> /* Standard C Library */
+#include <string.h> /* String operations library */
+#include <ctype.h> /* Library for useful character operations */
+#include <limits.h> /* Library for definitions of common variable type characteristics */
+#include <stdint.h>
+#include <fcntl.h> /* open */
+#include <unistd.h> /* read, close */
+#include <sys/mman.h> /* mmap the input file */
+#include <sys/stat.h>
+#include <setjmp.h> /* unwinding out of a failed job */
+#include <stdarg.h>
+#include <time.h> /* phase timers */
+#include <pthread.h> /* parallel pass 2 */
+#ifdef __linux__
+#include <linux/perf_event.h> /* hardware counters for --stats */
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+#if defined(__x86_64__) && !defined(ASM_NO_SIMD)
+#define SCAN_X86 1 /* SSE2/AVX2 source scan, AVX2 picked at run time */
+#include <immintrin.h>
+#endif
+#include "assembler.h"
+
+#define FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c)) /* ASCII lower case */
+#define NUM_OPCODE 28
+#define NUM_PSEUDO_OP 6
+#define NUM_OPS (NUM_OPCODE + NUM_PSEUDO_OP)
+#define OP_HASH_SIZE 64 /* slots in the perfect hash, power of two >= NUM_OPS */
+#define SYMTAB_INIT_CAP 64 /* must be a power of two */
+#define ARENA_BLOCK 4096 /* smallest arena block */
+#define MMAP_WRITE_MIN (1 << 20) /* outputs at least this large are written through a shared mapping */
+#define OBJ_MAGIC "LC3B"
+#define OBJ_VERSION 1
+#define OBJ_HEADER_SIZE 16
+#define REL_MAGIC "LC3R"
+#define REL_VERSION 2
+#define REL_HEADER_SIZE 20
+#define REL_EXPORT 1
+#define REL_IMPORT 2
+#define REL_LOCAL 3 /* resolved inside its module, not seen by the linker */
+#define DBG_MAGIC "LC3D"
+#define DBG_VERSION 1
+#define DBG_HEADER_SIZE 28
+#define MAX_MSG ASM_MAX_MSG
+#define DIAG_BUF_SIZE (64 << 10) /* info/trace output is collected into blocks of this size */
+#define NUM_COUNTERS 3 /* cycles, instructions, cache misses */
+#define PAR_MIN_WORDS (1 << 14) /* smallest slice of pass 2 worth a thread of its own */
+#define PAR_MIN_BYTES (256 << 10) /* smallest slice of pass 1 worth a thread of its own */
+#define PAR_MAX_THREADS 64
+#define STREAM_BLOCK (1 << 20) /* input read per step of asm_stream, grows for longer lines */
+#define STREAM_FLUSH_MIN 4096 /* asm_stream writes once this many words are ready, or half the window */
+#ifndef ASM_DIAG_MAX
+#define ASM_DIAG_MAX ASM_DIAG_TRACE /* highest diagnostic level compiled in */
+#endif
+
+
+/*OK: One line read finished*/
+/*DONE: Whole file read finished*/
+/*EMPTY_LINE:*/
+enum{DONE, OK, EMPTY_LINE};
+
+/*Opcode enum, pseudo ops follow the real opcodes. Order matches OP_NAME.
+ The pseudo ops from OP_INCLUDE on take no instruction slot*/
+enum{OP_ADD, OP_AND, OP_BR, OP_BRN, OP_BRZ, OP_BRP, OP_BRZP, OP_BRNP, OP_BRNZ, OP_BRNZP, OP_HALT, OP_JMP, OP_JSR, OP_JSRR, OP_LDB, OP_LDW, OP_LEA, OP_NOP, OP_NOT, OP_RET, OP_RTI, OP_LSHF, OP_RSHFL, OP_RSHFA, OP_STB, OP_STW, OP_TRAP, OP_XOR,
+	OP_ORIG, OP_FILL, OP_END, OP_INCLUDE, OP_GLOBAL, OP_EXTERN, OP_NONE = -1};
+
+static const char * const OP_NAME[NUM_OPS] = {"add", "and","br","brn","brz","brp","brzp","brnp","brnz","brnzp","halt", "jmp","jsr", "jsrr", "ldb", "ldw", "lea", "nop", "not", "ret", "rti", "lshf", "rshfl", "rshfa", "stb", "stw", "trap", "xor",
+	".orig", ".fill", ".end", ".include", ".global", ".extern"};
+
+/*Operand kinds of the descriptor table*/
+enum{OPK_NONE, /*no more operands*/
+	OPK_REG, /*register, field at the descriptor's shift*/
+	OPK_REG_IMM5, /*register, or a # / x constant as imm5 with bit 5 set*/
+	OPK_IMM6, /*signed offset6*/
+	OPK_AMOUNT4, /*unsigned shift amount*/
+	OPK_LABEL9, /*PC-relative offset9 to a label*/
+	OPK_LABEL11, /*PC-relative offset11 to a label*/
+	OPK_TRAPVECT8, /*unsigned trap vector, written in hex*/
+	OPK_FILL16, /*.fill value, the whole word*/
+	OPK_ORIG /*.orig address, checked by pass 1*/
+};
+
+/*Encoding of one opcode: fixed bits plus up to 3 operands. Constants always go to bit 0*/
+typedef struct {
+	uint16_t bits; /*opcode field, condition codes, constant operand bits*/
+	uint8_t kind[4]; /*operand kinds in source order, OPK_NONE after the last*/
+	uint8_t shift[3]; /*bit position of register operands*/
+	const char * syntax; /*error for a wrong operand count, NULL if not checked here*/
+}op_desc;
+
+#define OPS0(bits, msg) {bits, {OPK_NONE}, {0}, msg}
+#define OPS1(bits, k0, s0, msg) {bits, {k0, OPK_NONE}, {s0}, msg}
+#define OPS2(bits, k0, s0, k1, s1, msg) {bits, {k0, k1, OPK_NONE}, {s0, s1}, msg}
+#define OPS3(bits, k0, s0, k1, s1, k2, s2, msg) {bits, {k0, k1, k2, OPK_NONE}, {s0, s1, s2}, msg}
+#define SYNTAX(names) "Error: Wrong Syntax for " names "\n"
+
+/*Instruction set, indexed by opcode enum. Adding an instruction is a row here plus its OP_NAME*/
+static const op_desc OP_DESC[NUM_OPS] = {
+	OPS3(0x1000, OPK_REG, 9, OPK_REG, 6, OPK_REG_IMM5, 0, SYNTAX("and/and/xor")), /* add */
+	OPS3(0x5000, OPK_REG, 9, OPK_REG, 6, OPK_REG_IMM5, 0, SYNTAX("and/and/xor")), /* and */
+	OPS1(0x0E00, OPK_LABEL9, 0, SYNTAX("br")), /* br */
+	OPS1(0x0800, OPK_LABEL9, 0, SYNTAX("br")), /* brn */
+	OPS1(0x0400, OPK_LABEL9, 0, SYNTAX("br")), /* brz */
+	OPS1(0x0200, OPK_LABEL9, 0, SYNTAX("br")), /* brp */
+	OPS1(0x0600, OPK_LABEL9, 0, SYNTAX("br")), /* brzp */
+	OPS1(0x0A00, OPK_LABEL9, 0, SYNTAX("br")), /* brnp */
+	OPS1(0x0C00, OPK_LABEL9, 0, SYNTAX("br")), /* brnz */
+	OPS1(0x0E00, OPK_LABEL9, 0, SYNTAX("br")), /* brnzp */
+	OPS0(0xF025, SYNTAX("halt")), /* halt = trap x25 */
+	OPS1(0xC000, OPK_REG, 6, SYNTAX("jmp")), /* jmp */
+	OPS1(0x4800, OPK_LABEL11, 0, SYNTAX("jsr/jsrr")), /* jsr */
+	OPS1(0x4000, OPK_REG, 6, SYNTAX("jsr/jsrr")), /* jsrr */
+	OPS3(0x2000, OPK_REG, 9, OPK_REG, 6, OPK_IMM6, 0, SYNTAX("ldb/ldw")), /* ldb */
+	OPS3(0x6000, OPK_REG, 9, OPK_REG, 6, OPK_IMM6, 0, SYNTAX("ldb/ldw")), /* ldw */
+	OPS2(0xE000, OPK_REG, 9, OPK_LABEL9, 0, SYNTAX("lea")), /* lea */
+	OPS0(0x0000, SYNTAX("nop")), /* nop */
+	OPS2(0x903F, OPK_REG, 9, OPK_REG, 6, SYNTAX("not")), /* not = xor with #-1 */
+	OPS0(0xC1C0, SYNTAX("ret")), /* ret = jmp r7 */
+	OPS0(0x8000, SYNTAX("rti")), /* rti */
+	OPS3(0xD000, OPK_REG, 9, OPK_REG, 6, OPK_AMOUNT4, 0, SYNTAX("lshf")), /* lshf */
+	OPS3(0xD010, OPK_REG, 9, OPK_REG, 6, OPK_AMOUNT4, 0, SYNTAX("rshfa/rshfl")), /* rshfl */
+	OPS3(0xD030, OPK_REG, 9, OPK_REG, 6, OPK_AMOUNT4, 0, SYNTAX("rshfa/rshfl")), /* rshfa */
+	OPS3(0x3000, OPK_REG, 9, OPK_REG, 6, OPK_IMM6, 0, SYNTAX("stb/stw")), /* stb */
+	OPS3(0x7000, OPK_REG, 9, OPK_REG, 6, OPK_IMM6, 0, SYNTAX("stb/stw")), /* stw */
+	OPS1(0xF000, OPK_TRAPVECT8, 0, SYNTAX("trap")), /* trap */
+	OPS3(0x9000, OPK_REG, 9, OPK_REG, 6, OPK_REG_IMM5, 0, SYNTAX("and/and/xor")), /* xor */
+	OPS1(0x0000, OPK_ORIG, 0, NULL), /* .orig, operands checked by pass 1 */
+	OPS1(0x0000, OPK_FILL16, 0, "Error, missing operand .fill\n"), /* .fill */
+	OPS0(0x0000, "Error, missing operand .end\n"), /* .end */
+	OPS0(0x0000, NULL), /* .include, read by pass 1 and never decoded */
+	OPS0(0x0000, NULL), /* .global, read by pass 1 and never decoded */
+	OPS0(0x0000, NULL) /* .extern, read by pass 1 and never decoded */
+};
+
+/*Perfect hash over OP_NAME:
+ slot = (len + A[s[0]] + A[s[1]] + 2*A[s[2]] + A[s[len-1]]) % OP_HASH_SIZE, s[2] only counted when len > 2.
+ The associated values were searched offline so that every keyword lands in its own slot;
+ DEBUG builds verify that on startup (check_op_hash).*/
+static const unsigned char OP_HASH_ASSO[256] = {
+	['.'] = 49, ['a'] = 59, ['b'] = 16, ['d'] = 42, ['e'] = 28, ['f'] = 56, ['g'] = 15, ['h'] = 61, ['i'] = 37, ['j'] = 17, ['l'] = 17,
+	['m'] = 60, ['n'] = 11, ['o'] = 58, ['p'] = 63, ['r'] = 18, ['s'] = 32, ['t'] = 26, ['w'] = 26, ['x'] = 11, ['z'] = 55
+};
+
+static const signed char OP_HASH_SLOT[OP_HASH_SIZE] = {
+	OP_NONE, OP_NONE, OP_RSHFL, OP_NONE, OP_NONE, OP_NOP, OP_BRN, OP_AND,
+	OP_NONE, OP_FILL, OP_BRZ, OP_STW, OP_LDW, OP_JMP, OP_NONE, OP_NONE,
+	OP_INCLUDE, OP_END, OP_NONE, OP_BRZP, OP_NONE, OP_NONE, OP_NOT, OP_NONE,
+	OP_NONE, OP_NONE, OP_NONE, OP_NONE, OP_NONE, OP_NONE, OP_RTI, OP_NONE,
+	OP_NONE, OP_LEA, OP_BRP, OP_ORIG, OP_NONE, OP_TRAP, OP_ADD, OP_LSHF,
+	OP_NONE, OP_NONE, OP_JSR, OP_JSRR, OP_RSHFA, OP_STB, OP_LDB, OP_NONE,
+	OP_NONE, OP_NONE, OP_NONE, OP_BRNZ, OP_NONE, OP_EXTERN, OP_BR, OP_NONE,
+	OP_HALT, OP_NONE, OP_GLOBAL, OP_BRNP, OP_BRNZP, OP_NONE, OP_XOR, OP_RET
+};
+
+/*Block of an arena, the newest block is the head of the list*/
+typedef struct arena_block {
+	struct arena_block * next;
+	size_t used, cap;
+	char data[];
+}arena_block;
+
+/*Bump allocator owning the symbol names and other strings of one job. Nothing is freed
+ individually, arena_reset releases the whole job at once*/
+typedef struct {
+	arena_block * head;
+	size_t total; /*bytes allocated in all blocks, the size of the single block after a reset*/
+}arena;
+
+typedef struct {
+	const char * label; /*Interned label name, NULL if slot is empty*/
+	uint32_t hash;
+	int id; /*index into the table's per-symbol arrays, stable across rehashing*/
+}symbol_entry;
+
+/*Open addressing (linear probing) label table, grows at 70% load*/
+typedef struct {
+	symbol_entry * slots;
+	int capacity; /*always a power of two*/
+	int count;
+	int32_t * addrs; /*instruction count each symbol id is defined at, -1 while only referenced*/
+	const char ** names; /*interned name of each symbol id*/
+	int * chains; /*head of each symbol's pending fixup chain (one-pass mode), -1 if none*/
+	int ids_cap;
+	unsigned long lookups; /*stats: number of probe sequences*/
+	unsigned long probes; /*stats: total slots visited*/
+	int max_probe; /*stats: longest probe sequence*/
+}symbol_table;
+
+/*Error trap of one assembly job. asm_fail records the error and unwinds to the job's setjmp,
+ so a bad input ends its own job instead of the whole process*/
+typedef struct {
+	sigjmp_buf bail; /*no signal mask, unwinding stays a plain register restore*/
+	int code; /*exit code 1..4, 0 if the job succeeded*/
+	const char * where; /*source position the error is reported at*/
+	char msg[MAX_MSG];
+}asm_trap;
+
+static __thread asm_trap * cur_trap; /*trap of the job running on this thread, NULL to exit()*/
+
+static void asm_vfail(const char * where, int code, const char * fmt, va_list ap) __attribute__((noreturn));
+static void asm_fail(int code, const char * fmt, ...) __attribute__((noreturn, format(printf, 2, 3)));
+static void asm_fail_at(const char * where, int code, const char * fmt, ...) __attribute__((noreturn, format(printf, 3, 4)));
+
+static void asm_vfail(const char * where, int code, const char * fmt, va_list ap){
+	if (!cur_trap) {
+		vprintf(fmt, ap);
+		exit(code);
+	}
+	vsnprintf(cur_trap->msg, sizeof(cur_trap->msg), fmt, ap);
+	if (where) cur_trap->where = where;
+	cur_trap->code = code;
+	siglongjmp(cur_trap->bail, 1);
+}
+
+/* **********asm_fail*****************
+ Report an error with the given exit code at the last marked position and abandon the current job
+************************************************ */
+static void asm_fail(int code, const char * fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	asm_vfail(NULL, code, fmt, ap);
+}
+
+/* **********asm_fail_at*****************
+ Same as asm_fail, reported at the given source position
+************************************************ */
+static void asm_fail_at(const char * where, int code, const char * fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	asm_vfail(where, code, fmt, ap);
+}
+
+/* **********asm_mark*****************
+ Remember the source position errors of the current job are reported at
+************************************************ */
+static void asm_mark(const char * where){
+	if (cur_trap) cur_trap->where = where;
+}
+
+/* **********span_eq*****************
+ Compare a token span against a lower case word, folding the token's case on the fly
+************************************************ */
+static int span_eq(const char * p, size_t len, const char * word){
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (word[i] == '\0' || FOLD(p[i]) != word[i]) return 0;
+	}
+	return word[len] == '\0';
+}
+
+/* **********classify_op*****************
+ Map a token to its opcode/pseudo op enum with the perfect hash, return OP_NONE if it is neither.
+************************************************ */
+static int classify_op(const char * tok, size_t len){
+	const unsigned char * s = (const unsigned char *)tok;
+	unsigned h;
+	int op;
+	if (len < 2 || len > 8) return OP_NONE;
+	h = len + OP_HASH_ASSO[FOLD(s[0])] + OP_HASH_ASSO[FOLD(s[1])] + OP_HASH_ASSO[FOLD(s[len-1])];
+	if (len > 2) h += 2 * OP_HASH_ASSO[FOLD(s[2])];
+	op = OP_HASH_SLOT[h % OP_HASH_SIZE];
+	if (op != OP_NONE && span_eq(tok, len, OP_NAME[op])) {
+		return op;
+	}
+	return OP_NONE;
+}
+
+#ifdef DEBUG
+/* **********check_op_hash*****************
+ Verify every keyword hashes to its own slot
+************************************************ */
+static void check_op_hash(void){
+	int i;
+	for (i = 0; i < NUM_OPS; i++) {
+		if (classify_op(OP_NAME[i], strlen(OP_NAME[i])) != i) {
+			printf("Error: opcode hash table is broken for %s\n", OP_NAME[i]);
+			exit(4);
+		}
+	}
+}
+#endif
+
+/* **********tok_text*****************
+ Lower case, NUL terminated copy of a token for messages. Uses a per-thread buffer, error paths only.
+************************************************ */
+static const char * tok_text(const char * p, size_t len){
+	static __thread char text[MAX_MSG];
+	size_t i;
+	if (len > sizeof(text) - 1) len = sizeof(text) - 1;
+	for (i = 0; i < len; i++) text[i] = FOLD(p[i]);
+	text[len] = '\0';
+	return text;
+}
+
+/*One more than the value of a digit character, 0 for anything else*/
+static const uint8_t DIGIT_VALUE[256] = {
+	['0'] = 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+	['A'] = 11, 12, 13, 14, 15, 16,
+	['a'] = 11, 12, 13, 14, 15, 16
+};
+
+/* **********parse_literal*****************
+ Read the # or x number token at p in one pass: every digit is checked and added in the same
+ step, and the value stops growing once it leaves lo..hi. A malformed token fails (error 4)
+ before its range is looked at. Return 0 with *num set, or 1 if the number is out of range
+************************************************ */
+static int parse_literal(const char * p, size_t len, int lo, int hi, int * num){
+	const char * end = p + len;
+	const char * tok = p;
+	unsigned base = 10;
+	uint64_t n = 0, limit;
+	int neg = 0, over = 0;
+	
+	asm_mark(p);
+	if (len && FOLD(*p) == 'x') base = 16;
+	else if (!len || *p != '#') {
+		asm_fail_at(tok, 4, "Error: invalid operand, %s\n", tok_text(tok, len));
+		/*This has been changed from error code 3 to error code 4, see clarification 12 */
+	}
+	p++;
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	limit = neg ? (uint64_t)-(int64_t)lo : (uint64_t)hi;
+	for (; p < end; p++) {
+		unsigned d = DIGIT_VALUE[(unsigned char)*p] - 1u; /*not a digit: above any base*/
+		if (d >= base) {
+			asm_fail_at(tok, 4, base == 10 ? "Error: invalid decimal operand, %s\n" : "Error: invalid hex operand, %s\n",
+						tok_text(tok, len));
+		}
+		if (!over) {
+			n = n * base + d;
+			over = n > limit;
+		}
+	}
+	if (over) return 1;
+	*num = neg ? -(int)n : (int)n;
+	return 0;
+}
+
+/* **********check_label*****************
+// Check whether the label name is legal
+************************************************ */
+static void check_label(const char * label, size_t len){
+	size_t i;
+	if(len == 0) return;
+	if (FOLD(label[0]) == 'x' || (label[0] >= '0'&& label[0] <= '9')) {
+		asm_fail_at(label, 4, "Error: Labels can't start with 'x' or numbers\n");/*Error 4*/
+	}
+	if(classify_op(label, len) != OP_NONE){
+		asm_fail_at(label, 4, "Error: Label name can't contain opcode/pseudo op\n"); /*Error 4*/
+	}
+	if(span_eq(label, len, "in") || span_eq(label, len, "out") || span_eq(label, len, "getc") || span_eq(label, len, "puts")){
+		asm_fail_at(label, 4, "Error: Label name can't contain in/out/getc/puts\n"); /*Error 4*/
+	}
+	if (len == 2 && FOLD(label[0]) == 'r' && (label[1] < 8 && label[1]>=0 )) {
+		asm_fail_at(label, 4, "Error, label cannot be a name of Register\n");
+	}
+	for (i = 0;i < len;i++){
+		if (isalnum((unsigned char)label[i]) == 0) { /*isalnum == 0 -> not a alphanumeric value*/
+			asm_fail_at(label, 4, "Error: Label name can only contain alphanumeric chars\n"); /*Error 4*/
+		}
+	}
+}
+
+/* **********read_reg*****************
+ Use the reg token to extract register number and return it. (R3 -> 3)
+************************************************ */
+static int read_reg(const char * reg, size_t len){
+	int reg_num = len > 1 && isdigit((unsigned char)reg[1]) ? reg[1] - '0' : 0;
+	if (FOLD(reg[0]) != 'r') {
+		asm_fail_at(reg, 4, "Error: Wrong Register name\n");
+	}
+	if (len != 2 || reg_num > 7) {
+		asm_fail_at(reg, 4, "Error: Reg too large\n");
+	}
+	return reg_num;
+}
+
+/* **********check_word_align*****************
+Check whether the address is word aligned. Return 0 if aligned
+************************************************ */
+static int check_word_align(int num){/* 1-> odd, not align*/
+	return num % 2;
+}
+
+#define FIELD_MIN(width, is_signed) ((is_signed) ? -(1 << ((width) - 1)) : 0)
+#define FIELD_MAX(width, is_signed) ((is_signed) ? (1 << ((width) - 1)) - 1 : (1 << (width)) - 1)
+
+static void field_overflow(int width, int is_signed) __attribute__((noreturn));
+static void field_overflow(int width, int is_signed){
+	if (is_signed) asm_fail(3, "Error: %d bit number overflow\n", width);
+	asm_fail(3, "Error: %d bit unsigned number overflow\n", width); /*Error 3*/
+}
+
+/* **********DEFINE_FIELD*****************
+ pack_<name>(num): fail (error 3) unless num fits a width bit field, signed or unsigned, and
+ return the bits of the field, negative numbers in two's complement.
+ parse_<name>(p, len): the # or x token at p read straight into the field.
+ Width and signedness are constants, so each of them compiles to a compare and a mask
+************************************************ */
+#define DEFINE_FIELD(name, width, is_signed) \
+static __attribute__((unused)) int pack_##name(int num){ \
+	if (num < FIELD_MIN(width, is_signed) || num > FIELD_MAX(width, is_signed)) field_overflow(width, is_signed); \
+	return num & ((1 << (width)) - 1); \
+} \
+static __attribute__((unused)) int parse_##name(const char * p, size_t len){ \
+	int num = 0; \
+	if (parse_literal(p, len, FIELD_MIN(width, is_signed), FIELD_MAX(width, is_signed), &num)) field_overflow(width, is_signed); \
+	return num & ((1 << (width)) - 1); \
+}
+
+DEFINE_FIELD(amount4, 4, 0)
+DEFINE_FIELD(imm5, 5, 1)
+DEFINE_FIELD(offset6, 6, 1)
+DEFINE_FIELD(trapvect8, 8, 0)
+DEFINE_FIELD(offset9, 9, 1)
+DEFINE_FIELD(offset11, 11, 1)
+DEFINE_FIELD(word16, 16, 1)
+
+/* **********grow_array*****************
+ Make room for at least need elements of size elem in a malloc'd array
+************************************************ */
+static void * grow_array(void * arr, int * cap, int need, size_t elem){
+	if (need > *cap) {
+		int ncap = *cap ? *cap : 256;
+		while (ncap < need) ncap *= 2;
+		arr = realloc(arr, ncap * elem);
+		if (!arr) {
+			asm_fail(4, "Error: out of memory\n");
+		}
+		*cap = ncap;
+	}
+	return arr;
+}
+
+/* **********arena_alloc*****************
+ Return size bytes aligned to align (a power of two up to sizeof(void *)) that live until
+ the arena is reset
+************************************************ */
+static void * arena_alloc(arena * ar, size_t size, size_t align){
+	arena_block * blk = ar->head;
+	size_t at = blk ? (blk->used + align - 1) & ~(align - 1) : 0;
+	if (!blk || at + size > blk->cap) {
+		size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		if (blk && cap < 2 * blk->cap) cap = 2 * blk->cap;
+		blk = malloc(sizeof(arena_block) + cap);
+		if (!blk) {
+			asm_fail(4, "Error: out of memory\n");
+		}
+		blk->next = ar->head;
+		blk->used = 0;
+		blk->cap = cap;
+		ar->head = blk;
+		ar->total += cap;
+		at = 0;
+	}
+	blk->used = at + size;
+	return blk->data + at;
+}
+
+/* **********arena_reset*****************
+ Release everything allocated for the last job. A job that needed several blocks leaves one
+ block of their total size, so the next job of the same size allocates nothing
+************************************************ */
+static void arena_reset(arena * ar){
+	size_t total = ar->total;
+	if (ar->head && ar->head->next) {
+		arena_block * blk;
+		while (ar->head) {
+			blk = ar->head->next;
+			free(ar->head);
+			ar->head = blk;
+		}
+		ar->total = 0;
+		blk = malloc(sizeof(arena_block) + total);
+		if (!blk) return; /*the next allocation gets a fresh block*/
+		blk->next = NULL;
+		blk->cap = ar->total = total;
+		ar->head = blk;
+	}
+	if (ar->head) ar->head->used = 0;
+}
+
+static void arena_free(arena * ar){
+	while (ar->head) {
+		arena_block * next = ar->head->next;
+		free(ar->head);
+		ar->head = next;
+	}
+	ar->total = 0;
+}
+
+/* **********intern_label*****************
+ Copy the label, folded to lower case, into the job's arena and return the stable copy
+************************************************ */
+static const char * intern_label(arena * strings, const char * label, size_t len){
+	char * dst = arena_alloc(strings, len + 1, 1);
+	size_t i;
+	for (i = 0; i < len; i++) dst[i] = FOLD(label[i]);
+	dst[len] = '\0';
+	return dst;
+}
+
+/* **********hash_label*****************
+ FNV-1a hash of the case folded label name
+************************************************ */
+static uint32_t hash_label(const char * label, size_t len){
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)FOLD(label[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void symtab_init(symbol_table * table){
+	table->capacity = SYMTAB_INIT_CAP;
+	table->count = 0;
+	table->slots = calloc(table->capacity, sizeof(symbol_entry));
+	table->addrs = NULL;
+	table->names = NULL;
+	table->chains = NULL;
+	table->ids_cap = 0;
+	table->lookups = table->probes = 0;
+	table->max_probe = 0;
+	if (!table->slots) {
+		asm_fail(4, "Error: out of memory\n");
+	}
+}
+
+/* **********symtab_reset*****************
+ Empty the table for the next job, keeping its slots. The names go with the job's arena
+************************************************ */
+static void symtab_reset(symbol_table * table){
+	memset(table->slots, 0, table->capacity * sizeof(symbol_entry));
+	table->count = 0;
+	table->lookups = table->probes = 0;
+	table->max_probe = 0;
+}
+
+static void symtab_free(symbol_table * table){
+	free(table->slots);
+	free(table->addrs);
+	free(table->names);
+	free(table->chains);
+	table->slots = NULL;
+	table->capacity = table->count = 0;
+}
+
+/* **********symtab_slot*****************
+ Return the slot holding label, or the empty slot where it would go
+************************************************ */
+static symbol_entry * symtab_slot(symbol_table * table, const char * label, size_t len, uint32_t hash){
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = hash & mask;
+	int n = 1;
+	while (table->slots[i].label && (table->slots[i].hash != hash || !span_eq(label, len, table->slots[i].label))) {
+		i = (i + 1) & mask;
+		n++;
+	}
+	table->lookups++;
+	table->probes += n;
+	if (n > table->max_probe) table->max_probe = n;
+	return &table->slots[i];
+}
+
+static void symtab_grow(symbol_table * table){
+	symbol_entry * old = table->slots;
+	int old_cap = table->capacity;
+	int i;
+	table->capacity *= 2;
+	table->slots = calloc(table->capacity, sizeof(symbol_entry));
+	if (!table->slots) {
+		asm_fail(4, "Error: out of memory\n");
+	}
+	for (i = 0; i < old_cap; i++) {
+		if (old[i].label) {
+			uint32_t mask = table->capacity - 1;
+			uint32_t j = old[i].hash & mask;
+			while (table->slots[j].label) j = (j + 1) & mask;
+			table->slots[j] = old[i];
+		}
+	}
+	free(old);
+}
+
+/* **********symtab_ref*****************
+ Return the entry for label, inserting it as undefined if it is not in the table yet.
+ New names are interned in strings
+************************************************ */
+static symbol_entry * symtab_ref(symbol_table * table, arena * strings, const char * label, size_t len){
+	uint32_t hash = hash_label(label, len);
+	symbol_entry * e = symtab_slot(table, label, len, hash);
+	if (!e->label) {
+		if ((table->count + 1) * 10 >= table->capacity * 7) {
+			symtab_grow(table);
+			e = symtab_slot(table, label, len, hash);
+		}
+		e->label = intern_label(strings, label, len);
+		e->hash = hash;
+		e->id = table->count++;
+		if (e->id == table->ids_cap) {
+			int cap = table->ids_cap;
+			table->addrs = grow_array(table->addrs, &cap, e->id + 1, sizeof(int32_t));
+			cap = table->ids_cap;
+			table->names = grow_array(table->names, &cap, e->id + 1, sizeof(const char *));
+			table->chains = grow_array(table->chains, &table->ids_cap, e->id + 1, sizeof(int));
+		}
+		table->addrs[e->id] = -1;
+		table->names[e->id] = e->label;
+		table->chains[e->id] = -1;
+	}
+	return e;
+}
+
+/* **********add_label*****************
+ Bind label to addr, duplicate labels are an error.
+ Return the chain of fixups that were waiting for the label, -1 if none
+************************************************ */
+static int add_label( symbol_table * table, arena * strings, const char * label, size_t len, int addr){
+	int id = symtab_ref(table, strings, label, len)->id;
+	int pending;
+	if(table->addrs[id] >= 0){
+		asm_fail_at(label, 4, "Error: label duplicate in the table.\n");
+	}
+	table->addrs[id] = addr;
+	pending = table->chains[id];
+	table->chains[id] = -1;
+	return pending;
+}
+
+static void symtab_print_stats(symbol_table * table, FILE * out){
+	fprintf(out, "Symbols: %d, capacity %d, avg probe %.2f, max probe %d\n", table->count, table->capacity,
+		   table->lookups ? (double)table->probes / table->lookups : 0.0, table->max_probe);
+}
+
+/*Input program: the mapped file, or a non-mappable input (pipe, empty file) read into memory*/
+typedef struct {
+	char * data;
+	size_t len;
+	int mapped;
+}source_buf;
+
+/* **********read_source*****************
+ Read fd to its end into memory. Return 0 on success
+************************************************ */
+static int read_source(int fd, source_buf * src){
+	size_t cap = 0;
+	ssize_t n;
+	src->data = NULL;
+	src->len = 0;
+	src->mapped = 0;
+	for (;;) {
+		if (src->len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			src->data = realloc(src->data, cap);
+			if (!src->data) {
+				asm_fail(4, "Error: out of memory\n");
+			}
+		}
+		n = read(fd, src->data + src->len, cap - src->len);
+		if (n <= 0) break;
+		src->len += n;
+	}
+	return n < 0 ? -1 : 0;
+}
+
+/* **********load_source*****************
+ Map the input read-only, "-" reads stdin. Return 0 on success
+************************************************ */
+static int load_source(const char * path, source_buf * src){
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	struct stat sb;
+	int ret;
+	src->data = NULL;
+	src->len = 0;
+	src->mapped = 0;
+	if (fd < 0) return -1;
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		void * p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, sb.st_size, MADV_SEQUENTIAL);
+			src->data = p;
+			src->len = sb.st_size;
+			src->mapped = 1;
+			if (fd != STDIN_FILENO) close(fd);
+			return 0;
+		}
+	}
+	ret = read_source(fd, src);
+	if (fd != STDIN_FILENO) close(fd);
+	return ret;
+}
+
+static void free_source(source_buf * src){
+	if (src->mapped) munmap(src->data, src->len);
+	else free(src->data);
+	src->data = NULL;
+	src->len = 0;
+}
+
+#define IS_DELIM(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == ',')
+
+/*Character classes of the source, one bit per byte in 64 byte blocks. Built once per job by
+ scan_source, the lexer then finds lines, comments and token boundaries with bit scans*/
+typedef struct {
+	uint64_t * delim; /*' ' '\t' '\n' ','*/
+	uint64_t * nl; /*'\n'*/
+	uint64_t * stop; /*';' '\0', the rest of the line is ignored*/
+	uint64_t * bits; /*storage of the three bitmaps*/
+	int cap; /*words allocated in bits*/
+}scan_index;
+
+typedef void (*scan_fn)(const char * buf, size_t nblocks, uint64_t * delim, uint64_t * nl, uint64_t * stop);
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_LOW7 0x7F7F7F7F7F7F7F7FULL
+
+/*High bit of every byte of w that equals c, exact (no borrow between bytes)*/
+static inline uint64_t swar_eq(uint64_t w, unsigned char c){
+	uint64_t x = w ^ (SWAR_ONES * c);
+	return ~(((x & SWAR_LOW7) + SWAR_LOW7) | x) & ~SWAR_LOW7;
+}
+
+/*Gather the 8 byte high bits of m into the low 8 bits*/
+static inline uint64_t swar_bits(uint64_t m){
+	return ((m >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+/* **********scan_scalar*****************
+ Portable kernel: classify nblocks blocks of 64 bytes, 8 bytes per step in a 64 bit register
+************************************************ */
+static void scan_scalar(const char * buf, size_t nblocks, uint64_t * delim, uint64_t * nl, uint64_t * stop){
+	size_t b;
+	int i;
+	for (b = 0; b < nblocks; b++, buf += 64) {
+		uint64_t d = 0, n = 0, s = 0;
+		for (i = 0; i < 8; i++) {
+			uint64_t w, lf;
+			memcpy(&w, buf + 8 * i, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			w = __builtin_bswap64(w);
+#endif
+			lf = swar_eq(w, '\n');
+			d |= swar_bits(swar_eq(w, ' ') | swar_eq(w, '\t') | swar_eq(w, ',') | lf) << (8 * i);
+			n |= swar_bits(lf) << (8 * i);
+			s |= swar_bits(swar_eq(w, ';') | swar_eq(w, '\0')) << (8 * i);
+		}
+		delim[b] = d;
+		nl[b] = n;
+		stop[b] = s;
+	}
+}
+
+#ifdef SCAN_X86
+/*Bit mask of the bytes of v equal to c*/
+#define SSE2_EQ(v, c) _mm_movemask_epi8(_mm_cmpeq_epi8((v), _mm_set1_epi8(c)))
+
+/* **********scan_sse2*****************
+ x86-64 baseline kernel: four 16 byte compares per block
+************************************************ */
+static void scan_sse2(const char * buf, size_t nblocks, uint64_t * delim, uint64_t * nl, uint64_t * stop){
+	size_t b;
+	int i;
+	for (b = 0; b < nblocks; b++, buf += 64) {
+		uint64_t d = 0, n = 0, s = 0;
+		for (i = 0; i < 4; i++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(buf + 16 * i));
+			uint64_t lf = (uint16_t)SSE2_EQ(v, '\n');
+			d |= ((uint64_t)(uint16_t)(SSE2_EQ(v, ' ') | SSE2_EQ(v, '\t') | SSE2_EQ(v, ',')) | lf) << (16 * i);
+			n |= lf << (16 * i);
+			s |= (uint64_t)(uint16_t)(SSE2_EQ(v, ';') | SSE2_EQ(v, '\0')) << (16 * i);
+		}
+		delim[b] = d;
+		nl[b] = n;
+		stop[b] = s;
+	}
+}
+
+#define AVX2_EQ(v, c) (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((v), _mm256_set1_epi8(c)))
+
+/* **********scan_avx2*****************
+ Two 32 byte compares per block, used when the CPU has AVX2
+************************************************ */
+__attribute__((target("avx2")))
+static void scan_avx2(const char * buf, size_t nblocks, uint64_t * delim, uint64_t * nl, uint64_t * stop){
+	size_t b;
+	int i;
+	for (b = 0; b < nblocks; b++, buf += 64) {
+		uint64_t d = 0, n = 0, s = 0;
+		for (i = 0; i < 2; i++) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(buf + 32 * i));
+			uint64_t lf = AVX2_EQ(v, '\n');
+			d |= ((uint64_t)(AVX2_EQ(v, ' ') | AVX2_EQ(v, '\t') | AVX2_EQ(v, ',')) | lf) << (32 * i);
+			n |= lf << (32 * i);
+			s |= (uint64_t)(AVX2_EQ(v, ';') | AVX2_EQ(v, '\0')) << (32 * i);
+		}
+		delim[b] = d;
+		nl[b] = n;
+		stop[b] = s;
+	}
+}
+#endif
+
+/*Best kernel for this CPU*/
+static scan_fn pick_scanner(void){
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return scan_avx2;
+	return scan_sse2;
+#else
+	return scan_scalar;
+#endif
+}
+
+/* **********scan_source*****************
+ Build the class bitmaps of buf with the best kernel for this CPU. The last partial block goes
+ through the scalar kernel from a zero padded copy, bits past len are cleared
+************************************************ */
+static void scan_source(scan_index * ix, const char * buf, size_t len){
+	scan_fn scan = pick_scanner();
+	size_t full = len / 64, nblocks = (len + 63) / 64;
+	if (nblocks > (size_t)INT_MAX / 3) {
+		asm_fail(4, "Error: out of memory\n");
+	}
+	ix->bits = grow_array(ix->bits, &ix->cap, 3 * (int)nblocks, sizeof(uint64_t));
+	ix->delim = ix->bits;
+	ix->nl = ix->bits + nblocks;
+	ix->stop = ix->bits + 2 * nblocks;
+	scan(buf, full, ix->delim, ix->nl, ix->stop);
+	if (full < nblocks) {
+		char tail[64];
+		uint64_t valid = ~0ULL >> (64 - (len & 63));
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, buf + 64 * full, len & 63);
+		scan_scalar(tail, 1, ix->delim + full, ix->nl + full, ix->stop + full);
+		ix->delim[full] &= valid;
+		ix->nl[full] &= valid;
+		ix->stop[full] &= valid;
+	}
+}
+
+/* **********scan_next*****************
+ First position in [from, limit) whose bit in bits equals want, limit if there is none
+************************************************ */
+static inline size_t scan_next(const uint64_t * bits, size_t from, size_t limit, int want){
+	uint64_t flip = want ? 0 : ~0ULL;
+	size_t w = from >> 6;
+	uint64_t m;
+	if (from >= limit) return limit;
+	m = (bits[w] ^ flip) & (~0ULL << (from & 63));
+	while (!m) {
+		if (++w << 6 >= limit) return limit;
+		m = bits[w] ^ flip;
+	}
+	from = (w << 6) + __builtin_ctzll(m);
+	return from < limit ? from : limit;
+}
+
+/*(offset, length) span of a token in the source buffer, len is 0 if the token is absent*/
+typedef struct {
+	size_t off;
+	size_t len;
+}token;
+
+/*One lexed line*/
+typedef struct {
+	token label;
+	token opcode;
+	int op;
+	token arg[4];
+	int line; /*source line number, 1 based*/
+}parsed_line;
+
+/*Lexer state over one source buffer, all state lives here so lexers can run concurrently*/
+typedef struct {
+	const char * buf;
+	size_t len;
+	const scan_index * ix; /*class bitmaps of buf*/
+	size_t pos; /*start of the next line*/
+	int line; /*lines consumed so far*/
+}lexer;
+
+static void lexer_init(lexer * lx, const char * buf, size_t len, const scan_index * ix){
+	lx->buf = buf;
+	lx->len = len;
+	lx->ix = ix;
+	lx->pos = 0;
+	lx->line = 0;
+}
+
+/* **********next_token*****************
+ Find the next token in [*pos, end). Return 0 if the line has no more tokens
+************************************************ */
+static int next_token(const scan_index * ix, size_t * pos, size_t end, token * tok){
+	size_t i = scan_next(ix->delim, *pos, end, 0);
+	if (i >= end) {
+		*pos = i;
+		return 0;
+	}
+	tok->off = i;
+	i = scan_next(ix->delim, i, end, 1);
+	tok->len = i - tok->off;
+	*pos = i;
+	return 1;
+}
+
+/* **********lex_line*****************
+ Split the next source line into label, opcode and up to 4 operand spans.
+ Return DONE at end of input, EMPTY_LINE for blank/comment lines, OK otherwise
+************************************************ */
+static int lex_line(lexer * lx, parsed_line * pl)
+{
+	const char * buf = lx->buf;
+	const scan_index * ix = lx->ix;
+	size_t pos = lx->pos, end, eol;
+	token tok;
+	int i, op;
+	memset(pl, 0, sizeof(*pl));
+	pl->op = OP_NONE;
+	if (pos >= lx->len)
+		return( DONE );
+	eol = scan_next(ix->nl, pos, lx->len, 1);
+	lx->pos = eol < lx->len ? eol + 1 : eol;
+	pl->line = ++lx->line;
+	
+	/* ignore the comments */
+	end = scan_next(ix->stop, pos, eol, 1);
+	if( !next_token( ix, &pos, end, &tok ) )
+		return( EMPTY_LINE );
+	asm_mark(buf + tok.off);
+	
+	op = classify_op( buf + tok.off, tok.len );
+	if( op == OP_NONE && buf[tok.off] != '.' ) /* found a label */
+		{
+			pl->label = tok;
+			if( !next_token( ix, &pos, end, &tok ) ) return( OK );
+			op = classify_op( buf + tok.off, tok.len );
+		}
+	if (op == OP_NONE) {
+		asm_fail_at(buf + tok.off, 2, "Error: opcode %s is not defined\n",tok_text(buf + tok.off, tok.len));
+	}
+	pl->opcode = tok;
+	pl->op = op;
+	for (i = 0; i < 4; i++) {
+		if( !next_token( ix, &pos, end, &pl->arg[i] ) ) return( OK );
+	}
+	return( OK );
+}
+
+/*br/jsr/lea operand whose label was not defined yet when it was encoded (one-pass mode)*/
+typedef struct {
+	int sym; /*symbol id of the target label, -1 once patched*/
+	int word; /*index of the instruction word in the image, image_base included*/
+	int inst; /*instruction count of the referencing instruction*/
+	int width; /*offset field width, 9 or 11*/
+	int next; /*next fixup waiting on the same label, -1 ends the chain*/
+}fixup;
+
+/*Lines of the last successful asm_reassemble: the content hash of every line and, up to .end,
+ the IR entries and label each line produced. The next run redoes only the lines that changed*/
+typedef struct {
+	int valid; /*the records below match the IR, symbols and image*/
+	int nlines; /*source lines, a final '\n' does not start another one*/
+	int orig_line, end_line; /*0 based lines of .orig and .end*/
+	int cap; /*entries allocated in each per-line array*/
+	uint64_t * hash; /*hash of each line's bytes*/
+	uint64_t * next_hash; /*hashes of the source being reassembled*/
+	int32_t * first; /*IR entries before each line, end_line + 2 of them*/
+	int32_t * label; /*symbol id defined on each line, -1 if none*/
+	size_t * start; /*offset of each line of the source being reassembled, plus one past the last*/
+	int32_t * refs; /*IR entries referring to each symbol id*/
+	int refs_cap;
+	void * tmp; /*scratch for moving IR entries*/
+	int tmp_cap; /*8 byte units*/
+}line_cache;
+
+/*.orig segment of a relocatable object*/
+typedef struct {
+	int first; /*IR entry of the segment's .orig*/
+	uint16_t addr;
+}segment;
+
+/*Field of a relocatable object that refers to a label of another module*/
+typedef struct {
+	int word; /*IR entry holding the field*/
+	int sym; /*imported symbol id*/
+	int width; /*9 or 11 for a PC-relative offset, 16 for a .fill of the label's address*/
+}reloc;
+
+/*Link scope of a symbol of a relocatable object, SCOPE_LOCAL unless .global or .extern says so*/
+enum{SCOPE_LOCAL, SCOPE_GLOBAL, SCOPE_EXTERN};
+
+/*.global or .extern of a symbol id*/
+typedef struct {
+	int scope;
+	const char * at; /*the declared label, where errors about it are reported*/
+}sym_scope;
+
+#ifdef __APPLE__
+#define ST_MTIM(sb) (sb).st_mtimespec
+#define ST_CTIM(sb) (sb).st_ctimespec
+#else
+#define ST_MTIM(sb) (sb).st_mtim
+#define ST_CTIM(sb) (sb).st_ctim
+#endif
+#define SAME_TIME(a, b) ((a).tv_sec == (b).tv_sec && (a).tv_nsec == (b).tv_nsec)
+
+/*Source file read by .include: copied, scanned and lexed once per process, then shared by every
+ job that includes it. A file that changed on disk replaces its entry, which is freed once no
+ job holds it*/
+typedef struct included_file {
+	struct included_file * next;
+	char * path;
+	size_t dir_len; /*nested .include paths are relative to path[0..dir_len)*/
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime, ctime;
+	int refs; /*jobs that have the file in their includes*/
+	int stale; /*replaced in include_cache, freed by the last release_include*/
+	source_buf source; /*a private copy, so rewriting the file cannot change the lexed lines*/
+	scan_index scan;
+	parsed_line * lines; /*the file's non-empty lines*/
+	int nlines, lines_cap;
+	asm_trap fail; /*error met while reading or lexing the file, after its last line; code 0 if none*/
+}included_file;
+
+/*File .included by the current program*/
+typedef struct {
+	included_file * file; /*held until release_includes*/
+	int open; /*its lines are being read, including it again is a cycle*/
+}include_use;
+
+static pthread_mutex_t include_lock = PTHREAD_MUTEX_INITIALIZER;
+static included_file * include_cache; /*every file read by .include in this process*/
+
+/*State shared by both passes and the encoders. Reused from job to job as per-thread scratch*/
+typedef struct asm_state {
+	const char * src; /*source buffer the tokens point into*/
+	size_t src_len;
+	source_buf source; /*input of the current file job*/
+	int outfd; /*output of the current job, -1 if not open*/
+	int diag_level; /*ASM_DIAG_* of the current job*/
+	FILE * diag; /*info/trace stream, NULL for silent (batch) runs*/
+	char * diag_buf; /*pending diag output, DIAG_BUF_SIZE bytes*/
+	size_t diag_len;
+	asm_stats * stats; /*timings of the current job, NULL if not timed*/
+	int phase; /*ASM_PHASE_* being timed, -1 for none*/
+	double phase_start;
+	uint64_t phase_count[NUM_COUNTERS];
+	int perf_fd[NUM_COUNTERS]; /*counter group, [0] is the leader: -1 if not open, -2 if unavailable*/
+	scan_index scan; /*class bitmaps of src*/
+	arena arena; /*symbol names and other strings of the current job*/
+	symbol_table table;
+	uint16_t origin;
+	int inst_count;
+	int label_count;
+	int one_pass; /*encode while reading, forward references are backpatched*/
+	int optimize; /*run optimize_ir between the passes*/
+	asm_opt_report opt; /*what optimize_ir changed*/
+	asm_ir opt_ir; /*optimize_ir: the rebuilt IR, swapped with ir*/
+	int32_t * opt_work; /*optimize_ir: per entry scratch*/
+	int opt_work_cap;
+	int threads; /*pass 2 threads, 0 for one per core*/
+	int line; /*source line pass 1 is on*/
+	asm_ir ir; /*decoded instructions, built by pass 1*/
+	asm_trap deferred; /*first operand error of pass 1, code 0 if none*/
+	int deferred_at; /*IR entry the deferred error belongs to*/
+	uint16_t * image; /*encoded words, written out after the last pass*/
+	int image_len, image_cap;
+	fixup * fixups;
+	int fixup_len, fixup_cap;
+	int image_base; /*asm_stream: words already written, the image and the IR start after them*/
+	int fixup_base; /*asm_stream: fixups dropped from the front of fixups, chains count them*/
+	int src_line; /*asm_stream: lines before src*/
+	int peak_window; /*asm_stream: most words held at once*/
+	char * out_buf; /*asm_stream: rendered words*/
+	size_t out_cap;
+	line_cache lines; /*per-line records for asm_reassemble*/
+	int relocatable; /*object output: several .orig segments, .extern labels are imported*/
+	segment * segs;
+	int nsegs, segs_cap;
+	reloc * relocs;
+	int nrelocs, relocs_cap;
+	sym_scope * scopes; /*per symbol id, SCOPE_LOCAL from nscopes on*/
+	int nscopes, scopes_cap;
+	uint16_t * memory; /*linker: the 64K byte address space as words*/
+	uint64_t * used; /*linker: one bit per word of memory*/
+	struct pass1_slice * slices; /*parallel pass 1, one per thread*/
+	int slices_cap;
+	const char * dir; /*.include paths are relative to dir[0..dir_len), the working directory if 0*/
+	size_t dir_len;
+	include_use * includes; /*files included by this program*/
+	int nincludes, includes_cap;
+	int max_errors; /*errors to report, the first one only if below 2*/
+	int recovering; /*collect_errors is reading: operand errors are raised at once, not held back*/
+	asm_error * errors; /*every error of the last job, the returned one first*/
+	int nerrors, errors_cap;
+}asm_state;
+
+/*Newline aligned part of the source that pass 1 reads on a thread of its own*/
+typedef struct pass1_slice {
+	asm_state * st; /*the job*/
+	asm_state part; /*IR, labels and held error of the slice alone. Lines count from 0 and
+					 instructions from 1, the job's .orig*/
+	size_t begin, end; /*byte range*/
+	int lines; /*source lines read*/
+	int ended; /*read .end*/
+	int included; /*stopped at an .include, pass 1 has to be read serially*/
+	int fail_inst; /*instruction count at trap's error, which ends the slice*/
+	int ir_base, inst_base, line_base; /*where the slice starts in the whole program*/
+	size_t * label_pos; /*source offset of each label defined here, by local symbol id*/
+	int32_t * map; /*job's symbol id of each local id*/
+	int label_pos_cap, map_cap;
+	asm_trap trap;
+}pass1_slice;
+
+static void release_includes(asm_state * st);
+static void counters_close(asm_state * st);
+
+static void asm_init(asm_state * st){
+	int i;
+	memset(st, 0, sizeof(*st));
+	st->outfd = -1;
+	st->phase = -1;
+	for (i = 0; i < NUM_COUNTERS; i++) st->perf_fd[i] = -1;
+	symtab_init(&st->table);
+}
+
+/* **********asm_reset*****************
+ Prepare the state for the next job, keeping allocations
+************************************************ */
+static void asm_reset(asm_state * st){
+	st->src = NULL;
+	st->outfd = -1;
+	st->origin = 0;
+	st->inst_count = 0;
+	st->label_count = 0;
+	st->image_len = 0;
+	st->ir.len = 0;
+	st->deferred.code = 0;
+	st->fixup_len = 0;
+	st->image_base = 0;
+	st->fixup_base = 0;
+	st->src_line = 0;
+	st->peak_window = 0;
+	st->lines.valid = 0;
+	st->nsegs = 0;
+	st->nrelocs = 0;
+	st->nscopes = 0;
+	release_includes(st);
+	st->nerrors = 0;
+	memset(&st->opt, 0, sizeof(st->opt));
+	symtab_reset(&st->table);
+	arena_reset(&st->arena);
+}
+
+static void asm_free(asm_state * st){
+	symtab_free(&st->table);
+	arena_free(&st->arena);
+	free(st->scan.bits);
+	free(st->image);
+	free(st->fixups);
+	free(st->out_buf);
+	free(st->ir.op);
+	free(st->ir.regs);
+	free(st->ir.imm);
+	free(st->ir.sym);
+	free(st->ir.line);
+	free(st->opt_ir.op);
+	free(st->opt_ir.regs);
+	free(st->opt_ir.imm);
+	free(st->opt_ir.sym);
+	free(st->opt_ir.line);
+	free(st->opt_work);
+	free(st->diag_buf);
+	free(st->lines.hash);
+	free(st->lines.next_hash);
+	free(st->lines.first);
+	free(st->lines.label);
+	free(st->lines.start);
+	free(st->lines.refs);
+	free(st->lines.tmp);
+	free(st->segs);
+	free(st->relocs);
+	free(st->scopes);
+	free(st->memory);
+	free(st->used);
+	while (st->slices_cap > 0) {
+		pass1_slice * sl = &st->slices[--st->slices_cap];
+		asm_free(&sl->part);
+		free(sl->label_pos);
+		free(sl->map);
+	}
+	free(st->slices);
+	release_includes(st);
+	free(st->includes);
+	free(st->errors);
+	counters_close(st);
+}
+
+/*Diagnostic message at level lvl. Levels above ASM_DIAG_MAX cost nothing, the rest one compare*/
+#define DIAG(st, lvl, ...) do { \
+	if ((lvl) <= ASM_DIAG_MAX && (lvl) <= (st)->diag_level) diag_printf((st), __VA_ARGS__); \
+} while (0)
+
+static void diag_flush(asm_state * st){
+	if (st->diag_len && st->diag) {
+		fwrite(st->diag_buf, 1, st->diag_len, st->diag);
+		fflush(st->diag);
+	}
+	st->diag_len = 0;
+}
+
+/* **********diag_printf*****************
+ Append a message to the diag buffer, the stream is only written when the buffer fills up
+ or the job ends
+************************************************ */
+static void diag_printf(asm_state * st, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+static void diag_printf(asm_state * st, const char * fmt, ...){
+	va_list ap;
+	int n;
+	if (!st->diag) return;
+	if (!st->diag_buf) {
+		st->diag_buf = malloc(DIAG_BUF_SIZE);
+		if (!st->diag_buf) return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(st->diag_buf + st->diag_len, DIAG_BUF_SIZE - st->diag_len, fmt, ap);
+	va_end(ap);
+	if (n < 0) return;
+	if ((size_t)n >= DIAG_BUF_SIZE - st->diag_len) {
+		/*did not fit: flush what was there and format again, oversized messages go out directly*/
+		diag_flush(st);
+		va_start(ap, fmt);
+		if (n < DIAG_BUF_SIZE) st->diag_len = vsnprintf(st->diag_buf, DIAG_BUF_SIZE, fmt, ap);
+		else vfprintf(st->diag, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	st->diag_len += n;
+}
+
+static double wall_time(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group){
+	struct perf_event_attr pe;
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = config;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	pe.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &pe, 0, -1, group, 0);
+}
+#endif
+
+/*Close the counter group, members first*/
+static void counters_close(asm_state * st){
+	int i;
+	for (i = NUM_COUNTERS - 1; i >= 0; i--) {
+		if (st->perf_fd[i] >= 0) close(st->perf_fd[i]);
+		st->perf_fd[i] = -1;
+	}
+}
+
+/* **********counters_open*****************
+ Open the cycles/instructions/cache-misses group of the calling thread once per context.
+ Return 0 if the counters can be read
+************************************************ */
+static int counters_open(asm_state * st){
+#ifdef __linux__
+	static const uint64_t CONFIG[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+	int i;
+	if (st->perf_fd[0] == -1) {
+		st->perf_fd[0] = perf_open(CONFIG[0], -1);
+		for (i = 1; i < NUM_COUNTERS && st->perf_fd[0] >= 0; i++) {
+			st->perf_fd[i] = perf_open(CONFIG[i], st->perf_fd[0]);
+			if (st->perf_fd[i] < 0) counters_close(st);
+		}
+		if (st->perf_fd[0] < 0) st->perf_fd[0] = -2;
+	}
+#else
+	st->perf_fd[0] = -2;
+#endif
+	return st->perf_fd[0] >= 0 ? 0 : -1;
+}
+
+static void counters_read(asm_state * st, uint64_t * count){
+	struct {
+		uint64_t nr;
+		uint64_t value[NUM_COUNTERS];
+	}group;
+	memset(count, 0, NUM_COUNTERS * sizeof(uint64_t));
+	if (st->perf_fd[0] < 0 || read(st->perf_fd[0], &group, sizeof(group)) != sizeof(group)) return;
+	memcpy(count, group.value, sizeof(group.value));
+}
+
+/* **********phase_begin*****************
+ Charge the time since the last call to the running phase and start timing the next one.
+ -1 stops timing. Does nothing unless the job is timed
+************************************************ */
+static void phase_begin(asm_state * st, int phase){
+	asm_stats * stats = st->stats;
+	uint64_t count[NUM_COUNTERS];
+	double t;
+	if (!stats) return;
+	t = wall_time();
+	if (stats->have_counters) counters_read(st, count);
+	if (st->phase >= 0) {
+		stats->seconds[st->phase] += t - st->phase_start;
+		if (stats->have_counters) {
+			stats->cycles[st->phase] += count[0] - st->phase_count[0];
+			stats->instructions[st->phase] += count[1] - st->phase_count[1];
+			stats->cache_misses[st->phase] += count[2] - st->phase_count[2];
+		}
+	}
+	st->phase = phase;
+	st->phase_start = t;
+	if (stats->have_counters) memcpy(st->phase_count, count, sizeof(count));
+}
+
+static void emit_word(asm_state * st, int word){
+	st->image = grow_array(st->image, &st->image_cap, st->image_len + 1, sizeof(uint16_t));
+	st->image[st->image_len++] = word;
+}
+
+/* **********check_offset*****************
+ Range check a PC-relative offset and wrap it into a 9 or 11 bit field
+************************************************ */
+static int check_offset(int offset, int width){
+	return width == 9 ? pack_offset9(offset) : pack_offset11(offset);
+}
+
+/* **********ir_reserve*****************
+ Make room for n IR entries
+************************************************ */
+static void ir_reserve(asm_ir * ir, int n){
+	int cap = ir->cap ? ir->cap : 256;
+	if (n <= ir->cap) return;
+	while (cap < n) cap *= 2;
+	ir->op = realloc(ir->op, cap * sizeof(*ir->op));
+	ir->regs = realloc(ir->regs, cap * sizeof(*ir->regs));
+	ir->imm = realloc(ir->imm, cap * sizeof(*ir->imm));
+	ir->sym = realloc(ir->sym, cap * sizeof(*ir->sym));
+	ir->line = realloc(ir->line, cap * sizeof(*ir->line));
+	if (!ir->op || !ir->regs || !ir->imm || !ir->sym || !ir->line) {
+		ir->cap = 0;
+		asm_fail(4, "Error: out of memory\n");
+	}
+	ir->cap = cap;
+}
+
+/* **********ir_emit*****************
+ Append one decoded instruction word to the IR
+************************************************ */
+static void ir_emit(asm_state * st, int op, int regs, int imm, int sym){
+	asm_ir * ir = &st->ir;
+	int i = ir->len;
+	if (i == ir->cap) ir_reserve(ir, i + 1);
+	ir->op[i] = op;
+	ir->regs[i] = regs;
+	ir->imm[i] = imm;
+	ir->sym[i] = sym;
+	ir->line[i] = st->line;
+	ir->len++;
+}
+
+/* **********label_operand*****************
+ Index of op's label operand, -1 if it has none. *width receives the offset field width
+************************************************ */
+static int label_operand(int op, int * width){
+	int i;
+	for (i = 0; OP_DESC[op].kind[i] != OPK_NONE; i++) {
+		if (OP_DESC[op].kind[i] == OPK_LABEL9 || OP_DESC[op].kind[i] == OPK_LABEL11) {
+			if (width) *width = OP_DESC[op].kind[i] == OPK_LABEL9 ? 9 : 11;
+			return i;
+		}
+		if (OP_DESC[op].kind[i] == OPK_FILL16) {
+			if (width) *width = 16; /*.fill of a label, relocatable objects only*/
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* **********ir_operand*****************
+ Source position of the label operand of IR entry i, for error messages. Lexes that line again,
+ error paths only
+************************************************ */
+static const char * ir_operand(asm_state * st, int i){
+	const char * p = st->src;
+	const char * end = st->src + st->src_len;
+	lexer lx;
+	parsed_line pl;
+	int line;
+	if (st->ir.line[i] <= st->src_line) return NULL; /*asm_stream read it in an earlier block*/
+	for (line = st->src_line + 1; line < st->ir.line[i] && p; line++) {
+		p = memchr(p, '\n', end - p);
+		if (p) p++;
+	}
+	if (!p) return NULL;
+	lexer_init(&lx, st->src, st->src_len, &st->scan);
+	lx.pos = p - st->src;
+	lx.line = line - 1;
+	if (lex_line(&lx, &pl) != OK) return p;
+	if (pl.op == OP_INCLUDE) return st->src + pl.arg[0].off; /*the entry came from the included file*/
+	return st->src + pl.arg[label_operand(st->ir.op[i], NULL)].off;
+}
+
+/* **********ir_check_offset*****************
+ check_offset for the label operand of IR entry i, errors are reported at the operand
+************************************************ */
+static int ir_check_offset(asm_state * st, int i, int offset, int width){
+	if (offset >= (1 << (width - 1)) || offset < -(1 << (width - 1))) {
+		asm_mark(ir_operand(st, i));
+	}
+	return check_offset(offset, width);
+}
+
+/* **********entry_addr*****************
+ Byte address of IR entry e in a relocatable object: the address of its segment plus its place
+ in the segment
+************************************************ */
+static int entry_addr(const asm_state * st, int e){
+	int lo = 0, hi = st->nsegs - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (st->segs[mid].first <= e) lo = mid;
+		else hi = mid - 1;
+	}
+	return st->segs[lo].addr + 2 * (e - st->segs[lo].first - 1);
+}
+
+/*Scope of symbol id of a relocatable object*/
+static int sym_scope_of(const asm_state * st, int id){
+	return id < st->nscopes ? st->scopes[id].scope : SCOPE_LOCAL;
+}
+
+/* **********reloc_field*****************
+ ir_offset of a relocatable object. Labels of this module are resolved through the segments'
+ addresses, an .extern label is imported: the field stays 0 and gets a relocation
+************************************************ */
+static int reloc_field(asm_state * st, int i, int id, int width){
+	int at = st->table.addrs[id];
+	reloc * r;
+	if (at < 0) {
+		if (sym_scope_of(st, id) != SCOPE_EXTERN) {
+			asm_mark(ir_operand(st, i));
+			asm_fail(1, "Error: Label %s can't find.\n", st->table.names[id]);
+		}
+		st->relocs = grow_array(st->relocs, &st->relocs_cap, st->nrelocs + 1, sizeof(reloc));
+		r = &st->relocs[st->nrelocs++];
+		r->word = i;
+		r->sym = id;
+		r->width = width;
+		return 0;
+	}
+	if (width == 16) return entry_addr(st, at - 1);
+	return ir_check_offset(st, i, (entry_addr(st, at - 1) - entry_addr(st, i)) / 2 - 1, width);
+}
+
+/* **********ir_offset*****************
+ Return the encoded offset field of IR entry i's br/jsr/lea target.
+ In one-pass mode a forward reference is queued as a fixup and encoded as 0 for now.
+************************************************ */
+static int ir_offset(asm_state * st, int i){
+	symbol_table * table = &st->table;
+	int id = st->ir.sym[i];
+	int width = 0;
+	int inst = st->image_base + i + 1; /*instruction count of entry i, the .orig line is 1*/
+	label_operand(st->ir.op[i], &width);
+	if (st->relocatable) return reloc_field(st, i, id, width);
+	if (table->addrs[id] < 0) {
+		fixup * f;
+		if (!st->one_pass) {
+			asm_mark(ir_operand(st, i));
+			asm_fail(1, "Error: Label %s can't find.\n", table->names[id]);
+		}
+		st->fixups = grow_array(st->fixups, &st->fixup_cap, st->fixup_len + 1, sizeof(fixup));
+		f = &st->fixups[st->fixup_len];
+		f->sym = id;
+		f->word = st->image_base + i;
+		f->inst = inst;
+		f->width = width;
+		f->next = table->chains[id];
+		table->chains[id] = st->fixup_base + st->fixup_len++;
+		return 0;
+	}
+	if (width == 16) return st->origin + 2 * (table->addrs[id] - 2); /*optimize_ir's .fill of a far target*/
+	DIAG(st, ASM_DIAG_TRACE, "Origin %d, current %d, instruction \"%s\"\n",table->addrs[id],inst,table->names[id]);
+	return ir_check_offset(st, i, table->addrs[id] - inst - 1, width);
+}
+
+/* **********encode_batch*****************
+ Fixed fields of n IR entries starting at first: opcode bits + register fields + constant.
+ One branch-free loop, label offsets are added afterwards
+************************************************ */
+static void encode_batch(const asm_ir * ir, int first, int n, uint16_t * out){
+	const uint8_t * op = ir->op + first;
+	const uint16_t * regs = ir->regs + first;
+	const int32_t * imm = ir->imm + first;
+	int i;
+	for (i = 0; i < n; i++) {
+		out[i] = OP_DESC[op[i]].bits + regs[i] + imm[i];
+	}
+}
+
+/*Machine word of IR entry i, for the one-pass loop and incremental reassembly*/
+static inline int ir_word(asm_state * st, int i){
+	const asm_ir * ir = &st->ir;
+	int word = OP_DESC[ir->op[i]].bits + ir->regs[i] + ir->imm[i];
+	if (ir->sym[i] >= 0) word += ir_offset(st, i);
+	return word;
+}
+
+/* **********par_threads*****************
+ Threads for n units of work, at least min of them per thread. st->threads of 0 is one per core
+************************************************ */
+static int par_threads(const asm_state * st, long n, long min){
+	long threads = st->threads;
+	if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > n / min) threads = n / min;
+	if (threads > PAR_MAX_THREADS) threads = PAR_MAX_THREADS;
+	return threads < 1 ? 1 : (int)threads;
+}
+
+/* **********run_parallel*****************
+ Call fn on each of n items of size elem, item 0 on this thread and the others on threads of
+ their own. Items whose thread cannot be started run here too. Return once all are done
+************************************************ */
+static void run_parallel(void * items, size_t elem, int n, void * (*fn)(void *)){
+	pthread_t thread[PAR_MAX_THREADS];
+	int started[PAR_MAX_THREADS], i;
+	for (i = 1; i < n; i++) {
+		started[i] = pthread_create(&thread[i], NULL, fn, (char *)items + i * elem) == 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (i > 0 && started[i]) pthread_join(thread[i], NULL);
+		else fn((char *)items + i * elem);
+	}
+}
+
+/*Slice of pass 2 encoded by one thread*/
+typedef struct {
+	asm_state * st;
+	int first, end; /*IR entries [first, end)*/
+	int at; /*entry being encoded, the failing one once trap.code is set*/
+	asm_trap trap;
+}encode_slice;
+
+/* **********encode_slice_main*****************
+ Encode one slice into its place in the image. An error stops the slice and stays in its trap
+************************************************ */
+static void * encode_slice_main(void * arg){
+	encode_slice * sl = arg;
+	asm_state * st = sl->st;
+	const int32_t * sym = st->ir.sym;
+	asm_trap * outer = cur_trap;
+	cur_trap = &sl->trap;
+	if (sigsetjmp(sl->trap.bail, 0) == 0) {
+		encode_batch(&st->ir, sl->first, sl->end - sl->first, st->image + sl->first);
+		for (sl->at = sl->first; sl->at < sl->end; sl->at++) {
+			if (sym[sl->at] >= 0) st->image[sl->at] += ir_offset(st, sl->at);
+		}
+	}
+	cur_trap = outer;
+	return NULL;
+}
+
+/* **********encode_ir*****************
+ Pass 2: encode the first n IR entries into the image. Labels are all bound, so every word
+ depends only on its own entry and the table: large inputs are cut into slices encoded on
+ several threads straight into the image. The first error by entry, i.e. by line, is reported
+ as the serial loop would
+************************************************ */
+static void encode_ir(asm_state * st, int n){
+	encode_slice slice[PAR_MAX_THREADS];
+	int nslices = 1, i;
+	/*relocatable objects record relocations and trace runs print every offset in order*/
+	if (!st->relocatable && st->diag_level < ASM_DIAG_TRACE) nslices = par_threads(st, n, PAR_MIN_WORDS);
+	st->image = grow_array(st->image, &st->image_cap, n, sizeof(uint16_t));
+	for (i = 0; i < nslices; i++) {
+		slice[i].st = st;
+		slice[i].first = (int)((long)n * i / nslices);
+		slice[i].end = (int)((long)n * (i + 1) / nslices);
+		slice[i].trap.code = 0;
+		slice[i].trap.where = cur_trap ? cur_trap->where : NULL;
+	}
+	run_parallel(slice, sizeof(encode_slice), nslices, encode_slice_main);
+	for (i = 0; i < nslices; i++) {
+		if (slice[i].trap.code) asm_fail_at(slice[i].trap.where, slice[i].trap.code, "%s", slice[i].trap.msg);
+	}
+	st->image_len = n;
+}
+
+/* **********patch_fixups*****************
+ Fill in the offset fields of every instruction waiting on a label defined at addr
+************************************************ */
+static void patch_fixups(asm_state * st, int chain, int addr){
+	while (chain >= 0) {
+		fixup * f = &st->fixups[chain - st->fixup_base];
+		int i = f->word - st->image_base;
+		DIAG(st, ASM_DIAG_TRACE, "Origin %d, current %d, instruction \"%s\"\n",addr,f->inst,st->table.names[f->sym]);
+		st->image[i] += ir_check_offset(st, i, addr - f->inst - 1, f->width);
+		f->sym = -1;
+		chain = f->next;
+	}
+}
+
+/* **********check_fixups*****************
+ After .end every forward reference must have been patched
+************************************************ */
+static void check_fixups(asm_state * st){
+	int i;
+	for (i = 0; i < st->fixup_len; i++) {
+		if (st->fixups[i].sym >= 0) {
+			asm_fail_at(ir_operand(st, st->fixups[i].word - st->image_base), 1, "Error: Label %s can't find.\n", st->table.names[st->fixups[i].sym]);
+		}
+	}
+}
+
+/*Symbol id of a br/jsr/lea operand, the label may still be undefined*/
+static int label_ref(asm_state * st, const char * label, size_t len){
+	return symtab_ref(&st->table, &st->arena, label, len)->id;
+}
+
+#define ARG(i) st->src + arg[i].off, arg[i].len /* pointer, length of operand i */
+
+/* **********decode_operands*****************
+ Check and convert the operands of one instruction as its descriptor says and append the IR entry.
+ Return DONE for .end, OK otherwise
+************************************************ */
+static int decode_operands(asm_state * st, int op, const token * arg){
+	const op_desc * d = &OP_DESC[op];
+	int regs = 0, imm = 0, sym = -1, i;
+	for (i = 0; i < 4 && d->syntax; i++) {
+		if (!arg[i].len != (d->kind[i] == OPK_NONE)) {
+			asm_fail(4, "%s", d->syntax);
+		}
+	}
+	for (i = 0; d->kind[i] != OPK_NONE; i++) {
+		switch (d->kind[i]) {
+			case OPK_REG_IMM5:
+				if (FOLD(st->src[arg[i].off]) == 'x' || st->src[arg[i].off] == '#') {
+					imm = parse_imm5(ARG(i)) + 32;
+					break;
+				}
+				/* register form */
+				/* fall through */
+			case OPK_REG:
+				regs += read_reg(ARG(i)) << d->shift[i];
+				break;
+			case OPK_IMM6:
+				imm = parse_offset6(ARG(i));
+				break;
+			case OPK_AMOUNT4:
+				imm = parse_amount4(ARG(i));
+				break;
+			case OPK_LABEL9:
+			case OPK_LABEL11:
+				sym = label_ref(st, ARG(i));
+				break;
+			case OPK_TRAPVECT8:
+				if (FOLD(st->src[arg[i].off]) != 'x') {
+					DIAG(st, ASM_DIAG_INFO, "Error, trap vector should be a hex.\n");
+				}
+				imm = parse_trapvect8(ARG(i));
+				break;
+			case OPK_FILL16:
+				if (st->relocatable && isalpha((unsigned char)st->src[arg[i].off]) && FOLD(st->src[arg[i].off]) != 'x') {
+					sym = label_ref(st, ARG(i));
+					break;
+				}
+				imm = parse_word16(ARG(i));
+				break;
+			case OPK_ORIG:
+				imm = st->origin;
+				break;
+		}
+	}
+	if (op == OP_END) return DONE;
+	ir_emit(st, op, regs, imm, sym);
+	return OK;
+}
+
+/*"00".."FF", two hex digits for every byte value*/
+static const char HEX_PAIRS[512 + 1] =
+	"000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* hex text, one "0xABCD" line per word */
+static size_t hex_size(const uint16_t * image, int len){
+	return (size_t)len * 7;
+}
+
+static void hex_render(char * dst, const uint16_t * image, int len){
+	int i;
+	for (i = 0; i < len; i++) {
+		dst[0] = '0';
+		dst[1] = 'x';
+		memcpy(dst + 2, HEX_PAIRS + 2 * (image[i] >> 8), 2);
+		memcpy(dst + 4, HEX_PAIRS + 2 * (image[i] & 0xFF), 2);
+		dst[6] = '\n';
+		dst += 7;
+	}
+}
+
+/* raw big-endian words, origin first */
+static size_t bin_size(const uint16_t * image, int len){
+	return (size_t)len * 2;
+}
+
+static void bin_render(char * dst, const uint16_t * image, int len){
+	int i;
+	for (i = 0; i < len; i++) {
+		dst[2 * i] = image[i] >> 8;
+		dst[2 * i + 1] = image[i] & 0xFF;
+	}
+}
+
+/* object file: 16 byte big-endian header, then the program words without the origin
+   magic[4] version[2] flags[2] origin[2] reserved[2] count[4] */
+static size_t obj_size(const uint16_t * image, int len){
+	return OBJ_HEADER_SIZE + (len > 0 ? (size_t)(len - 1) * 2 : 0);
+}
+
+static void obj_render(char * dst, const uint16_t * image, int len){
+	uint32_t count = len > 0 ? len - 1 : 0;
+	memcpy(dst, OBJ_MAGIC, 4);
+	dst[4] = OBJ_VERSION >> 8;
+	dst[5] = OBJ_VERSION & 0xFF;
+	dst[6] = dst[7] = 0;
+	dst[8] = len > 0 ? image[0] >> 8 : 0;
+	dst[9] = len > 0 ? image[0] & 0xFF : 0;
+	dst[10] = dst[11] = 0;
+	dst[12] = count >> 24;
+	dst[13] = (count >> 16) & 0xFF;
+	dst[14] = (count >> 8) & 0xFF;
+	dst[15] = count & 0xFF;
+	if (count) bin_render(dst + OBJ_HEADER_SIZE, image + 1, count);
+}
+
+static const asm_format OUTPUT_FORMATS[] = {
+	{"hex", hex_size, hex_render},
+	{"bin", bin_size, bin_render},
+	{"obj", obj_size, obj_render},
+};
+
+const asm_format * asm_find_format(const char * name){
+	int i;
+	for (i = 0; i < sizeof(OUTPUT_FORMATS) / sizeof(OUTPUT_FORMATS[0]); i++) {
+		if (strcmp(OUTPUT_FORMATS[i].name, name) == 0) return &OUTPUT_FORMATS[i];
+	}
+	return NULL;
+}
+
+static size_t write_all(int fd, const char * buf, size_t size){
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = write(fd, buf + done, size - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/* **********write_image*****************
+ Render the image into fd (opened read/write) in one go. Large regular files are sized with
+ ftruncate and rendered straight into a shared mapping, everything else through one buffer.
+ Return 0 on success
+************************************************ */
+int asm_write_image(int fd, const asm_format * fmt, const uint16_t * image, int len){
+	size_t size = fmt->size(image, len);
+	size_t done = 0;
+	char * buf;
+	if (size >= MMAP_WRITE_MIN && ftruncate(fd, size) == 0) {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (buf != MAP_FAILED) {
+			fmt->render(buf, image, len);
+			return munmap(buf, size);
+		}
+	}
+	buf = malloc(size ? size : 1);
+	if (!buf) return -1;
+	fmt->render(buf, image, len);
+	done = write_all(fd, buf, size);
+	free(buf);
+	return done == size ? 0 : -1;
+}
+
+static void put16(char * p, unsigned v){
+	p[0] = (v >> 8) & 0xFF;
+	p[1] = v & 0xFF;
+}
+
+static void put32(char * p, uint32_t v){
+	put16(p, v >> 16);
+	put16(p + 2, v & 0xFFFF);
+}
+
+static unsigned get16(const char * p){
+	return ((unsigned char)p[0] << 8) | (unsigned char)p[1];
+}
+
+static uint32_t get32(const char * p){
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+/* **********write_object*****************
+ Write the relocatable object of the last assembly to fd. Layout, big-endian:
+   "LC3R", version:16, segments:16, symbols:32, relocations:32, string bytes:32
+   per segment: address:16, 0:16, words:32, then the words
+   per symbol (one per label id): name offset:32, address:16, REL_EXPORT, REL_IMPORT or REL_LOCAL:16
+   per relocation: segment:16, field width:16, word in segment:32, symbol:32
+   NUL terminated names
+ Return 0 on success
+************************************************ */
+static int write_object(asm_state * st, int fd){
+	const symbol_table * table = &st->table;
+	size_t size = REL_HEADER_SIZE, strings = 0, done;
+	char * buf;
+	char * p;
+	int i, id, seg;
+	for (i = 0; i < st->nsegs; i++) {
+		int end = i + 1 < st->nsegs ? st->segs[i + 1].first : st->image_len;
+		size += 8 + 2 * (size_t)(end - st->segs[i].first - 1);
+	}
+	for (id = 0; id < table->count; id++) strings += strlen(table->names[id]) + 1;
+	size += 8 * (size_t)table->count + 12 * (size_t)st->nrelocs + strings;
+	buf = malloc(size);
+	if (!buf) return -1;
+	memcpy(buf, REL_MAGIC, 4);
+	put16(buf + 4, REL_VERSION);
+	put16(buf + 6, st->nsegs);
+	put32(buf + 8, table->count);
+	put32(buf + 12, st->nrelocs);
+	put32(buf + 16, (uint32_t)strings);
+	p = buf + REL_HEADER_SIZE;
+	for (i = 0; i < st->nsegs; i++) {
+		int end = i + 1 < st->nsegs ? st->segs[i + 1].first : st->image_len;
+		put16(p, st->segs[i].addr);
+		put16(p + 2, 0);
+		put32(p + 4, end - st->segs[i].first - 1);
+		p += 8;
+		bin_render(p, st->image + st->segs[i].first + 1, end - st->segs[i].first - 1);
+		p += 2 * (size_t)(end - st->segs[i].first - 1);
+	}
+	for (id = 0, strings = 0; id < table->count; id++) {
+		int at = table->addrs[id];
+		int scope = sym_scope_of(st, id);
+		put32(p, (uint32_t)strings);
+		put16(p + 4, at < 0 ? 0 : entry_addr(st, at - 1));
+		put16(p + 6, scope == SCOPE_GLOBAL ? REL_EXPORT : scope == SCOPE_EXTERN ? REL_IMPORT : REL_LOCAL);
+		p += 8;
+		strings += strlen(table->names[id]) + 1;
+	}
+	for (i = 0, seg = 0; i < st->nrelocs; i++) {
+		const reloc * r = &st->relocs[i];
+		for (seg = 0; seg + 1 < st->nsegs && st->segs[seg + 1].first <= r->word; seg++);
+		put16(p, seg);
+		put16(p + 2, r->width);
+		put32(p + 4, r->word - st->segs[seg].first - 1);
+		put32(p + 8, r->sym);
+		p += 12;
+	}
+	for (id = 0; id < table->count; id++) {
+		size_t n = strlen(table->names[id]) + 1;
+		memcpy(p, table->names[id], n);
+		p += n;
+	}
+	done = write_all(fd, buf, size);
+	free(buf);
+	return done == size ? 0 : -1;
+}
+
+/*Parts of a loaded relocatable object, checked by open_object*/
+typedef struct {
+	const char * path;
+	const char * segs; /*first segment header*/
+	const char * syms;
+	const char * relocs;
+	const char * names;
+	int nsegs, nsyms, nrelocs;
+	uint32_t names_len;
+}object_view;
+
+/* **********open_object*****************
+ Load the object at path into st->source and check that every part lies inside the file
+************************************************ */
+static void open_object(asm_state * st, const char * path, object_view * ov){
+	const char * buf;
+	const char * end;
+	const char * p;
+	int i;
+	free_source(&st->source);
+	if (load_source(path, &st->source) != 0) {
+		asm_fail(4, "Error: annot open file %s\n",path);
+	}
+	buf = st->source.data;
+	end = buf + st->source.len;
+	ov->path = path;
+	if (st->source.len < REL_HEADER_SIZE || memcmp(buf, REL_MAGIC, 4) != 0 || get16(buf + 4) != REL_VERSION) {
+		asm_fail(4, "Error: %s is not a relocatable object\n", path);
+	}
+	ov->nsegs = get16(buf + 6);
+	ov->nsyms = (int)get32(buf + 8);
+	ov->nrelocs = (int)get32(buf + 12);
+	ov->names_len = get32(buf + 16);
+	ov->segs = p = buf + REL_HEADER_SIZE;
+	for (i = 0; i < ov->nsegs && end - p >= 8; i++) {
+		uint32_t nwords = get32(p + 4);
+		if (nwords > (uint32_t)(end - p - 8) / 2) break;
+		p += 8 + 2 * (size_t)nwords;
+	}
+	ov->syms = p;
+	ov->relocs = p + 8 * (size_t)ov->nsyms;
+	ov->names = ov->relocs + 12 * (size_t)ov->nrelocs;
+	if (i < ov->nsegs || ov->nsyms < 0 || ov->nrelocs < 0 || (size_t)ov->nsyms > (size_t)(end - p) / 8
+		|| (size_t)ov->nrelocs > (size_t)(end - ov->relocs) / 12 || ov->names_len != (size_t)(end - ov->names)
+		|| (ov->names_len && end[-1] != '\0')) {
+		asm_fail(4, "Error: %s is a damaged object\n", path);
+	}
+	for (i = 0; i < ov->nsyms; i++) {
+		if (get32(ov->syms + 8 * i) >= ov->names_len) {
+			asm_fail(4, "Error: %s is a damaged object\n", path);
+		}
+	}
+}
+
+/* **********link_objects*****************
+ Body of asm_link. First sweep: collect the exports and place every segment in the address
+ space. Second sweep: patch the relocations, which only refer to imports: local labels were
+ resolved by their own module, so two modules can use the same one. The linked image runs
+ from the lowest to the highest word in use, gaps between segments are 0
+************************************************ */
+static void link_objects(asm_state * st, const char * const * paths, int n){
+	symbol_table * table = &st->table;
+	object_view ov;
+	int f, i, lo = 0x10000, hi = 0;
+	if (!st->memory) st->memory = malloc(0x8000 * sizeof(uint16_t));
+	if (!st->used) st->used = malloc(0x8000 / 8);
+	if (!st->memory || !st->used) {
+		asm_fail(4, "Error: out of memory\n");
+	}
+	memset(st->used, 0, 0x8000 / 8);
+	for (f = 0; f < n; f++) {
+		const char * p;
+		open_object(st, paths[f], &ov);
+		for (i = 0; i < ov.nsyms; i++) {
+			const char * sym = ov.syms + 8 * i;
+			const char * name = ov.names + get32(sym);
+			if (get16(sym + 6) == REL_EXPORT) {
+				int id = symtab_ref(table, &st->arena, name, strlen(name))->id;
+				if (table->addrs[id] >= 0) {
+					asm_fail(4, "Error: label %s of %s duplicate in the table.\n", name, paths[f]);
+				}
+				table->addrs[id] = get16(sym + 4);
+			}
+		}
+		for (i = 0, p = ov.segs; i < ov.nsegs; i++) {
+			unsigned addr = get16(p);
+			uint32_t w, nwords = get32(p + 4);
+			if (addr + 2 * (size_t)nwords > 0x10000) {
+				asm_fail(3, "Error: Address is Out of 16 bit Memory.\n");
+			}
+			for (w = 0; w < nwords; w++) {
+				unsigned at = addr / 2 + w;
+				if (st->used[at / 64] >> (at % 64) & 1) {
+					asm_fail(4, "Error: segment x%04X of %s overlaps another segment\n", addr, paths[f]);
+				}
+				st->used[at / 64] |= 1ULL << (at % 64);
+				st->memory[at] = get16(p + 8 + 2 * w);
+			}
+			if (nwords && (int)addr < lo) lo = addr;
+			if (nwords && (int)(addr + 2 * nwords) > hi) hi = addr + 2 * nwords;
+			p += 8 + 2 * (size_t)nwords;
+		}
+	}
+	for (f = 0; f < n; f++) {
+		open_object(st, paths[f], &ov);
+		for (i = 0; i < ov.nrelocs; i++) {
+			const char * r = ov.relocs + 12 * i;
+			unsigned seg = get16(r), width = get16(r + 2), s;
+			uint32_t word = get32(r + 4), sym = get32(r + 8);
+			const char * p = ov.segs;
+			const char * name;
+			int id, at;
+			if (seg >= (unsigned)ov.nsegs || sym >= (uint32_t)ov.nsyms || get16(ov.syms + 8 * sym + 6) != REL_IMPORT
+				|| (width != 9 && width != 11 && width != 16)) {
+				asm_fail(4, "Error: %s is a damaged object\n", paths[f]);
+			}
+			for (s = 0; s < seg; s++) p += 8 + 2 * (size_t)get32(p + 4);
+			if (word >= get32(p + 4)) {
+				asm_fail(4, "Error: %s is a damaged object\n", paths[f]);
+			}
+			name = ov.names + get32(ov.syms + 8 * sym);
+			id = symtab_ref(table, &st->arena, name, strlen(name))->id;
+			if (table->addrs[id] < 0) {
+				asm_fail(1, "Error: Label %s can't find.\n", name);
+			}
+			at = get16(p) / 2 + word;
+			if (width == 16) st->memory[at] = table->addrs[id];
+			else st->memory[at] += check_offset((table->addrs[id] - 2 * at - 2) / 2, width);
+		}
+	}
+	if (lo >= hi) {
+		asm_fail(4, "Error: nothing to link\n");
+	}
+	st->image = grow_array(st->image, &st->image_cap, (hi - lo) / 2 + 1, sizeof(uint16_t));
+	st->image[0] = lo;
+	memcpy(st->image + 1, st->memory + lo / 2, (hi - lo));
+	for (i = lo / 2; i < hi / 2; i++) {
+		if (!(st->used[i / 64] >> (i % 64) & 1)) st->image[1 + i - lo / 2] = 0;
+	}
+	st->image_len = (hi - lo) / 2 + 1;
+}
+
+/* **********pass1_check*****************
+ Syntax checks of pass 1 and .orig/.end placement, everything but binding the line's label.
+ Return DONE at .end
+************************************************ */
+static int pass1_check(asm_state * st, const parsed_line * pl){
+	const token * lArg = pl->arg;
+	int lOp = pl->op;
+	int lRet = OK;
+	st->inst_count++;
+	st->line = pl->line;
+	DIAG(st, ASM_DIAG_TRACE, "NUM of Label: %d\nLabel : %.*s\nOP : %s\nArg 1 : %.*s\nArg 2 : %.*s\nArg 3 : %.*s\nArg 4 : %.*s\n\n",
+		 st->label_count, (int)pl->label.len, st->src + pl->label.off, lOp != OP_NONE ? OP_NAME[lOp] : "",
+		 (int)lArg[0].len, st->src + lArg[0].off, (int)lArg[1].len, st->src + lArg[1].off,
+		 (int)lArg[2].len, st->src + lArg[2].off, (int)lArg[3].len, st->src + lArg[3].off);
+	check_label(st->src + pl->label.off, pl->label.len);
+	if (lOp == OP_NONE) {
+		asm_fail(2, "Error: invalid opcode\n");
+	}
+	if (!pl->label.len && lOp == OP_ORIG ) {
+		if ((st->origin != 0 && !st->relocatable) || !lArg[0].len || lArg[1].len || lArg[2].len || lArg[3].len) {
+			asm_fail(2, "Error: .Orig Syntax \n");
+		}
+		else {
+			int tmpaddr = 0;
+			if (parse_literal(st->src + lArg[0].off, lArg[0].len, 0, UINT16_MAX, &tmpaddr)) {
+				asm_fail(3, "Error: Address is Out of 16 bit Memory.\n");
+			}
+			if(check_word_align(tmpaddr)){
+				asm_fail(3, "Error: Not word alignment\n");
+			}
+			else{
+				st->origin = tmpaddr;
+				DIAG(st, ASM_DIAG_INFO, "Start Addr : 0x%04X\n",st->origin);
+				if (st->relocatable) {
+					st->segs = grow_array(st->segs, &st->segs_cap, st->nsegs + 1, sizeof(segment));
+					st->segs[st->nsegs].first = st->ir.len;
+					st->segs[st->nsegs++].addr = st->origin;
+				}
+			}
+		}
+	}
+	if (st->inst_count > 0 && st->origin == 0) {
+		asm_fail(4, "Error, ORIG syntax error\n");
+	}
+	if (st->inst_count > 1 && lOp == OP_ORIG && !st->relocatable) {
+		asm_fail(3, "Error, duplicate .orig\n");
+	}
+	if (lOp == OP_END) {
+		if ( lArg[0].len || lArg[1].len || lArg[2].len || lArg[3].len || pl->label.len){
+			asm_fail(4, "Error END Syntax \n");
+		}
+		
+		else{
+			lRet = DONE;
+			/*printf(".END command = End of Program. Exiting...\n");*/
+		}
+	}
+	return lRet;
+}
+
+/* **********pass1_line*****************
+ Syntax checks for .orig/.end placement and binding of the line's label to the instruction count.
+ Return DONE at .end
+************************************************ */
+static int pass1_line(asm_state * st, const parsed_line * pl){
+	int lRet = pass1_check(st, pl);
+	if(pl->label.len){
+		int pending = add_label(&st->table,&st->arena,st->src + pl->label.off,pl->label.len,st->inst_count);
+		patch_fixups(st, pending, st->inst_count);
+		(st->label_count) += 1;
+	}
+	return lRet;
+}
+
+/* **********declare_symbol*****************
+ .global label or .extern label. In a relocatable object a .global label is exported and an
+ .extern label is left to another module; every other label stays local to its module.
+ Absolute programs check the line and ignore it
+************************************************ */
+static int declare_symbol(asm_state * st, const parsed_line * pl){
+	const token * arg = pl->arg;
+	int scope = pl->op == OP_GLOBAL ? SCOPE_GLOBAL : SCOPE_EXTERN;
+	int id;
+	st->line = pl->line;
+	if (pl->label.len || !arg[0].len || arg[1].len) {
+		asm_fail(4, "Error: Wrong Syntax for .global/.extern\n");
+	}
+	check_label(ARG(0));
+	if (!st->relocatable) return OK;
+	id = label_ref(st, ARG(0));
+	if (id >= st->nscopes) {
+		st->scopes = grow_array(st->scopes, &st->scopes_cap, id + 1, sizeof(sym_scope));
+		memset(st->scopes + st->nscopes, 0, (id + 1 - st->nscopes) * sizeof(sym_scope));
+		st->nscopes = id + 1;
+	}
+	if (st->scopes[id].scope != SCOPE_LOCAL && st->scopes[id].scope != scope) {
+		asm_fail_at(st->src + arg[0].off, 4, "Error: label %s is both .global and .extern\n", st->table.names[id]);
+	}
+	st->scopes[id].scope = scope;
+	st->scopes[id].at = st->src + arg[0].off;
+	return OK;
+}
+
+/* **********check_scopes*****************
+ After pass 1 of a relocatable object: a .global label must be defined here, an .extern one
+ must not be
+************************************************ */
+static void check_scopes(asm_state * st){
+	int id;
+	for (id = 0; id < st->nscopes; id++) {
+		const sym_scope * sc = &st->scopes[id];
+		if (sc->scope == SCOPE_GLOBAL && st->table.addrs[id] < 0) {
+			asm_fail_at(sc->at, 1, "Error: Label %s can't find.\n", st->table.names[id]);
+		}
+		if (sc->scope == SCOPE_EXTERN && st->table.addrs[id] >= 0) {
+			asm_fail_at(sc->at, 4, "Error: .extern label %s is defined in this module\n", st->table.names[id]);
+		}
+	}
+}
+
+/* **********decode_line*****************
+ Decode one line's operands in pass 1. An operand error is held back until pass 2 gets to the
+ line, so a program with several errors reports the same one as when pass 2 did the decoding.
+ Later lines are not decoded once an error is held
+************************************************ */
+static int decode_line(asm_state * st, const parsed_line * pl){
+	asm_trap trap;
+	asm_trap * outer = cur_trap;
+	if (st->recovering) return decode_operands(st, pl->op, pl->arg);
+	if (st->deferred.code) return pl->op == OP_END ? DONE : OK;
+	trap.code = 0;
+	trap.where = outer->where;
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		decode_operands(st, pl->op, pl->arg);
+	}
+	else {
+		st->deferred = trap;
+		st->deferred_at = st->ir.len;
+	}
+	outer->where = trap.where;
+	cur_trap = outer;
+	return pl->op == OP_END ? DONE : OK;
+}
+
+static int read_line(asm_state * st, const parsed_line * pl);
+
+/* **********read_include*****************
+ Scan and lex the private copy of a file for the include cache. Errors are kept in the entry's
+ trap, so a job that includes the file reports them when it gets to them
+************************************************ */
+static void read_include(included_file * f) __attribute__((noinline)); /*keeps the sigsetjmp out of new_include*/
+static void read_include(included_file * f){
+	lexer lx;
+	parsed_line pl;
+	int lRet;
+	if (sigsetjmp(f->fail.bail, 0) != 0) return;
+	scan_source(&f->scan, f->source.data, f->source.len);
+	lexer_init(&lx, f->source.data, f->source.len, &f->scan);
+	do{
+		lRet = lex_line(&lx, &pl);
+		if (lRet == OK) {
+			f->lines = grow_array(f->lines, &f->lines_cap, f->nlines + 1, sizeof(parsed_line));
+			f->lines[f->nlines++] = pl;
+		}
+	}
+	while (lRet != DONE);
+}
+
+/* **********copy_include*****************
+ Read the file open on fd into f's private copy. Return 0 on success, -1 if it cannot be read
+ or memory runs out
+************************************************ */
+static int copy_include(included_file * f, int fd) __attribute__((noinline));
+static int copy_include(included_file * f, int fd){
+	if (sigsetjmp(f->fail.bail, 0) != 0) return -1;
+	return read_source(fd, &f->source);
+}
+
+/* **********new_include*****************
+ Read path into a new cache entry, NULL if it cannot be read. Called with include_lock held
+************************************************ */
+static included_file * new_include(const char * path){
+	asm_trap * outer = cur_trap;
+	included_file * f = calloc(1, sizeof(included_file));
+	const char * slash;
+	struct stat sb;
+	int fd = open(path, O_RDONLY), ret = -1;
+	if (f && fd >= 0 && fstat(fd, &sb) == 0) {
+		/*the key is taken from the descriptor the bytes are read from*/
+		f->path = strdup(path);
+		f->dev = sb.st_dev;
+		f->ino = sb.st_ino;
+		f->size = sb.st_size;
+		f->mtime = ST_MTIM(sb);
+		f->ctime = ST_CTIM(sb);
+		cur_trap = &f->fail; /*read_source reports running out of memory through the trap*/
+		if (f->path) ret = copy_include(f, fd);
+		cur_trap = outer;
+	}
+	if (fd >= 0) close(fd);
+	if (ret != 0) {
+		if (f) {
+			free(f->source.data);
+			free(f->path);
+		}
+		free(f);
+		return NULL;
+	}
+	slash = strrchr(f->path, '/');
+	f->dir_len = slash ? slash - f->path + 1 : 0;
+	cur_trap = &f->fail;
+	read_include(f);
+	cur_trap = outer;
+	f->next = include_cache;
+	include_cache = f;
+	return f;
+}
+
+static void free_include(included_file * f){
+	free_source(&f->source);
+	free(f->scan.bits);
+	free(f->lines);
+	free(f->path);
+	free(f);
+}
+
+/* **********open_include*****************
+ Return the cache entry of path, reading the file if no entry matches it on disk, and hold it
+ for the job until release_include. An older entry of the same file is dropped from the cache.
+ NULL if it cannot be read
+************************************************ */
+static included_file * open_include(const char * path){
+	struct stat sb;
+	included_file * f, ** link;
+	if (stat(path, &sb) != 0 || !S_ISREG(sb.st_mode)) return NULL;
+	pthread_mutex_lock(&include_lock);
+	for (link = &include_cache; (f = *link); link = &f->next) {
+		if (f->dev != sb.st_dev || f->ino != sb.st_ino) continue;
+		if (f->size == sb.st_size && SAME_TIME(f->mtime, ST_MTIM(sb)) && SAME_TIME(f->ctime, ST_CTIM(sb))) break;
+		*link = f->next;
+		f->stale = 1;
+		if (!f->refs) free_include(f);
+		f = NULL;
+		break;
+	}
+	if (!f) f = new_include(path);
+	if (f) f->refs++;
+	pthread_mutex_unlock(&include_lock);
+	return f;
+}
+
+static void release_include(included_file * f){
+	pthread_mutex_lock(&include_lock);
+	if (--f->refs == 0 && f->stale) free_include(f);
+	pthread_mutex_unlock(&include_lock);
+}
+
+/*Let go of the files the last job included*/
+static void release_includes(asm_state * st){
+	int i;
+	for (i = 0; i < st->nincludes; i++) release_include(st->includes[i].file);
+	st->nincludes = 0;
+}
+
+/* **********read_lines*****************
+ Pass 1 over the lines of an included file, numbered as the .include line. An error is caught
+ in trap
+************************************************ */
+static void read_lines(asm_state * st, const included_file * f, const parsed_line * at, const char * path,
+					   asm_trap * trap) __attribute__((noinline)); /*keeps the sigsetjmp out of include_source*/
+static void read_lines(asm_state * st, const included_file * f, const parsed_line * at, const char * path,
+					   asm_trap * trap){
+	asm_trap * outer = cur_trap;
+	parsed_line pl;
+	int i;
+	trap->code = 0;
+	trap->where = outer->where;
+	cur_trap = trap;
+	if (sigsetjmp(trap->bail, 0) != 0) {
+		cur_trap = outer;
+		return;
+	}
+	for (i = 0; i < f->nlines; i++) {
+		pl = f->lines[i];
+		pl.line = at->line;
+		if (read_line(st, &pl) == DONE) {
+			asm_fail(4, "Error: .end in included file %s\n", path);
+		}
+	}
+	if (f->fail.code) asm_fail(f->fail.code, "%s", f->fail.msg);
+	cur_trap = outer;
+}
+
+/* **********include_source*****************
+ .include "file": read the lines of file in place of this one. The path is relative to the
+ including file. A file is read once per program and later .includes of it are skipped;
+ including a file that is still being read is an error. Errors inside the file are reported
+ at the .include. The process caches each file as a copy read into memory, not a mapping, so a
+ file rewritten while it is cached cannot change lines already lexed
+************************************************ */
+static int include_source(asm_state * st, const parsed_line * pl){
+	const char * name = st->src + pl->arg[0].off;
+	size_t len = pl->arg[0].len;
+	const char * src = st->src;
+	size_t src_len = st->src_len;
+	scan_index scan = st->scan;
+	const char * dir = st->dir;
+	size_t dir_len = st->dir_len, base = dir_len;
+	included_file * f;
+	asm_trap trap;
+	asm_trap * outer = cur_trap;
+	char path[PATH_MAX];
+	int i, held = st->deferred.code;
+	if (pl->label.len || len < 3 || name[0] != '"' || name[len - 1] != '"' || pl->arg[1].len) {
+		asm_fail(4, "Error: .include Syntax \n");
+	}
+	if (name[1] == '/') base = 0; /*absolute path*/
+	if (snprintf(path, sizeof(path), "%.*s%s%.*s", (int)base, dir, base && dir[base - 1] != '/' ? "/" : "",
+				 (int)len - 2, name + 1) >= (int)sizeof(path)) {
+		asm_fail_at(name, 4, "Error: annot open file %.*s\n", (int)len - 2, name + 1);
+	}
+	st->includes = grow_array(st->includes, &st->includes_cap, st->nincludes + 1, sizeof(include_use));
+	f = open_include(path);
+	if (!f) {
+		asm_fail_at(name, 4, "Error: annot open file %s\n", path);
+	}
+	for (i = 0; i < st->nincludes; i++) {
+		if (st->includes[i].file != f) continue;
+		release_include(f); /*the job holds it already*/
+		if (st->includes[i].open) asm_fail_at(name, 4, "Error: .include of %s is circular\n", path);
+		return OK;
+	}
+	DIAG(st, ASM_DIAG_INFO, "Include %s\n", path);
+	st->includes[i].file = f;
+	st->includes[i].open = 1;
+	st->nincludes++;
+	st->src = f->source.data;
+	st->src_len = f->source.len;
+	st->scan = f->scan;
+	st->dir = f->path;
+	st->dir_len = f->dir_len;
+	read_lines(st, f, pl, path, &trap);
+	st->src = src;
+	st->src_len = src_len;
+	st->scan = scan;
+	st->dir = dir;
+	st->dir_len = dir_len;
+	st->includes[i].open = 0;
+	if (trap.code) asm_fail_at(name, trap.code, "%s", trap.msg);
+	if (st->deferred.code && !held) st->deferred.where = name;
+	outer->where = name;
+	return OK;
+}
+
+/* **********read_line*****************
+ Pass 1 (or the single pass) over one lexed line. Return DONE at .end
+************************************************ */
+static int read_line(asm_state * st, const parsed_line * pl){
+	int lRet;
+	if (pl->op == OP_INCLUDE) return include_source(st, pl);
+	if (pl->op == OP_GLOBAL || pl->op == OP_EXTERN) return declare_symbol(st, pl);
+	if (st->one_pass) {
+		pass1_line(st, pl);
+		lRet = decode_operands(st, pl->op, pl->arg);
+		if (st->image_len < st->ir.len) emit_word(st, ir_word(st, st->image_len));
+		return lRet;
+	}
+	pass1_line(st, pl);
+	return decode_line(st, pl);
+}
+
+/* **********slice_label*****************
+ Bind a label of a pass 1 slice in the slice's own table
+************************************************ */
+static void slice_label(pass1_slice * sl, const parsed_line * pl){
+	symbol_table * table = &sl->part.table;
+	int id = symtab_ref(table, &sl->part.arena, sl->part.src + pl->label.off, pl->label.len)->id;
+	if (table->addrs[id] >= 0) {
+		asm_fail_at(sl->part.src + pl->label.off, 4, "Error: label duplicate in the table.\n");
+	}
+	table->addrs[id] = sl->part.inst_count;
+	sl->label_pos = grow_array(sl->label_pos, &sl->label_pos_cap, id + 1, sizeof(size_t));
+	sl->label_pos[id] = pl->label.off;
+	sl->part.label_count++;
+}
+
+/* **********pass1_slice_main*****************
+ Pass 1 over one slice: the same checks and decoding as the serial loop, labels go to the slice's
+ table. The first error ends the slice and stays in its trap
+************************************************ */
+static void * pass1_slice_main(void * arg){
+	pass1_slice * sl = arg;
+	asm_state * part = &sl->part;
+	asm_trap * outer = cur_trap;
+	lexer lx;
+	parsed_line pl;
+	int lRet;
+	cur_trap = &sl->trap;
+	lexer_init(&lx, part->src, sl->end, &sl->st->scan);
+	lx.pos = sl->begin;
+	if (sigsetjmp(sl->trap.bail, 0) == 0) {
+		do{
+			lRet = lex_line(&lx, &pl);
+			if (lRet == OK && pl.op == OP_INCLUDE) {
+				sl->included = 1;
+				break;
+			}
+			if (lRet == OK && (pl.op == OP_GLOBAL || pl.op == OP_EXTERN)) {
+				declare_symbol(part, &pl); /*only checked, slices are never relocatable*/
+				continue;
+			}
+			if(lRet != DONE && lRet != EMPTY_LINE){
+				pass1_check(part, &pl);
+				if (pl.label.len) slice_label(sl, &pl);
+				lRet = decode_line(part, &pl);
+				sl->ended = lRet == DONE;
+			}
+		}
+		while (lRet != DONE);
+	}
+	sl->fail_inst = part->inst_count;
+	sl->lines = lx.line;
+	cur_trap = outer;
+	return NULL;
+}
+
+/* **********merge_slice*****************
+ Add the labels of a finished slice to the job's table at their global instruction counts and
+ report its errors. A label already bound by an earlier slice is a duplicate; the slice's own
+ error wins only if it comes first
+************************************************ */
+static void merge_slice(asm_state * st, pass1_slice * sl){
+	symbol_table * table = &st->table;
+	const symbol_table * local = &sl->part.table;
+	int k, dup = -1;
+	sl->map = grow_array(sl->map, &sl->map_cap, local->count, sizeof(int32_t));
+	for (k = 0; k < local->count; k++) {
+		int id = symtab_ref(table, &st->arena, local->names[k], strlen(local->names[k]))->id;
+		int at = local->addrs[k];
+		sl->map[k] = id;
+		if (at < 0) continue;
+		if (table->addrs[id] >= 0) {
+			if (dup < 0 || at < local->addrs[dup]) dup = k;
+			continue;
+		}
+		table->addrs[id] = sl->inst_base + at - 1;
+	}
+	if (dup >= 0 && (!sl->trap.code || local->addrs[dup] <= sl->fail_inst)) {
+		asm_fail_at(st->src + sl->label_pos[dup], 4, "Error: label duplicate in the table.\n");
+	}
+	if (sl->trap.code) asm_fail_at(sl->trap.where, sl->trap.code, "%s", sl->trap.msg);
+	if (sl->part.deferred.code && !st->deferred.code) {
+		st->deferred = sl->part.deferred;
+		st->deferred_at = sl->ir_base + sl->part.deferred_at;
+	}
+	if (sl->trap.where) cur_trap->where = sl->trap.where;
+	st->inst_count = sl->inst_base + sl->part.inst_count - 1;
+	st->label_count += sl->part.label_count;
+	if (sl->part.line) st->line = sl->line_base + sl->part.line;
+}
+
+/* **********copy_slice_main*****************
+ Move a merged slice's IR to its place in the job's IR, with job symbol ids and line numbers
+************************************************ */
+static void * copy_slice_main(void * arg){
+	pass1_slice * sl = arg;
+	const asm_ir * from = &sl->part.ir;
+	asm_ir * ir = &sl->st->ir;
+	int i, at = sl->ir_base;
+	memcpy(ir->op + at, from->op, from->len * sizeof(*ir->op));
+	memcpy(ir->regs + at, from->regs, from->len * sizeof(*ir->regs));
+	memcpy(ir->imm + at, from->imm, from->len * sizeof(*ir->imm));
+	for (i = 0; i < from->len; i++) {
+		ir->sym[at + i] = from->sym[i] >= 0 ? sl->map[from->sym[i]] : -1;
+		ir->line[at + i] = from->line[i] + sl->line_base;
+	}
+	return NULL;
+}
+
+/* **********pass1_slices*****************
+ Pass 1 over the rest of the source after the .orig line, cut at newlines into n slices read on
+ n threads. An exclusive prefix sum over the slices' instruction counts, IR entries and lines
+ places each slice; merging them in order gives the same labels and the same first error as the
+ serial loop. lx->line is moved to the last line read. Return 1 if .end was read, -1 if the
+ program includes files: the guard of a file depends on every line before it, so pass 1 has to be
+ read serially from lx on
+************************************************ */
+static int pass1_slices(asm_state * st, lexer * lx, int n){
+	pass1_slice * sl;
+	size_t rest = st->src_len - lx->pos;
+	int i, merged, ended = 0;
+	if (n > st->slices_cap) {
+		pass1_slice * grown = realloc(st->slices, n * sizeof(pass1_slice));
+		if (!grown) asm_fail(4, "Error: out of memory\n");
+		st->slices = grown;
+		for (; st->slices_cap < n; st->slices_cap++) {
+			sl = &st->slices[st->slices_cap];
+			memset(sl, 0, sizeof(*sl));
+			asm_init(&sl->part);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		const char * nl;
+		sl = &st->slices[i];
+		sl->st = st;
+		sl->begin = i ? st->slices[i - 1].end : lx->pos;
+		sl->end = i + 1 < n ? lx->pos + rest * (i + 1) / n : st->src_len;
+		if (sl->end < sl->begin) sl->end = sl->begin;
+		if (i + 1 < n && sl->end > sl->begin) {
+			nl = memchr(st->src + sl->end - 1, '\n', st->src_len - sl->end + 1);
+			sl->end = nl ? (size_t)(nl - st->src) + 1 : st->src_len;
+		}
+		asm_reset(&sl->part);
+		sl->part.src = st->src;
+		sl->part.src_len = st->src_len;
+		sl->part.origin = st->origin;
+		sl->part.inst_count = 1;
+		sl->part.line = 0;
+		sl->ended = 0;
+		sl->included = 0;
+		sl->trap.code = 0;
+		sl->trap.where = NULL;
+	}
+	run_parallel(st->slices, sizeof(pass1_slice), n, pass1_slice_main);
+	for (i = 0; i < n && !st->slices[i].trap.code; i++) {
+		if (st->slices[i].included) return -1;
+		if (st->slices[i].ended) break;
+	}
+	
+	for (merged = 0; merged < n && !ended; merged++) {
+		sl = &st->slices[merged];
+		sl->inst_base = merged ? sl[-1].inst_base + sl[-1].part.inst_count - 1 : st->inst_count;
+		sl->ir_base = merged ? sl[-1].ir_base + sl[-1].part.ir.len : st->ir.len;
+		sl->line_base = merged ? sl[-1].line_base + sl[-1].lines : lx->line;
+		merge_slice(st, sl);
+		ended = sl->ended;
+	}
+	sl = &st->slices[merged - 1];
+	lx->line = sl->line_base + sl->lines;
+	ir_reserve(&st->ir, sl->ir_base + sl->part.ir.len);
+	run_parallel(st->slices, sizeof(pass1_slice), merged, copy_slice_main);
+	st->ir.len = sl->ir_base + sl->part.ir.len;
+	return ended;
+}
+
+/*br opcode of each n/z/p mask, -1 for none*/
+static const signed char BR_OP[8] = {-1, OP_BRP, OP_BRZ, OP_BRZP, OP_BRN, OP_BRNP, OP_BRNZ, OP_BR};
+
+#define IS_BR(op) ((op) >= OP_BR && (op) <= OP_BRNZP)
+#define BR_COND(op) (OP_DESC[op].bits >> 9 & 7) /* n/z/p mask */
+
+/*How optimize_ir lays out a br, with the words each takes*/
+enum{BR_NEAR, /*br, 1 word*/
+	BR_JSR, /*jsr, behind an inverted br if conditional: 1 or 2 words*/
+	BR_FAR, /*lea r7/ldw r7/jmp r7 through a .fill of the target, behind an inverted br if conditional: 4 or 5 words*/
+	BR_DROPPED /*removed, 0 words*/
+};
+
+/* **********opt_words*****************
+ Words IR entry i takes in layout form
+************************************************ */
+static int opt_words(const asm_ir * ir, int i, int form){
+	int cond = IS_BR(ir->op[i]) && BR_COND(ir->op[i]) != 7;
+	switch (form) {
+		case BR_JSR: return 1 + cond;
+		case BR_FAR: return 4 + cond;
+		case BR_DROPPED: return 0;
+	}
+	return 1;
+}
+
+/* **********opt_emit*****************
+ Append IR entry i of the old IR to out in layout form, every word on i's line
+************************************************ */
+static void opt_emit(asm_ir * out, const asm_ir * ir, int i, int form){
+	int op = ir->op[i], sym = ir->sym[i], n = out->len, k;
+	int cond = IS_BR(op) && BR_COND(op) != 7;
+	if (form == BR_DROPPED) return;
+	ir_reserve(out, n + 5);
+	for (k = 0; k < opt_words(ir, i, form); k++) {
+		out->regs[n + k] = 0;
+		out->imm[n + k] = 0;
+		out->sym[n + k] = -1;
+		out->line[n + k] = ir->line[i];
+	}
+	if (form == BR_NEAR) {
+		out->op[n] = op;
+		out->regs[n] = ir->regs[i];
+		out->imm[n] = ir->imm[i];
+		out->sym[n] = sym;
+		out->len++;
+		return;
+	}
+	if (cond) {
+		/*taken when the original is not, over the long jump*/
+		out->op[n] = BR_OP[BR_COND(op) ^ 7];
+		out->imm[n] = pack_offset9(form == BR_JSR ? 1 : 4);
+		n++;
+	}
+	if (form == BR_JSR) {
+		out->op[n] = OP_JSR;
+		out->sym[n] = sym;
+		n++;
+	}
+	else {
+		out->op[n] = OP_LEA;
+		out->regs[n] = 7 << 9;
+		out->imm[n] = pack_offset9(2);
+		out->op[n + 1] = OP_LDW;
+		out->regs[n + 1] = 7 << 9 | 7 << 6;
+		out->op[n + 2] = OP_JMP;
+		out->regs[n + 2] = 7 << 6;
+		out->op[n + 3] = OP_FILL;
+		out->sym[n + 3] = sym; /*encoded as the target's address*/
+		n += 4;
+	}
+	out->len = n;
+}
+
+/* **********optimize_ir*****************
+ --optimize, between pass 1 and pass 2 of an absolute program:
+ br to an unconditional br is sent on to the end of the chain; nops that carry no label and do
+ not sit next to a .fill (they may be data) are dropped, and so is any br that lands on the next
+ word left; a br whose target is out of offset9 range becomes a jsr, or a lea/ldw/jmp through
+ r7 beyond offset11 (ldw sets the condition codes), behind an inverted br when conditional. Relaxing grows the code and moves
+ labels, so layouts are computed until no br needs a longer form. The IR is then rebuilt and
+ the labels moved to their entries' new places
+************************************************ */
+static void optimize_ir(asm_state * st){
+	asm_ir * ir = &st->ir;
+	symbol_table * table = &st->table;
+	asm_opt_report * rep = &st->opt;
+	asm_ir swap;
+	int n = ir->len, i, id, next, changed;
+	int32_t * tgt, * form, * labelled, * addr;
+	st->opt_work = grow_array(st->opt_work, &st->opt_work_cap, 4 * n + 1, sizeof(int32_t));
+	tgt = st->opt_work;
+	form = tgt + n;
+	labelled = form + n;
+	addr = labelled + n;
+	memset(labelled, 0, n * sizeof(int32_t));
+	for (id = 0; id < table->count; id++) {
+		if (table->addrs[id] > 0 && table->addrs[id] <= n) labelled[table->addrs[id] - 1] = 1;
+	}
+	for (i = 0; i < n; i++) {
+		form[i] = BR_NEAR;
+		tgt[i] = IS_BR(ir->op[i]) && table->addrs[ir->sym[i]] > 0 ? table->addrs[ir->sym[i]] - 1 : -1;
+	}
+	/*jump threading, a chain that loops is cut short after n steps*/
+	for (i = 1; i < n; i++) {
+		int t = tgt[i], sym = ir->sym[i], steps = 0;
+		while (t >= 0 && (ir->op[t] == OP_BR || ir->op[t] == OP_BRNZP) && tgt[t] >= 0 && tgt[t] != t && steps++ < n) {
+			sym = ir->sym[t];
+			t = tgt[t];
+		}
+		if (t != tgt[i]) {
+			ir->sym[i] = sym;
+			tgt[i] = t;
+			rep->threaded++;
+		}
+	}
+	for (i = 1; i < n; i++) {
+		if (ir->op[i] == OP_NOP && !labelled[i] && ir->op[i - 1] != OP_FILL && (i + 1 == n || ir->op[i + 1] != OP_FILL)) {
+			form[i] = BR_DROPPED;
+			rep->nops++;
+		}
+	}
+	/*backwards, so a br is dropped once everything between it and its target is*/
+	for (i = n - 1, next = n; i > 0; i--) {
+		if (form[i] == BR_DROPPED) continue;
+		if (tgt[i] > i && next >= tgt[i]) {
+			form[i] = BR_DROPPED;
+			rep->to_next++;
+		}
+		else next = i;
+	}
+	do{
+		changed = 0;
+		addr[0] = 0;
+		for (i = 0; i < n; i++) addr[i + 1] = addr[i] + opt_words(ir, i, form[i]);
+		for (i = 1; i < n; i++) {
+			int at, offset, f;
+			if (tgt[i] < 0 || form[i] == BR_DROPPED || form[i] == BR_FAR) continue;
+			at = addr[i] + (form[i] != BR_NEAR && BR_COND(ir->op[i]) != 7); /*the word holding the offset*/
+			offset = addr[tgt[i]] - at - 1;
+			f = offset >= FIELD_MIN(9, 1) && offset <= FIELD_MAX(9, 1) ? BR_NEAR
+				: offset >= FIELD_MIN(11, 1) && offset <= FIELD_MAX(11, 1) ? BR_JSR : BR_FAR;
+			if (f > form[i]) {
+				form[i] = f;
+				changed = 1;
+			}
+		}
+	}
+	while (changed);
+	rep->before = n - 1;
+	rep->after = addr[n] - 1;
+	for (i = 1; i < n; i++) rep->relaxed += form[i] == BR_JSR || form[i] == BR_FAR;
+	if (rep->after == rep->before && !rep->relaxed) return; /*threading alone rewrote entries in place*/
+	st->opt_ir.len = 0;
+	for (i = 0; i < n; i++) opt_emit(&st->opt_ir, ir, i, form[i]);
+	for (id = 0; id < table->count; id++) {
+		if (table->addrs[id] > 0 && table->addrs[id] <= n) table->addrs[id] = addr[table->addrs[id] - 1] + 1;
+	}
+	swap = *ir;
+	*ir = st->opt_ir;
+	st->opt_ir = swap;
+}
+
+/* **********assemble_source*****************
+ Run both passes (or the single pass) over st->src into st->image
+************************************************ */
+static void assemble_source(asm_state * st){
+	lexer lx;
+	parsed_line pl;
+	int lRet, ended = 0, nslices = 1;
+	
+	phase_begin(st, ASM_PHASE_PASS1);
+	scan_source(&st->scan, st->src, st->src_len);
+	lexer_init(&lx, st->src, st->src_len, &st->scan);
+	if (st->one_pass) {
+		/*Single pass: check, bind labels and encode each line as it is read*/
+		do{
+			lRet = lex_line(&lx, &pl);
+			if(lRet != DONE && lRet != EMPTY_LINE){
+				lRet = read_line(st, &pl);
+			}
+			if (pl.op != OP_END && lRet == DONE) {
+				asm_fail(4, "Error, no end for the program\n");
+			}
+		}
+		while (lRet != DONE);
+		check_fixups(st);
+		if (st->stats) st->stats->lines += lx.line;
+		return;
+	}
+	
+	/*Read instructions line by line 1st Round
+	Bond label to specific address(instruction count) and decode the operands into the IR.
+	Large sources are read in slices on several threads once .orig is known*/
+	if (!st->relocatable && st->diag_level < ASM_DIAG_INFO) nslices = par_threads(st, st->src_len, PAR_MIN_BYTES);
+	do{
+		lRet = lex_line(&lx, &pl);
+		if(lRet != DONE && lRet != EMPTY_LINE){
+			lRet = read_line(st, &pl);
+			ended = lRet == DONE;
+			if (!ended && nslices > 1 && st->origin != 0) {
+				int sliced = pass1_slices(st, &lx, nslices);
+				nslices = 1;
+				if (sliced >= 0) {
+					ended = sliced;
+					lRet = DONE;
+				}
+			}
+		}
+	}
+	while (lRet != DONE);
+	if (st->stats) st->stats->lines += lx.line;
+	
+	phase_begin(st, ASM_PHASE_PASS2);
+	DIAG(st, ASM_DIAG_TRACE, "Starting 2nd passing\n");
+	if (st->optimize && ended && !st->deferred.code) optimize_ir(st);
+	
+	/*2nd pass encodes the IR, labels are all known now*/
+	encode_ir(st, st->deferred.code ? st->deferred_at : st->ir.len);
+	if (st->deferred.code) {
+		asm_fail_at(st->deferred.where, st->deferred.code, "%s", st->deferred.msg);
+	}
+	if (!ended) {
+		asm_fail(4, "Error, no end for the program\n");
+	}
+	if (st->relocatable) check_scopes(st);
+}
+
+/* **********stream_flush*****************
+ asm_stream: write out the words no forward reference is waiting on and drop them, with their IR
+ entries and the fixups already patched, from the front of the window. Words are only written
+ in runs of STREAM_FLUSH_MIN or half the window, so moving the rest down stays linear; all
+ writes every word, for the end of the program
+************************************************ */
+static void stream_flush(asm_state * st, int fd, const asm_format * fmt, int all){
+	asm_ir * ir = &st->ir;
+	int ready = st->image_len, head = 0, rest;
+	size_t size;
+	while (head < st->fixup_len && st->fixups[head].sym < 0) head++;
+	if (head < st->fixup_len) ready = st->fixups[head].word - st->image_base;
+	if (st->image_len > st->peak_window) st->peak_window = st->image_len;
+	if (!all && (ready == 0 || (ready < STREAM_FLUSH_MIN && ready * 2 < st->image_len))) return;
+	phase_begin(st, ASM_PHASE_OUTPUT);
+	size = fmt->size(st->image, ready);
+	if (size > st->out_cap) {
+		free(st->out_buf);
+		st->out_buf = malloc(size);
+		st->out_cap = st->out_buf ? size : 0;
+		if (!st->out_buf) asm_fail(4, "Error: out of memory\n");
+	}
+	fmt->render(st->out_buf, st->image, ready);
+	if (write_all(fd, st->out_buf, size) != size) {
+		asm_fail(4, "Error: annot write output\n");
+	}
+	if (st->stats) st->stats->words += ready;
+	rest = st->image_len - ready;
+	memmove(st->image, st->image + ready, rest * sizeof(*st->image));
+	memmove(ir->op, ir->op + ready, rest * sizeof(*ir->op));
+	memmove(ir->regs, ir->regs + ready, rest * sizeof(*ir->regs));
+	memmove(ir->imm, ir->imm + ready, rest * sizeof(*ir->imm));
+	memmove(ir->sym, ir->sym + ready, rest * sizeof(*ir->sym));
+	memmove(ir->line, ir->line + ready, rest * sizeof(*ir->line));
+	st->image_len = ir->len = rest;
+	st->image_base += ready;
+	memmove(st->fixups, st->fixups + head, (st->fixup_len - head) * sizeof(fixup));
+	st->fixup_len -= head;
+	st->fixup_base += head;
+	phase_begin(st, ASM_PHASE_PASS1);
+}
+
+/* **********stream_source*****************
+ asm_stream: one pass over the input, read in blocks of whole lines. After each block the words
+ before the oldest unresolved forward reference are written out, so memory holds one block of
+ source, the window of words still waiting on a label and the symbol table
+************************************************ */
+static void stream_source(asm_state * st, int in_fd, int out_fd, const asm_format * fmt){
+	source_buf * in = &st->source;
+	size_t cap = STREAM_BLOCK, len = 0, end;
+	ssize_t n = 1;
+	lexer lx;
+	parsed_line pl;
+	int lRet, ended = 0;
+	in->data = malloc(cap);
+	in->len = 0;
+	in->mapped = 0;
+	if (!in->data) asm_fail(4, "Error: out of memory\n");
+	phase_begin(st, ASM_PHASE_PASS1);
+	while (!ended && n > 0) {
+		n = read(in_fd, in->data + len, cap - len);
+		if (n < 0) asm_fail(4, "Error: annot read input\n");
+		len += n;
+		for (end = len; n > 0 && end > 0 && in->data[end - 1] != '\n'; end--); /*at EOF the last line needs no '\n'*/
+		if (end == 0 && n > 0) {
+			/*no whole line yet*/
+			if (len == cap) {
+				char * grown = realloc(in->data, cap * 2);
+				if (!grown) asm_fail(4, "Error: out of memory\n");
+				in->data = grown;
+				cap *= 2;
+			}
+			continue;
+		}
+		st->src = in->data;
+		st->src_len = end;
+		scan_source(&st->scan, st->src, end);
+		lexer_init(&lx, st->src, end, &st->scan);
+		lx.line = st->src_line;
+		do{
+			lRet = lex_line(&lx, &pl);
+			if(lRet != DONE && lRet != EMPTY_LINE){
+				lRet = read_line(st, &pl);
+				ended = lRet == DONE;
+			}
+		}
+		while (lRet != DONE);
+		if (st->stats) st->stats->lines += lx.line - st->src_line;
+		if (ended) break;
+		stream_flush(st, out_fd, fmt, 0);
+		st->src_line = lx.line;
+		memmove(in->data, in->data + end, len - end);
+		len -= end;
+	}
+	if (!ended) {
+		asm_fail(4, "Error, no end for the program\n");
+	}
+	check_fixups(st);
+	stream_flush(st, out_fd, fmt, 1);
+}
+
+/* **********lines_reserve*****************
+ Make room for n lines in every per-line array of the cache
+************************************************ */
+static void lines_reserve(line_cache * lc, int n){
+	int cap;
+	if (n <= lc->cap) return;
+	cap = lc->cap;
+	lc->hash = grow_array(lc->hash, &cap, n, sizeof(uint64_t));
+	cap = lc->cap;
+	lc->next_hash = grow_array(lc->next_hash, &cap, n, sizeof(uint64_t));
+	cap = lc->cap;
+	lc->first = grow_array(lc->first, &cap, n, sizeof(int32_t));
+	cap = lc->cap;
+	lc->label = grow_array(lc->label, &cap, n, sizeof(int32_t));
+	lc->start = grow_array(lc->start, &lc->cap, n, sizeof(size_t));
+}
+
+/* **********hash_line*****************
+ 64 bit hash of len bytes, 8 bytes per step
+************************************************ */
+static uint64_t hash_line(const char * p, size_t len){
+	uint64_t h = len * 0x9E3779B97F4A7C15ULL;
+	uint64_t w;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, p, len);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	return h * 0xC4CEB9FE1A85EC53ULL;
+}
+
+/* **********hash_lines*****************
+ Find the lines of st->src with the newline bitmap and hash each into next_hash.
+ Return the number of lines
+************************************************ */
+static int hash_lines(asm_state * st){
+	line_cache * lc = &st->lines;
+	const uint64_t * nl = st->scan.nl;
+	size_t len = st->src_len, w, nwords = (len + 63) / 64;
+	int n = 0, i;
+	if (len == 0) return 0;
+	lines_reserve(lc, 2);
+	lc->start[n++] = 0;
+	for (w = 0; w < nwords; w++) {
+		uint64_t m = nl[w];
+		while (m) {
+			size_t pos = (w << 6) + __builtin_ctzll(m);
+			m &= m - 1;
+			lines_reserve(lc, n + 2);
+			lc->start[n++] = pos + 1;
+		}
+	}
+	if (lc->start[n - 1] == len) n--; /*the final '\n' ends the last line*/
+	else lc->start[n] = len + 1;
+	for (i = 0; i < n; i++) {
+		lc->next_hash[i] = hash_line(st->src + lc->start[i], lc->start[i + 1] - 1 - lc->start[i]);
+	}
+	return n;
+}
+
+/* **********record_lines*****************
+ Rebuild the per-line records after a full assembly of st->src
+************************************************ */
+static void record_lines(asm_state * st){
+	line_cache * lc = &st->lines;
+	const asm_ir * ir = &st->ir;
+	uint64_t * swap;
+	int n, line, i = 0, id;
+	n = hash_lines(st); /*assemble_source scanned st->src*/
+	lines_reserve(lc, n + 1);
+	swap = lc->hash;
+	lc->hash = lc->next_hash;
+	lc->next_hash = swap;
+	lc->nlines = n;
+	lc->orig_line = ir->line[0] - 1;
+	lc->end_line = st->line - 1;
+	for (line = 0; line <= lc->end_line; line++) {
+		while (i < ir->len && ir->line[i] - 1 < line) i++;
+		lc->first[line] = i;
+		lc->label[line] = -1;
+	}
+	lc->first[lc->end_line + 1] = ir->len;
+	lc->refs = grow_array(lc->refs, &lc->refs_cap, st->table.count + 1, sizeof(int32_t));
+	memset(lc->refs, 0, st->table.count * sizeof(int32_t));
+	for (id = 0; id < st->table.count; id++) {
+		if (st->table.addrs[id] > 0) lc->label[ir->line[st->table.addrs[id] - 1] - 1] = id;
+	}
+	for (i = 0; i < ir->len; i++) {
+		if (ir->sym[i] >= 0) lc->refs[ir->sym[i]]++;
+	}
+	lc->valid = 1;
+}
+
+/* **********ir_splice*****************
+ Move the nr entries of size elem appended at arr[len] into [lo, lo + nr), in place of [lo, hi)
+************************************************ */
+static void ir_splice(asm_state * st, void * arr, size_t elem, int lo, int hi, int len, int nr){
+	char * a = arr;
+	line_cache * lc = &st->lines;
+	lc->tmp = grow_array(lc->tmp, &lc->tmp_cap, nr + 1, 8);
+	memcpy(lc->tmp, a + len * elem, nr * elem);
+	memmove(a + (lo + nr) * elem, a + hi * elem, (len - hi) * elem);
+	memcpy(a + lo * elem, lc->tmp, nr * elem);
+}
+
+/* **********reassemble_lines*****************
+ Reassemble st->src against the records of the previous source: lines in the unchanged head and
+ tail keep their IR entries and words, the lines between are decoded again and only words whose
+ label offset can have moved are encoded again. Any error, or an edit touching .orig or .end,
+ returns 0 so the caller assembles everything and reports exactly what a full run would.
+ Only decoding and encoding are limited to the edit: the scan, the tail renumbering, the symbol
+ walk and the encode scan all run over the whole program
+************************************************ */
+static int reassemble_lines(asm_state * st){
+	line_cache * lc = &st->lines;
+	asm_ir * ir = &st->ir;
+	symbol_table * table = &st->table;
+	lexer lx;
+	parsed_line pl;
+	uint64_t * swap;
+	int n, old_n = lc->nlines, head, tail, old_hi, new_hi;
+	int lo, hi, len = ir->len, nsyms = table->count, nr, dwords, dlines, line, i, id;
+	phase_begin(st, ASM_PHASE_PASS1);
+	scan_source(&st->scan, st->src, st->src_len);
+	n = hash_lines(st);
+	for (head = 0; head < n && head < old_n && lc->next_hash[head] == lc->hash[head]; head++);
+	for (tail = 0; tail < n - head && tail < old_n - head && lc->next_hash[n - 1 - tail] == lc->hash[old_n - 1 - tail]; tail++);
+	old_hi = old_n - tail; /*lines [head, old_hi) were replaced by [head, new_hi)*/
+	new_hi = n - tail;
+	if (head > lc->end_line) {
+		/*only lines past .end changed, the image stays*/
+		swap = lc->hash;
+		lc->hash = lc->next_hash;
+		lc->next_hash = swap;
+		lc->nlines = n;
+		return 1;
+	}
+	if (head <= lc->orig_line || old_hi > lc->end_line) return 0;
+	DIAG(st, ASM_DIAG_TRACE, "Reassembling lines %d to %d\n", head + 1, new_hi);
+	lo = lc->first[head];
+	hi = lc->first[old_hi];
+	dlines = new_hi - old_hi;
+	
+	/*drop the old lines' labels and references*/
+	for (line = head; line < old_hi; line++) {
+		if (lc->label[line] >= 0) table->addrs[lc->label[line]] = -1;
+	}
+	for (i = lo; i < hi; i++) {
+		if (ir->sym[i] >= 0) lc->refs[ir->sym[i]]--;
+	}
+	
+	/*decode the new lines after the last IR entry, the tail's labels still hold their old address*/
+	lexer_init(&lx, st->src, st->src_len, &st->scan);
+	lx.pos = lc->start[head];
+	lx.line = head;
+	st->one_pass = 0;
+	for (line = head; line < new_hi; line++) {
+		if (lex_line(&lx, &pl) != OK) continue;
+		if (pl.op == OP_ORIG || pl.op == OP_END || pl.op >= OP_INCLUDE) return 0;
+		st->inst_count = lo + ir->len - len;
+		pass1_line(st, &pl);
+		decode_operands(st, pl.op, pl.arg);
+	}
+	nr = ir->len - len;
+	dwords = nr - (hi - lo);
+	lc->refs = grow_array(lc->refs, &lc->refs_cap, table->count + 1, sizeof(int32_t));
+	memset(lc->refs + nsyms, 0, (table->count - nsyms) * sizeof(int32_t));
+	for (i = len; i < len + nr; i++) {
+		if (ir->sym[i] < 0) continue;
+		if (table->addrs[ir->sym[i]] < 0) return 0;
+		lc->refs[ir->sym[i]]++;
+	}
+	for (line = head; line < old_hi; line++) {
+		id = lc->label[line];
+		if (id >= 0 && table->addrs[id] < 0 && lc->refs[id] > 0) return 0;
+	}
+	
+	/*move the new entries in place of the old ones, then renumber the tail*/
+	ir_splice(st, ir->op, sizeof(*ir->op), lo, hi, len, nr);
+	ir_splice(st, ir->regs, sizeof(*ir->regs), lo, hi, len, nr);
+	ir_splice(st, ir->imm, sizeof(*ir->imm), lo, hi, len, nr);
+	ir_splice(st, ir->sym, sizeof(*ir->sym), lo, hi, len, nr);
+	ir_splice(st, ir->line, sizeof(*ir->line), lo, hi, len, nr);
+	ir->len = len + dwords;
+	for (i = lo + nr; i < ir->len; i++) ir->line[i] += dlines;
+	st->image = grow_array(st->image, &st->image_cap, len + nr, sizeof(uint16_t));
+	memmove(st->image + lo + nr, st->image + hi, (len - hi) * sizeof(uint16_t));
+	st->image_len = ir->len;
+	
+	lines_reserve(lc, n + 1);
+	memmove(lc->first + new_hi, lc->first + old_hi, (lc->end_line + 2 - old_hi) * sizeof(int32_t));
+	memmove(lc->label + new_hi, lc->label + old_hi, (lc->end_line + 1 - old_hi) * sizeof(int32_t));
+	lc->end_line += dlines;
+	for (line = new_hi; line <= lc->end_line + 1; line++) lc->first[line] += dwords;
+	for (line = new_hi; line <= lc->end_line; line++) {
+		if (lc->label[line] >= 0) table->addrs[lc->label[line]] += dwords;
+	}
+	for (line = head, i = lo; line < new_hi; line++) {
+		lc->first[line] = i;
+		lc->label[line] = -1;
+		while (i < lo + nr && ir->line[i] - 1 == line) i++;
+	}
+	for (id = 0; id < table->count; id++) {
+		int at = table->addrs[id] - 1;
+		if (at >= lo && at < lo + nr) lc->label[ir->line[at] - 1] = id;
+	}
+	
+	/*encode the new words and those whose target sits on the other side of the edit*/
+	phase_begin(st, ASM_PHASE_PASS2);
+	for (i = 0; i < ir->len; i++) {
+		int in_edit = i >= lo && i < lo + nr;
+		if (!in_edit && ir->sym[i] >= 0) {
+			int at = table->addrs[ir->sym[i]] - 1;
+			in_edit = (at >= lo && at < lo + nr) || (dwords && (i < lo) != (at < lo));
+		}
+		if (in_edit) st->image[i] = ir_word(st, i);
+	}
+	swap = lc->hash;
+	lc->hash = lc->next_hash;
+	lc->next_hash = swap;
+	lc->nlines = n;
+	if (st->stats) st->stats->lines += new_hi - head;
+	return 1;
+}
+
+/* **********try_reassemble*****************
+ reassemble_lines under its own trap: an error there only means a full run is needed
+************************************************ */
+static int try_reassemble(asm_state * st){
+	asm_trap trap;
+	asm_trap * outer = cur_trap;
+	trap.code = 0;
+	trap.where = NULL;
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		int done = reassemble_lines(st);
+		cur_trap = outer;
+		return done;
+	}
+	cur_trap = outer;
+	return 0;
+}
+
+/* **********locate_error*****************
+ Turn the trap's source position into a line and column
+************************************************ */
+static void locate_error(const asm_state * st, const asm_trap * trap, asm_error * err){
+	const char * p;
+	const char * line_start = st->src;
+	err->line = err->column = 0;
+	if (!trap->where || !st->src || trap->where < st->src || trap->where > st->src + st->src_len) return;
+	err->line = st->src_line + 1;
+	for (p = st->src; p < trap->where; p++) {
+		if (*p == '\n') {
+			err->line++;
+			line_start = p + 1;
+		}
+	}
+	err->column = (int)(trap->where - line_start) + 1;
+}
+
+/* **********add_error*****************
+ collect_errors: record an error, keeping the list after the first entry in line order.
+ Errors with no line go last. Return 0 once the list is full
+************************************************ */
+static int add_error(asm_state * st, const asm_error * err){
+	int i;
+	if (st->nerrors >= st->max_errors) return 0;
+	if (st->nerrors > 0 && err->code == st->errors[0].code && err->line == st->errors[0].line
+		&& err->column == st->errors[0].column && strcmp(err->message, st->errors[0].message) == 0) {
+		return 1; /*the error already returned*/
+	}
+	st->errors = grow_array(st->errors, &st->errors_cap, st->nerrors + 1, sizeof(asm_error));
+	for (i = st->nerrors; i > 1; i--) {
+		const asm_error * e = &st->errors[i - 1];
+		if (err->line && (!e->line || e->line > err->line || (e->line == err->line && e->column > err->column))) {
+			st->errors[i] = *e;
+		}
+		else break;
+	}
+	st->errors[i] = *err;
+	st->nerrors++;
+	return st->nerrors < st->max_errors;
+}
+
+/*Steps of one line (or one IR entry) in collect_errors*/
+enum{STEP_LEX, STEP_CHECK, STEP_LABEL, STEP_DECODE, STEP_ENCODE};
+
+/* **********try_step*****************
+ collect_errors: run one step under its own trap. A failure is recorded if record is set.
+ Return the step's result, -1 if it failed
+************************************************ */
+static int try_step(asm_state * st, int step, lexer * lx, parsed_line * pl, int i, int record) __attribute__((noinline));
+static int try_step(asm_state * st, int step, lexer * lx, parsed_line * pl, int i, int record){
+	asm_trap trap;
+	asm_trap * outer = cur_trap;
+	int lRet = OK;
+	trap.code = 0;
+	trap.where = step == STEP_ENCODE ? NULL : outer->where; /*the line's first token, marked by STEP_LEX*/
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		switch (step) {
+			case STEP_LEX:
+				lRet = lex_line(lx, pl);
+				break;
+			case STEP_CHECK:
+				if (pl->op == OP_INCLUDE) lRet = include_source(st, pl);
+				else if (pl->op == OP_GLOBAL || pl->op == OP_EXTERN) lRet = declare_symbol(st, pl);
+				else lRet = pass1_check(st, pl);
+				break;
+			case STEP_LABEL:
+				add_label(&st->table, &st->arena, st->src + pl->label.off, pl->label.len, st->inst_count);
+				st->label_count++;
+				break;
+			case STEP_DECODE:
+				decode_operands(st, pl->op, pl->arg);
+				break;
+			case STEP_ENCODE:
+				st->image[i] = ir_word(st, i);
+				break;
+		}
+		if (step == STEP_LEX) outer->where = trap.where;
+	}
+	else {
+		asm_error err;
+		err.code = trap.code;
+		memcpy(err.message, trap.msg, sizeof(err.message));
+		locate_error(st, &trap, &err);
+		if (record && !add_error(st, &err)) {
+			cur_trap = outer;
+			siglongjmp(outer->bail, 1); /*the list is full*/
+		}
+		lRet = -1;
+	}
+	cur_trap = outer;
+	return lRet;
+}
+
+/* **********recover_lines*****************
+ Body of collect_errors. Pass 1 reads every line; a line that fails is recorded and still takes
+ its instruction slot (a nop in the IR), so the labels after it keep their addresses. A missing
+ or bad .orig is assumed. Pass 2 then encodes every entry
+************************************************ */
+static void recover_lines(asm_state * st){
+	lexer lx;
+	parsed_line pl;
+	int lRet, ok, ended = 0, i;
+	scan_source(&st->scan, st->src, st->src_len);
+	lexer_init(&lx, st->src, st->src_len, &st->scan);
+	do{
+		lRet = try_step(st, STEP_LEX, &lx, &pl, 0, 1);
+		if (lRet == DONE || lRet == EMPTY_LINE) continue;
+		st->line = pl.line;
+		if (lRet < 0) {
+			st->inst_count++; /*the line was meant to be an instruction*/
+		}
+		else {
+			lRet = try_step(st, STEP_CHECK, &lx, &pl, 0, 1);
+			ok = lRet >= 0;
+			ended = lRet == DONE;
+			if (pl.op >= OP_INCLUDE) continue; /*no instruction slot, nothing to bind or decode*/
+			if (pl.label.len) ok &= try_step(st, STEP_LABEL, &lx, &pl, 0, ok) >= 0;
+			if (ok) try_step(st, STEP_DECODE, &lx, &pl, 0, 1);
+		}
+		if (st->origin == 0) {
+			/*assume a .orig, so the lines after it are checked as usual*/
+			st->origin = 2;
+			if (st->relocatable && st->nsegs == 0) {
+				st->segs = grow_array(st->segs, &st->segs_cap, 1, sizeof(segment));
+				st->segs[0].first = 0;
+				st->segs[0].addr = st->origin;
+				st->nsegs = 1;
+			}
+		}
+		while (st->ir.len < st->inst_count && !ended) ir_emit(st, OP_NOP, 0, 0, -1);
+	}
+	while (lRet != DONE && !ended);
+	st->image = grow_array(st->image, &st->image_cap, st->ir.len, sizeof(uint16_t));
+	for (i = 0; i < st->ir.len; i++) {
+		if (st->ir.sym[i] >= 0) try_step(st, STEP_ENCODE, &lx, &pl, i, 1);
+	}
+	if (!ended) {
+		asm_error err;
+		err.code = 4;
+		err.line = err.column = 0;
+		snprintf(err.message, sizeof(err.message), "Error, no end for the program\n");
+		add_error(st, &err);
+	}
+}
+
+/* **********collect_errors*****************
+ After an error, read the program again from the start to find the others, up to max_errors in
+ all. first, the error the job stops at without max_errors, stays first and keeps the exit code
+************************************************ */
+static void collect_errors(asm_state * st, const asm_error * first) __attribute__((noinline));
+static void collect_errors(asm_state * st, const asm_error * first){
+	const char * src = st->src;
+	size_t src_len = st->src_len;
+	int outfd = st->outfd, diag_level = st->diag_level, one_pass = st->one_pass;
+	asm_stats * stats = st->stats;
+	asm_trap trap;
+	trap.code = 0;
+	trap.where = NULL;
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		st->errors = grow_array(st->errors, &st->errors_cap, 1, sizeof(asm_error));
+		st->errors[0] = *first;
+		st->nerrors = 1;
+	}
+	cur_trap = NULL;
+	if (st->max_errors < 2 || !src || trap.code) return;
+	asm_reset(st);
+	st->errors[0] = *first;
+	st->nerrors = 1;
+	st->src = src;
+	st->src_len = src_len;
+	st->outfd = outfd;
+	st->diag_level = ASM_DIAG_QUIET;
+	st->stats = NULL;
+	st->one_pass = 0;
+	st->recovering = 1;
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) recover_lines(st);
+	cur_trap = NULL;
+	st->recovering = 0;
+	st->one_pass = one_pass;
+	st->stats = stats;
+	st->diag_level = diag_level;
+	st->ir.len = 0; /*the IR and image of a failed job are not kept*/
+	st->image_len = 0;
+}
+
+static void set_options(asm_state * st, const asm_options * opts){
+	st->relocatable = opts ? opts->relocatable : 0;
+	st->one_pass = opts && !st->relocatable ? opts->one_pass : 0;
+	st->optimize = opts && !st->relocatable && !st->one_pass ? opts->optimize : 0;
+	st->threads = opts ? opts->threads : 0;
+	st->dir = opts ? opts->include_dir : NULL;
+	st->dir_len = st->dir ? strlen(st->dir) : 0;
+	st->diag_level = opts ? opts->diag_level : ASM_DIAG_QUIET;
+	st->diag = opts ? opts->diag : NULL;
+	st->stats = opts ? opts->stats : NULL;
+	st->max_errors = opts ? opts->max_errors : 0;
+	if (st->stats && st->stats->counters) st->stats->have_counters = counters_open(st) == 0;
+}
+
+static void set_error(asm_state * st, asm_trap * trap, asm_error * err){
+	asm_error first;
+	if (!err) err = &first;
+	err->code = trap->code;
+	memcpy(err->message, trap->msg, sizeof(err->message));
+	locate_error(st, trap, err);
+	if (trap->code) collect_errors(st, err);
+	else st->nerrors = 0;
+}
+
+asm_ctx * asm_ctx_create(void){
+	asm_state * st = malloc(sizeof(asm_state));
+#ifdef DEBUG
+	check_op_hash();
+#endif
+	if (!st) return NULL;
+	asm_init(st);
+	return st;
+}
+
+void asm_ctx_destroy(asm_ctx * ctx){
+	if (!ctx) return;
+	asm_free(ctx);
+	free(ctx);
+}
+
+void asm_print_stats(asm_ctx * ctx, FILE * out){
+	symtab_print_stats(&ctx->table, out);
+}
+
+const asm_ir * asm_get_ir(asm_ctx * ctx){
+	ctx->ir.nsyms = ctx->table.count;
+	ctx->ir.sym_addr = ctx->table.addrs;
+	ctx->ir.sym_name = ctx->table.names;
+	return &ctx->ir;
+}
+
+const uint16_t * asm_get_image(asm_ctx * ctx, size_t * nwords){
+	*nwords = ctx->image_base || ctx->relocatable ? 0 : ctx->image_len;
+	return ctx->image;
+}
+
+const asm_error * asm_get_errors(asm_ctx * ctx, int * n){
+	*n = ctx->nerrors;
+	return ctx->errors;
+}
+
+const asm_opt_report * asm_get_opt_report(asm_ctx * ctx){
+	return &ctx->opt;
+}
+
+const char * asm_op_name(int op){
+	return op >= 0 && op < NUM_OPS ? OP_NAME[op] : NULL;
+}
+
+void asm_print_phase_stats(const asm_stats * stats, FILE * out){
+	static const char * const PHASE_NAME[ASM_NUM_PHASES] = {"load", "pass1", "pass2", "output"};
+	double total = 0;
+	int i;
+	for (i = 0; i < ASM_NUM_PHASES; i++) total += stats->seconds[i];
+	fprintf(out, "%-8s %12s %14s", "phase", "ms", "lines/s");
+	if (stats->have_counters) fprintf(out, " %14s %14s %6s %12s", "cycles", "instructions", "IPC", "cache-miss");
+	fputc('\n', out);
+	for (i = 0; i < ASM_NUM_PHASES; i++) {
+		double sec = stats->seconds[i];
+		fprintf(out, "%-8s %12.3f %14.0f", PHASE_NAME[i], sec * 1e3, sec > 0 ? stats->lines / sec : 0);
+		if (stats->have_counters) {
+			fprintf(out, " %14llu %14llu %6.2f %12llu", (unsigned long long)stats->cycles[i], (unsigned long long)stats->instructions[i],
+					stats->cycles[i] ? (double)stats->instructions[i] / stats->cycles[i] : 0, (unsigned long long)stats->cache_misses[i]);
+		}
+		fputc('\n', out);
+	}
+	fprintf(out, "%-8s %12.3f %14.0f  (%ld lines, %ld words)\n", "total", total * 1e3, total > 0 ? stats->lines / total : 0, stats->lines, stats->words);
+	if (stats->counters && !stats->have_counters) fprintf(out, "Hardware counters unavailable\n");
+	if (stats->peak_window) fprintf(out, "Peak window: %ld words\n", stats->peak_window);
+}
+
+int asm_assemble(asm_ctx * st, const char * src, size_t len, const asm_options * opts,
+				 uint16_t * words, size_t cap, size_t * nwords, asm_error * err){
+	asm_trap trap;
+	asm_reset(st);
+	set_options(st, opts);
+	st->src = src;
+	st->src_len = len;
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		assemble_source(st);
+		if (nwords) *nwords = st->image_len;
+		if (st->image_len > cap) {
+			st->max_errors = 0; /*not an error in the source*/
+			asm_fail(4, "Error: output buffer too small, %d words needed\n", st->image_len);
+		}
+		memcpy(words, st->image, st->image_len * sizeof(uint16_t));
+		if (st->stats) st->stats->words += st->image_len;
+	}
+	cur_trap = NULL;
+	phase_begin(st, -1);
+	diag_flush(st);
+	set_error(st, &trap, err);
+	return trap.code;
+}
+
+int asm_assemble_file(asm_ctx * st, const char * iFileName, const char * oFileName, const asm_format * fmt,
+					  const asm_options * opts, asm_error * err){
+	asm_trap trap;
+	asm_reset(st);
+	set_options(st, opts);
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		phase_begin(st, ASM_PHASE_LOAD);
+		st->outfd = open(oFileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (load_source(iFileName, &st->source) != 0) {
+			asm_fail(4, "Error: annot open file %s\n",iFileName);
+		}
+		if (st->outfd < 0) {
+			asm_fail(4, "Error: annot open file %s\n",oFileName);
+		}
+		if (strcmp(iFileName, "-") != 0) {
+			/*.include paths are relative to the file*/
+			const char * slash = strrchr(iFileName, '/');
+			st->dir = iFileName;
+			st->dir_len = slash ? slash - iFileName + 1 : 0;
+		}
+		st->src = st->source.data;
+		st->src_len = st->source.len;
+		assemble_source(st);
+		phase_begin(st, ASM_PHASE_OUTPUT);
+		if (st->relocatable ? write_object(st, st->outfd) != 0 : asm_write_image(st->outfd, fmt, st->image, st->image_len) != 0) {
+			asm_fail(4, "Error: annot write file %s\n",oFileName);
+		}
+		if (st->stats) st->stats->words += st->image_len;
+	}
+	cur_trap = NULL;
+	phase_begin(st, -1);
+	diag_flush(st);
+	set_error(st, &trap, err);
+	free_source(&st->source);
+	st->src = NULL;
+	if (st->outfd >= 0) close(st->outfd);
+	st->outfd = -1;
+	return trap.code;
+}
+
+int asm_stream(asm_ctx * st, int in_fd, int out_fd, const asm_format * fmt, const asm_options * opts, asm_error * err){
+	asm_trap trap;
+	asm_reset(st);
+	set_options(st, opts);
+	st->max_errors = 0; /*the lines before the window are gone, only the first error is reported*/
+	st->one_pass = 1;
+	st->relocatable = 0;
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		if (fmt->render == obj_render) {
+			asm_fail(4, "Error: obj output needs the word count up front and cannot be streamed\n");
+		}
+		stream_source(st, in_fd, out_fd, fmt);
+	}
+	cur_trap = NULL;
+	if (st->stats && st->peak_window > st->stats->peak_window) st->stats->peak_window = st->peak_window;
+	phase_begin(st, -1);
+	diag_flush(st);
+	set_error(st, &trap, err);
+	free_source(&st->source);
+	st->src = NULL;
+	return trap.code;
+}
+
+int asm_reassemble(asm_ctx * st, const char * src, size_t len, const asm_options * opts,
+				   uint16_t * words, size_t cap, size_t * nwords, asm_error * err){
+	asm_trap trap;
+	int reuse;
+	set_options(st, opts);
+	st->optimize = 0; /*the line cache needs one entry per source word*/
+	reuse = st->lines.valid && !st->relocatable;
+	st->lines.valid = 0;
+	st->src = src;
+	st->src_len = len;
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		if (reuse && try_reassemble(st)) {
+			st->lines.valid = 1;
+		}
+		else {
+			asm_reset(st);
+			st->one_pass = opts && !st->relocatable ? opts->one_pass : 0;
+			st->src = src;
+			st->src_len = len;
+			assemble_source(st);
+			if (!st->relocatable && !st->nincludes) record_lines(st); /*included lines are not tracked*/
+		}
+		if (nwords) *nwords = st->image_len;
+		if (st->image_len > cap) {
+			st->max_errors = 0; /*not an error in the source*/
+			asm_fail(4, "Error: output buffer too small, %d words needed\n", st->image_len);
+		}
+		memcpy(words, st->image, st->image_len * sizeof(uint16_t));
+		if (st->stats) st->stats->words += st->image_len;
+	}
+	cur_trap = NULL;
+	phase_begin(st, -1);
+	diag_flush(st);
+	set_error(st, &trap, err);
+	return trap.code;
+}
+
+/*Header of a saved line cache, followed by the per-line, IR, image and symbol arrays*/
+typedef struct {
+	uint32_t magic; /*CACHE_MAGIC, also rejects files of the other byte order*/
+	uint32_t version;
+	int32_t nlines, orig_line, end_line;
+	int32_t ir_len, nsyms;
+	uint32_t origin;
+	uint64_t names_len; /*bytes of the NUL terminated symbol names*/
+	uint64_t sum; /*cache_file_sum of the file*/
+}cache_header;
+
+#define CACHE_MAGIC 0x4C433343 /* "LC3C" */
+#define CACHE_VERSION 2
+
+/*Add len bytes of the cache body to the running checksum sum*/
+static uint64_t cache_sum(uint64_t sum, const void * p, size_t len){
+	return (sum ^ hash_line(p, len)) * 0x9E3779B97F4A7C15ULL + len;
+}
+
+/*Bytes of the cache body h describes*/
+static uint64_t cache_body_size(const cache_header * h){
+	return (uint64_t)h->nlines * sizeof(uint64_t) + ((uint64_t)h->end_line * 2 + 3) * sizeof(int32_t)
+		+ (uint64_t)h->nsyms * 2 * sizeof(int32_t) + (uint64_t)h->ir_len * (1 + 2 + 4 + 4 + 4 + 2) + h->names_len;
+}
+
+/*Checksum of the line cache of st as asm_cache_save writes it with the header h, less h->sum*/
+static uint64_t cache_file_sum(const asm_state * st, const cache_header * h){
+	const line_cache * lc = &st->lines;
+	const asm_ir * ir = &st->ir;
+	cache_header head = *h;
+	uint64_t sum;
+	int id;
+	head.sum = 0;
+	sum = cache_sum(0, &head, sizeof(head));
+	sum = cache_sum(sum, lc->hash, h->nlines * sizeof(uint64_t));
+	sum = cache_sum(sum, lc->first, (h->end_line + 2) * sizeof(int32_t));
+	sum = cache_sum(sum, lc->label, (h->end_line + 1) * sizeof(int32_t));
+	sum = cache_sum(sum, lc->refs, h->nsyms * sizeof(int32_t));
+	sum = cache_sum(sum, st->table.addrs, h->nsyms * sizeof(int32_t));
+	sum = cache_sum(sum, ir->op, h->ir_len * sizeof(*ir->op));
+	sum = cache_sum(sum, ir->regs, h->ir_len * sizeof(*ir->regs));
+	sum = cache_sum(sum, ir->imm, h->ir_len * sizeof(*ir->imm));
+	sum = cache_sum(sum, ir->sym, h->ir_len * sizeof(*ir->sym));
+	sum = cache_sum(sum, ir->line, h->ir_len * sizeof(*ir->line));
+	sum = cache_sum(sum, st->image, h->ir_len * sizeof(uint16_t));
+	for (id = 0; id < h->nsyms; id++) {
+		sum = cache_sum(sum, st->table.names[id], strlen(st->table.names[id]) + 1);
+	}
+	return sum;
+}
+
+/* **********cache_checked*****************
+ Whether the arrays load_cache read can be trusted by reassemble_lines: every IR index, symbol id
+ and line number in them is in range
+************************************************ */
+static int cache_checked(const asm_state * st, const cache_header * h){
+	const line_cache * lc = &st->lines;
+	const asm_ir * ir = &st->ir;
+	int i;
+	if (lc->first[0] < 0 || lc->first[h->end_line + 1] != h->ir_len) return 0;
+	for (i = 0; i <= h->end_line; i++) {
+		if (lc->first[i] > lc->first[i + 1] || lc->label[i] < -1 || lc->label[i] >= h->nsyms) return 0;
+	}
+	for (i = 0; i < h->nsyms; i++) {
+		if (lc->refs[i] < 0 || lc->refs[i] > h->ir_len || st->table.addrs[i] < -1 || st->table.addrs[i] > h->ir_len) return 0;
+	}
+	for (i = 0; i < h->ir_len; i++) {
+		if (ir->op[i] >= NUM_OPS || ir->sym[i] < -1 || ir->sym[i] >= h->nsyms || ir->line[i] < 1 || ir->line[i] > h->nlines) return 0;
+	}
+	return 1;
+}
+
+int asm_cache_save(asm_ctx * st, const char * path){
+	const line_cache * lc = &st->lines;
+	const asm_ir * ir = &st->ir;
+	cache_header h;
+	char tmp_path[PATH_MAX];
+	FILE * f;
+	int id, ok;
+	if (!lc->valid) return -1;
+	/*written next to path and renamed over it, so a reader never sees half a cache*/
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) return -1;
+	memset(&h, 0, sizeof(h));
+	h.magic = CACHE_MAGIC;
+	h.version = CACHE_VERSION;
+	h.nlines = lc->nlines;
+	h.orig_line = lc->orig_line;
+	h.end_line = lc->end_line;
+	h.ir_len = ir->len;
+	h.nsyms = st->table.count;
+	h.origin = st->origin;
+	for (id = 0; id < h.nsyms; id++) h.names_len += strlen(st->table.names[id]) + 1;
+	h.sum = cache_file_sum(st, &h);
+	f = fopen(tmp_path, "wb");
+	if (!f) return -1;
+	ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(lc->hash, sizeof(uint64_t), h.nlines, f) == (size_t)h.nlines
+		&& fwrite(lc->first, sizeof(int32_t), h.end_line + 2, f) == (size_t)h.end_line + 2
+		&& fwrite(lc->label, sizeof(int32_t), h.end_line + 1, f) == (size_t)h.end_line + 1
+		&& fwrite(lc->refs, sizeof(int32_t), h.nsyms, f) == (size_t)h.nsyms
+		&& fwrite(st->table.addrs, sizeof(int32_t), h.nsyms, f) == (size_t)h.nsyms
+		&& fwrite(ir->op, sizeof(*ir->op), h.ir_len, f) == (size_t)h.ir_len
+		&& fwrite(ir->regs, sizeof(*ir->regs), h.ir_len, f) == (size_t)h.ir_len
+		&& fwrite(ir->imm, sizeof(*ir->imm), h.ir_len, f) == (size_t)h.ir_len
+		&& fwrite(ir->sym, sizeof(*ir->sym), h.ir_len, f) == (size_t)h.ir_len
+		&& fwrite(ir->line, sizeof(*ir->line), h.ir_len, f) == (size_t)h.ir_len
+		&& fwrite(st->image, sizeof(uint16_t), h.ir_len, f) == (size_t)h.ir_len;
+	for (id = 0; ok && id < h.nsyms; id++) {
+		ok = fwrite(st->table.names[id], 1, strlen(st->table.names[id]) + 1, f) == strlen(st->table.names[id]) + 1;
+	}
+	ok = fclose(f) == 0 && ok && rename(tmp_path, path) == 0;
+	if (!ok) unlink(tmp_path);
+	return ok ? 0 : -1;
+}
+
+/* **********load_cache*****************
+ Body of asm_cache_load, errors unwind to its trap
+************************************************ */
+static void load_cache(asm_state * st, FILE * f){
+	line_cache * lc = &st->lines;
+	asm_ir * ir = &st->ir;
+	cache_header h;
+	struct stat sb;
+	char * names = NULL;
+	char * p;
+	int id, ok;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != CACHE_MAGIC || h.version != CACHE_VERSION
+		|| h.nlines < 0 || h.orig_line < 0 || h.end_line < h.orig_line || h.end_line >= h.nlines
+		|| h.ir_len < 1 || h.nsyms < 0 || h.origin > UINT16_MAX || h.names_len > (uint64_t)h.nsyms * 1024
+		|| fstat(fileno(f), &sb) != 0 || (uint64_t)sb.st_size != sizeof(h) + cache_body_size(&h)) {
+		asm_fail(4, "Error: bad cache file\n"); /*the size check also keeps a corrupted header from sizing the arrays*/
+	}
+	lines_reserve(lc, h.nlines + 1);
+	ir_reserve(ir, h.ir_len);
+	st->image = grow_array(st->image, &st->image_cap, h.ir_len, sizeof(uint16_t));
+	lc->refs = grow_array(lc->refs, &lc->refs_cap, h.nsyms + 1, sizeof(int32_t));
+	lc->tmp = grow_array(lc->tmp, &lc->tmp_cap, h.nsyms + 1, 8); /*symbol addresses until the table is rebuilt*/
+	names = arena_alloc(&st->arena, h.names_len + 1, 1);
+	ok = fread(lc->hash, sizeof(uint64_t), h.nlines, f) == (size_t)h.nlines
+		&& fread(lc->first, sizeof(int32_t), h.end_line + 2, f) == (size_t)h.end_line + 2
+		&& fread(lc->label, sizeof(int32_t), h.end_line + 1, f) == (size_t)h.end_line + 1
+		&& fread(lc->refs, sizeof(int32_t), h.nsyms, f) == (size_t)h.nsyms
+		&& fread(lc->tmp, sizeof(int32_t), h.nsyms, f) == (size_t)h.nsyms
+		&& fread(ir->op, sizeof(*ir->op), h.ir_len, f) == (size_t)h.ir_len
+		&& fread(ir->regs, sizeof(*ir->regs), h.ir_len, f) == (size_t)h.ir_len
+		&& fread(ir->imm, sizeof(*ir->imm), h.ir_len, f) == (size_t)h.ir_len
+		&& fread(ir->sym, sizeof(*ir->sym), h.ir_len, f) == (size_t)h.ir_len
+		&& fread(ir->line, sizeof(*ir->line), h.ir_len, f) == (size_t)h.ir_len
+		&& fread(st->image, sizeof(uint16_t), h.ir_len, f) == (size_t)h.ir_len
+		&& fread(names, 1, h.names_len, f) == h.names_len;
+	names[h.names_len] = '\0';
+	for (id = 0, p = names; ok && id < h.nsyms; id++) {
+		size_t n = strlen(p);
+		ok = p + n < names + h.names_len && symtab_ref(&st->table, &st->arena, p, n)->id == id;
+		if (ok) st->table.addrs[id] = ((int32_t *)lc->tmp)[id];
+		p += n + 1;
+	}
+	if (!ok || cache_file_sum(st, &h) != h.sum || !cache_checked(st, &h)) asm_fail(4, "Error: bad cache file\n");
+	ir->len = h.ir_len;
+	st->image_len = h.ir_len;
+	st->origin = h.origin;
+	lc->nlines = h.nlines;
+	lc->orig_line = h.orig_line;
+	lc->end_line = h.end_line;
+	lc->valid = 1;
+}
+
+int asm_cache_load(asm_ctx * st, const char * path){
+	asm_trap trap;
+	FILE * f = fopen(path, "rb");
+	if (!f) return -1;
+	asm_reset(st);
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		load_cache(st, f);
+	}
+	cur_trap = NULL;
+	fclose(f);
+	if (trap.code) asm_reset(st);
+	return trap.code ? -1 : 0;
+}
+
+int asm_link(asm_ctx * st, const char * const * in_paths, int n, const char * out_path, const asm_format * fmt, asm_error * err){
+	asm_trap trap;
+	asm_reset(st);
+	set_options(st, NULL);
+	trap.code = 0;
+	trap.where = NULL;
+	trap.msg[0] = '\0';
+	cur_trap = &trap;
+	if (sigsetjmp(trap.bail, 0) == 0) {
+		link_objects(st, in_paths, n);
+		st->outfd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (st->outfd < 0) {
+			asm_fail(4, "Error: annot open file %s\n",out_path);
+		}
+		if (asm_write_image(st->outfd, fmt, st->image, st->image_len) != 0) {
+			asm_fail(4, "Error: annot write file %s\n",out_path);
+		}
+	}
+	cur_trap = NULL;
+	set_error(st, &trap, err);
+	free_source(&st->source);
+	if (st->outfd >= 0) close(st->outfd);
+	st->outfd = -1;
+	return trap.code;
+}
+
+/*A symbol of the debug sidecar while it is written*/
+typedef struct {
+	const char * name;
+	uint32_t name_off; /*offset in the string pool*/
+	uint32_t index; /*place in the by-name array*/
+	int addr;
+}debug_sym;
+
+static int debug_by_name(const void * a, const void * b){
+	return strcmp(((const debug_sym *)a)->name, ((const debug_sym *)b)->name);
+}
+
+static int debug_by_addr(const void * a, const void * b){
+	const debug_sym * x = a;
+	const debug_sym * y = b;
+	return x->addr != y->addr ? x->addr - y->addr : strcmp(x->name, y->name);
+}
+
+/* **********debug_runs*****************
+ Cut the source lines of words[0..nwords) (IR entries 1..) into runs of words on the same line
+ or on consecutive lines. Write them at p if it is not NULL, return how many there are
+************************************************ */
+static uint32_t debug_runs(const asm_ir * ir, char * p){
+	uint32_t nruns = 0;
+	int i, first = 0, step = 1, line = 0;
+	for (i = 0; i + 1 <= ir->len; i++) {
+		int l = i + 1 < ir->len ? ir->line[i + 1] : -1; /*-1 closes the last run*/
+		if (i > 0 && i == first + 1 && (l == line || l == line + 1)) step = l - line;
+		else if (i == 0 || l != line + step * (i - first)) {
+			if (i > 0 && p) {
+				put32(p, first);
+				put32(p + 4, step);
+				put32(p + 8, line);
+				p += 12;
+			}
+			nruns += i > 0;
+			first = i;
+			step = 1;
+			line = l;
+		}
+	}
+	return nruns;
+}
+
+/* **********asm_write_debug*****************
+ Write the debug sidecar of the last assembly to path. Layout, big-endian, every section
+ starting on a multiple of 4:
+   "LC3D", version:16, origin:16, words:32, symbols:32, runs:32, string bytes:32, source name offset:32
+   the words after .orig, padded to 4 bytes
+   per symbol, sorted by name: name offset:32, address:16, 0:16
+   per symbol, sorted by address: index of the symbol above:32
+   per run of words, sorted by word: first word:32, line step:32 (0 or 1), line:32. Word i of
+   the run is on line + step * i
+   NUL terminated strings
+ Return 0 on success
+************************************************ */
+int asm_write_debug(asm_ctx * st, const char * path, const char * src_name){
+	const symbol_table * table = &st->table;
+	int nwords = st->image_len - 1;
+	uint32_t nsyms = 0, nruns, strings, i;
+	size_t size, done;
+	debug_sym * syms;
+	debug_sym * by_addr;
+	char * buf;
+	char * p;
+	int id, fd;
+	if (st->relocatable || st->image_base || nwords < 0 || st->ir.len != st->image_len) return -1;
+	for (id = 0; id < table->count; id++) {
+		if (table->addrs[id] < 0) return -1; /*not a finished absolute image*/
+	}
+	strings = strlen(src_name) + 1;
+	syms = malloc(2 * sizeof(debug_sym) * (table->count + 1));
+	if (!syms) return -1;
+	by_addr = syms + table->count + 1;
+	for (id = 0; id < table->count; id++) {
+		syms[nsyms].name = table->names[id];
+		syms[nsyms].name_off = strings;
+		syms[nsyms].addr = (st->origin + 2 * (table->addrs[id] - 2)) & 0xFFFF;
+		strings += strlen(table->names[id]) + 1;
+		nsyms++;
+	}
+	qsort(syms, nsyms, sizeof(debug_sym), debug_by_name);
+	for (i = 0; i < nsyms; i++) syms[i].index = i;
+	memcpy(by_addr, syms, nsyms * sizeof(debug_sym));
+	qsort(by_addr, nsyms, sizeof(debug_sym), debug_by_addr);
+	nruns = debug_runs(&st->ir, NULL);
+	size = DBG_HEADER_SIZE + ((2 * (size_t)nwords + 3) & ~(size_t)3) + 12 * (size_t)nsyms + 12 * (size_t)nruns + strings;
+	buf = calloc(size, 1);
+	if (!buf) {
+		free(syms);
+		return -1;
+	}
+	memcpy(buf, DBG_MAGIC, 4);
+	put16(buf + 4, DBG_VERSION);
+	put16(buf + 6, st->origin);
+	put32(buf + 8, nwords);
+	put32(buf + 12, nsyms);
+	put32(buf + 16, nruns);
+	put32(buf + 20, strings);
+	put32(buf + 24, 0);
+	p = buf + DBG_HEADER_SIZE;
+	bin_render(p, st->image + 1, nwords);
+	p += (2 * (size_t)nwords + 3) & ~(size_t)3;
+	for (i = 0; i < nsyms; i++, p += 8) {
+		put32(p, syms[i].name_off);
+		put16(p + 4, syms[i].addr);
+	}
+	for (i = 0; i < nsyms; i++, p += 4) put32(p, by_addr[i].index);
+	debug_runs(&st->ir, p);
+	p += 12 * (size_t)nruns;
+	memcpy(p, src_name, strlen(src_name) + 1);
+	for (i = 0; i < nsyms; i++) memcpy(p + syms[i].name_off, syms[i].name, strlen(syms[i].name) + 1);
+	free(syms);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	done = fd < 0 ? 0 : write_all(fd, buf, size);
+	free(buf);
+	if (fd >= 0 && close(fd) != 0) done = 0;
+	return done == size ? 0 : -1;
+}
+
+/*A sidecar mapped by asm_debug_open, sections as laid out by asm_write_debug*/
+struct asm_debug {
+	char * map;
+	size_t size;
+	int origin;
+	uint32_t nwords, nsyms, nruns, strings_len;
+	const char * words;
+	const char * syms;
+	const char * by_addr;
+	const char * runs;
+	const char * strings;
+	const char * src_name;
+};
+
+asm_debug * asm_debug_open(const char * path){
+	int fd = open(path, O_RDONLY);
+	struct stat sb;
+	asm_debug * dbg;
+	uint64_t need;
+	char * map;
+	if (fd < 0) return NULL;
+	if (fstat(fd, &sb) != 0 || sb.st_size < DBG_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+	dbg = malloc(sizeof(asm_debug));
+	if (!dbg) {
+		munmap(map, sb.st_size);
+		return NULL;
+	}
+	dbg->map = map;
+	dbg->size = sb.st_size;
+	dbg->origin = get16(map + 6);
+	dbg->nwords = get32(map + 8);
+	dbg->nsyms = get32(map + 12);
+	dbg->nruns = get32(map + 16);
+	dbg->strings_len = get32(map + 20);
+	dbg->words = map + DBG_HEADER_SIZE;
+	dbg->syms = dbg->words + ((2 * (size_t)dbg->nwords + 3) & ~(size_t)3);
+	dbg->by_addr = dbg->syms + 8 * (size_t)dbg->nsyms;
+	dbg->runs = dbg->by_addr + 4 * (size_t)dbg->nsyms;
+	dbg->strings = dbg->runs + 12 * (size_t)dbg->nruns;
+	need = DBG_HEADER_SIZE + ((2 * (uint64_t)dbg->nwords + 3) & ~(uint64_t)3) + 12 * (uint64_t)dbg->nsyms
+		+ 12 * (uint64_t)dbg->nruns + dbg->strings_len;
+	if (memcmp(map, DBG_MAGIC, 4) != 0 || get16(map + 4) != DBG_VERSION || need != dbg->size
+		|| dbg->strings_len == 0 || dbg->strings[dbg->strings_len - 1] != '\0' || get32(map + 24) >= dbg->strings_len) {
+		asm_debug_close(dbg);
+		return NULL;
+	}
+	dbg->src_name = dbg->strings + get32(map + 24);
+	return dbg;
+}
+
+void asm_debug_close(asm_debug * dbg){
+	if (!dbg) return;
+	munmap(dbg->map, dbg->size);
+	free(dbg);
+}
+
+const char * asm_debug_source(const asm_debug * dbg){
+	return dbg->src_name;
+}
+
+/*Name of symbol i of the by-name array, "" if the offset is out of the pool*/
+static const char * debug_name(const asm_debug * dbg, uint32_t i){
+	uint32_t off = get32(dbg->syms + 8 * (size_t)i);
+	return off < dbg->strings_len ? dbg->strings + off : "";
+}
+
+/*Line of word i, which is in the image*/
+static int debug_word_line(const asm_debug * dbg, uint32_t i){
+	uint32_t lo = 0, hi = dbg->nruns;
+	const char * r;
+	while (hi - lo > 1) { /*last run starting at or before i*/
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (get32(dbg->runs + 12 * (size_t)mid) <= i) lo = mid;
+		else hi = mid;
+	}
+	if (!dbg->nruns) return 0;
+	r = dbg->runs + 12 * (size_t)lo;
+	return get32(r + 8) + get32(r + 4) * (i - get32(r));
+}
+
+int asm_debug_line(const asm_debug * dbg, int addr){
+	int off = (addr & 0xFFFF) - dbg->origin;
+	if (off < 0 || (off & 1) || (uint32_t)off / 2 >= dbg->nwords) return 0;
+	return debug_word_line(dbg, off / 2);
+}
+
+int asm_debug_symbol(const asm_debug * dbg, const char * name){
+	uint32_t lo = 0, hi = dbg->nsyms;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char * s = debug_name(dbg, mid);
+		const char * n = name;
+		while (*s && *s == FOLD(*n)) {
+			s++;
+			n++;
+		}
+		if (*s == FOLD(*n)) return get16(dbg->syms + 8 * (size_t)mid + 4);
+		if ((unsigned char)*s < (unsigned char)FOLD(*n)) lo = mid + 1;
+		else hi = mid;
+	}
+	return -1;
+}
+
+/*Symbol i of the by-address array, as an index of the by-name array*/
+static uint32_t debug_addr_sym(const asm_debug * dbg, uint32_t i){
+	uint32_t s = get32(dbg->by_addr + 4 * (size_t)i);
+	return s < dbg->nsyms ? s : 0;
+}
+
+static int debug_sym_addr(const asm_debug * dbg, uint32_t s){
+	return get16(dbg->syms + 8 * (size_t)s + 4);
+}
+
+const char * asm_debug_label(const asm_debug * dbg, int addr, int * offset){
+	uint32_t lo = 0, hi = dbg->nsyms, s;
+	addr &= 0xFFFF;
+	while (lo < hi) { /*first symbol after addr*/
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (debug_sym_addr(dbg, debug_addr_sym(dbg, mid)) <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return NULL;
+	s = debug_addr_sym(dbg, lo - 1);
+	while (lo > 1 && debug_sym_addr(dbg, debug_addr_sym(dbg, lo - 2)) == debug_sym_addr(dbg, s)) {
+		s = debug_addr_sym(dbg, --lo - 1); /*the first name of several at one address*/
+	}
+	if (offset) *offset = addr - debug_sym_addr(dbg, s);
+	return debug_name(dbg, s);
+}
+
+/*Print source line text (up to the newline) after the columns of a listing line*/
+static const char * listing_text(const char * p, const char * end, FILE * out){
+	const char * nl = memchr(p, '\n', end - p);
+	size_t n = (nl ? nl : end) - p;
+	if (n && p[n - 1] == '\r') n--;
+	fprintf(out, "%.*s\n", (int)n, p);
+	return nl ? nl + 1 : end;
+}
+
+/* **********asm_debug_listing*****************
+ Print address, word, line and text of every source line, one line per word; lines that made
+ no word get blank address columns. Without src the label at each address stands in for the
+ text. Return 0 on success
+************************************************ */
+int asm_debug_listing(const asm_debug * dbg, const char * src, size_t len, FILE * out){
+	const char * p = src;
+	const char * end = src ? src + len : NULL;
+	int cur = 1;
+	uint32_t i;
+	for (i = 0; i < dbg->nwords; i++) {
+		int addr = (dbg->origin + 2 * i) & 0xFFFF;
+		int line = debug_word_line(dbg, i);
+		for (; p && p < end && cur < line; cur++) {
+			fprintf(out, "%14s%5d  ", "", cur);
+			p = listing_text(p, end, out);
+		}
+		fprintf(out, "x%04X  x%04X", addr, get16(dbg->words + 2 * (size_t)i));
+		if (p && p < end && cur == line) {
+			fprintf(out, "  %5d  ", cur++);
+			p = listing_text(p, end, out);
+		}
+		else if (!src) {
+			int off;
+			const char * label = asm_debug_label(dbg, addr, &off);
+			fprintf(out, "  %5d  %s\n", line, label && off == 0 ? label : "");
+		}
+		else fprintf(out, "\n"); /*another word of the line above*/
+	}
+	for (; p && p < end; cur++) {
+		fprintf(out, "%14s%5d  ", "", cur);
+		p = listing_text(p, end, out);
+	}
+	return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,701 @@
+/*
+server.c
+
+ Assembler daemon over a Unix domain socket, and the client side of its protocol (see server.h).
+ The calling thread polls the listening socket and every idle connection. A connection with a
+ request waiting goes on the ready queue, a worker takes it, answers what it sent and hands it
+ back. Each worker keeps its context, word buffer and reply buffer across requests.
+
+*/
+#include <stdio.h> /* standard input/output library */
+#include <stdlib.h> /* Standard C Library */
+#include <string.h> /* String operations library */
+#include <limits.h> /* PATH_MAX */
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h> /* open */
+#include <unistd.h> /* read, write, close */
+#include <signal.h> /* SIGPIPE */
+#include <time.h> /* request latency */
+#include <pthread.h> /* worker pool */
+#include <poll.h> /* idle connections */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+#define SRV_HEADER_MAX 256 /* longest request or reply header line */
+#define SRV_READ_BUF (16 << 10)
+#define LAT_SUB 8 /* latency buckets per power of two */
+#define LAT_BUCKETS (16 + 40 * LAT_SUB) /* exact below 16 us, then up to 2^44 us */
+
+/*Buffered reader of one connection*/
+typedef struct {
+	int fd;
+	size_t pos, len;
+	char buf[SRV_READ_BUF];
+}conn_reader;
+
+/*Client connection, idle in the dispatcher's poll set or with one worker*/
+typedef struct srv_conn {
+	struct srv_conn * next; /*on the ready queue or the handed back list*/
+	conn_reader in; /*bytes read ahead stay with the connection, not the worker*/
+}srv_conn;
+
+/*Counts and latency histogram of every request served*/
+typedef struct {
+	uint64_t count[LAT_BUCKETS];
+	uint64_t requests, failed, bad, max_us;
+}srv_stats;
+
+typedef struct srv_server srv_server;
+
+/*One worker and the state it keeps from one request to the next*/
+typedef struct {
+	srv_server * srv;
+	int id;
+	pthread_t thread;
+	srv_conn * conn; /*connection being served*/
+	asm_ctx * ctx;
+	uint16_t * words;
+	size_t words_cap;
+	char * payload;
+	size_t payload_cap;
+	char * src; /*source read for a path request*/
+	size_t src_cap;
+	char * out; /*reply being built*/
+	size_t out_cap, out_len;
+}srv_worker;
+
+struct srv_server {
+	const char * path;
+	int listen_fd;
+	int wake[2]; /*pipe waking the dispatcher when a connection is handed back or on shutdown*/
+	int nworkers;
+	srv_worker * workers;
+	pthread_mutex_t lock; /*guards the fields below up to stats_lock*/
+	pthread_cond_t ready_cond;
+	srv_conn * ready; /*connections with a request waiting, oldest first*/
+	srv_conn * ready_tail;
+	srv_conn * back; /*connections answered by a worker, for the dispatcher to poll again*/
+	int stopping; /*shutdown requested*/
+	int done; /*the dispatcher has stopped, workers end once ready is empty*/
+	struct timespec started;
+	pthread_mutex_t stats_lock;
+	srv_stats stats; /*guarded by stats_lock*/
+};
+
+static double elapsed(const struct timespec * t0){
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+static int send_all(int fd, const char * buf, size_t size){
+	while (size) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*Next byte of the connection, -1 at the end*/
+static int conn_getc(conn_reader * r){
+	if (r->pos == r->len) {
+		ssize_t n;
+		do n = read(r->fd, r->buf, sizeof(r->buf));
+		while (n < 0 && errno == EINTR);
+		if (n <= 0) return -1;
+		r->pos = 0;
+		r->len = n;
+	}
+	return (unsigned char)r->buf[r->pos++];
+}
+
+/*Read one line without its newline into line[0..cap). Return its length, -1 at the end or if
+ it does not fit*/
+static int conn_line(conn_reader * r, char * line, size_t cap){
+	size_t n = 0;
+	int c;
+	while ((c = conn_getc(r)) != '\n') {
+		if (c < 0 || n + 1 >= cap) return -1;
+		line[n++] = (char)c;
+	}
+	line[n] = '\0';
+	return (int)n;
+}
+
+/*Read exactly n bytes. Return 0 on success*/
+static int conn_read(conn_reader * r, char * dst, size_t n){
+	size_t have = r->len - r->pos < n ? r->len - r->pos : n;
+	memcpy(dst, r->buf + r->pos, have);
+	r->pos += have;
+	dst += have;
+	n -= have;
+	while (n) {
+		ssize_t got = read(r->fd, dst, n);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return -1;
+		dst += got;
+		n -= got;
+	}
+	return 0;
+}
+
+/*Grow *buf to hold need bytes, keeping its contents. Return 0 on success*/
+static int reserve(char ** buf, size_t * cap, size_t need){
+	if (need > *cap) {
+		size_t ncap = *cap ? *cap : 4096;
+		char * p;
+		while (ncap < need) ncap *= 2;
+		p = realloc(*buf, ncap);
+		if (!p) return -1;
+		*buf = p;
+		*cap = ncap;
+	}
+	return 0;
+}
+
+/* **********lat_bucket*****************
+ Histogram bucket of a latency: exact below 16 us, above that LAT_SUB buckets per power of two,
+ so a percentile is within 1/LAT_SUB of the true value
+************************************************ */
+static int lat_bucket(uint64_t us){
+	int e;
+	if (us < 16) return (int)us;
+	e = 63 - __builtin_clzll(us);
+	if (e >= 4 + 40) return LAT_BUCKETS - 1;
+	return 16 + (e - 4) * LAT_SUB + (int)((us >> (e - 3)) & (LAT_SUB - 1));
+}
+
+/*Smallest latency of bucket b*/
+static uint64_t lat_value(int b){
+	int e;
+	if (b < 16) return b;
+	e = (b - 16) / LAT_SUB + 4;
+	return (uint64_t)(LAT_SUB + (b - 16) % LAT_SUB) << (e - 3);
+}
+
+static void record_request(srv_server * srv, double seconds, int failed, int bad){
+	srv_stats * s = &srv->stats;
+	uint64_t us = (uint64_t)(seconds * 1e6);
+	pthread_mutex_lock(&srv->stats_lock);
+	s->count[lat_bucket(us)]++;
+	s->requests++;
+	s->failed += failed;
+	s->bad += bad;
+	if (us > s->max_us) s->max_us = us;
+	pthread_mutex_unlock(&srv->stats_lock);
+}
+
+/*Latency under which a fraction p of the requests finished*/
+static uint64_t percentile(const srv_stats * s, double p){
+	uint64_t want = (uint64_t)(p * s->requests + 0.999999), seen = 0;
+	int b;
+	if (!s->requests) return 0;
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		seen += s->count[b];
+		if (seen >= want) return lat_value(b) < s->max_us ? lat_value(b) : s->max_us;
+	}
+	return s->max_us;
+}
+
+/*Start the reply in w->out: header, then the error lines. The body is appended after it*/
+static int reply_begin(srv_worker * w, int code, const asm_error * errors, int nerrors, size_t body_len){
+	int i;
+	w->out_len = 0;
+	if (reserve(&w->out, &w->out_cap, SRV_HEADER_MAX + (size_t)nerrors * (ASM_MAX_MSG + 64) + body_len) != 0) return -1;
+	w->out_len += sprintf(w->out, "%d %d %zu\n", code, nerrors, body_len);
+	for (i = 0; i < nerrors; i++) {
+		size_t len = strlen(errors[i].message);
+		w->out_len += sprintf(w->out + w->out_len, "%d:%d: exit %d: %s%s", errors[i].line, errors[i].column,
+							  errors[i].code, errors[i].message, len && errors[i].message[len - 1] == '\n' ? "" : "\n");
+	}
+	return 0;
+}
+
+/*Reply with one error that is not tied to a source line*/
+static int reply_error(srv_worker * w, const char * msg){
+	asm_error err;
+	memset(&err, 0, sizeof(err));
+	err.code = ASM_ERR_OTHER;
+	snprintf(err.message, sizeof(err.message), "%s", msg);
+	return reply_begin(w, ASM_ERR_OTHER, &err, 1, 0) != 0 ? -1 : send_all(w->conn->in.fd, w->out, w->out_len);
+}
+
+/*Read a whole file into w->src. Return its length, -1 if it cannot be read*/
+static long load_file(srv_worker * w, const char * path){
+	int fd = open(path, O_RDONLY);
+	size_t len = 0;
+	ssize_t n = 1;
+	if (fd < 0) return -1;
+	while (n > 0) {
+		if (len == w->src_cap && reserve(&w->src, &w->src_cap, len + 1) != 0) {
+			close(fd);
+			return -1;
+		}
+		n = read(fd, w->src + len, w->src_cap - len);
+		if (n > 0) len += n;
+	}
+	close(fd);
+	return n < 0 ? -1 : (long)len;
+}
+
+/* **********serve_assemble*****************
+ Assemble the payload (source, or path of the source) and send the reply. Return 0 if the
+ reply went out, *failed set if the assembly had an error
+************************************************ */
+static int serve_assemble(srv_worker * w, const asm_format * fmt, int by_path, size_t len, int one_pass, int max_errors,
+						  int * failed){
+	const char * src = w->payload;
+	char dir[PATH_MAX];
+	asm_options opts;
+	asm_error err;
+	size_t nwords = 0, size;
+	int code, n = 1;
+	const asm_error * errors = &err;
+	opts.one_pass = one_pass;
+	opts.threads = 1; /*the pool already keeps every core busy*/
+	opts.diag_level = ASM_DIAG_QUIET;
+	opts.diag = NULL;
+	opts.stats = NULL;
+	opts.relocatable = 0;
+	opts.include_dir = NULL;
+	opts.max_errors = max_errors;
+	opts.optimize = 0;
+	if (by_path) {
+		/*.include paths are relative to the file*/
+		const char * slash = strrchr(w->payload, '/');
+		long got;
+		if (slash && (size_t)(slash - w->payload) < sizeof(dir)) {
+			memcpy(dir, w->payload, slash - w->payload + 1);
+			dir[slash - w->payload + 1] = '\0';
+			opts.include_dir = dir;
+		}
+		got = load_file(w, w->payload);
+		if (got < 0) {
+			char msg[ASM_MAX_MSG];
+			snprintf(msg, sizeof(msg), "Error: annot open file %s\n", w->payload);
+			*failed = 1;
+			return reply_error(w, msg);
+		}
+		src = w->src;
+		len = got;
+	}
+	code = asm_assemble(w->ctx, src, len, &opts, w->words, w->words_cap, &nwords, &err);
+	if (code == ASM_ERR_OTHER && nwords > w->words_cap) {
+		/*first request this large: size the buffer and run again*/
+		uint16_t * words = realloc(w->words, nwords * 2 * sizeof(uint16_t));
+		if (!words) return reply_error(w, "Error: out of memory\n");
+		w->words = words;
+		w->words_cap = nwords * 2;
+		code = asm_assemble(w->ctx, src, len, &opts, w->words, w->words_cap, &nwords, &err);
+	}
+	*failed = code != ASM_OK;
+	if (code) {
+		if (max_errors > 1) errors = asm_get_errors(w->ctx, &n);
+		if (reply_begin(w, code, errors, n, 0) != 0) return -1;
+	}
+	else {
+		size = fmt->size(w->words, (int)nwords);
+		if (reply_begin(w, ASM_OK, NULL, 0, size) != 0) return -1;
+		fmt->render(w->out + w->out_len, w->words, (int)nwords);
+		w->out_len += size;
+	}
+	return send_all(w->conn->in.fd, w->out, w->out_len);
+}
+
+/*Text of the stats request*/
+static int serve_stats(srv_worker * w){
+	srv_server * srv = w->srv;
+	srv_stats s;
+	char text[1024];
+	int len;
+	pthread_mutex_lock(&srv->stats_lock);
+	s = srv->stats;
+	pthread_mutex_unlock(&srv->stats_lock);
+	len = snprintf(text, sizeof(text),
+				   "requests %llu\nfailed %llu\nbad_requests %llu\nworkers %d\nuptime_s %.1f\n"
+				   "p50_us %llu\np90_us %llu\np99_us %llu\np999_us %llu\nmax_us %llu\n",
+				   (unsigned long long)s.requests, (unsigned long long)s.failed, (unsigned long long)s.bad,
+				   srv->nworkers, elapsed(&srv->started),
+				   (unsigned long long)percentile(&s, 0.5), (unsigned long long)percentile(&s, 0.9),
+				   (unsigned long long)percentile(&s, 0.99), (unsigned long long)percentile(&s, 0.999),
+				   (unsigned long long)s.max_us);
+	if (reply_begin(w, ASM_OK, NULL, 0, len) != 0) return -1;
+	memcpy(w->out + w->out_len, text, len);
+	w->out_len += len;
+	return send_all(w->conn->in.fd, w->out, w->out_len);
+}
+
+/*Wake the dispatcher from poll*/
+static void wake_dispatcher(srv_server * srv){
+	char c = 0;
+	while (write(srv->wake[1], &c, 1) < 0 && errno == EINTR);
+}
+
+/* **********stop_server*****************
+ Shutdown request: the dispatcher stops accepting and closes the idle connections, a connection
+ with a worker is closed once its request is answered
+************************************************ */
+static void stop_server(srv_worker * self){
+	srv_server * srv = self->srv;
+	pthread_mutex_lock(&srv->lock);
+	srv->stopping = 1;
+	pthread_mutex_unlock(&srv->lock);
+	wake_dispatcher(srv);
+}
+
+/* **********serve_connection*****************
+ Answer the requests w->conn has sent, up to the first one not yet started. Return 0 if the
+ connection stays open, -1 once the client closed it, sent something that is not a request,
+ or asked for a shutdown
+************************************************ */
+static int serve_connection(srv_worker * w){
+	conn_reader * in = &w->conn->in;
+	char line[SRV_HEADER_MAX];
+	char format[16], kind[8];
+	struct timespec t0;
+	size_t len;
+	int one_pass, max_errors, failed, ok;
+	do{
+		if (conn_line(in, line, sizeof(line)) < 0) return -1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (strcmp(line, "stats") == 0) {
+			if (serve_stats(w) != 0) return -1;
+			continue;
+		}
+		if (strcmp(line, "shutdown") == 0) {
+			reply_begin(w, ASM_OK, NULL, 0, 0);
+			send_all(in->fd, w->out, w->out_len);
+			stop_server(w);
+			return -1;
+		}
+		if (sscanf(line, "assemble %15s %7s %zu %d %d", format, kind, &len, &one_pass, &max_errors) != 5
+			|| !asm_find_format(format) || (strcmp(kind, "inline") != 0 && strcmp(kind, "path") != 0)
+			|| len > SRV_MAX_PAYLOAD || (kind[0] == 'p' && (len == 0 || len >= PATH_MAX))) {
+			/*the payload cannot be skipped without its length, so the connection ends here*/
+			record_request(w->srv, elapsed(&t0), 0, 1);
+			reply_error(w, "Error: bad request\n");
+			return -1;
+		}
+		if (reserve(&w->payload, &w->payload_cap, len + 1) != 0) {
+			reply_error(w, "Error: out of memory\n");
+			return -1;
+		}
+		if (conn_read(in, w->payload, len) != 0) return -1;
+		w->payload[len] = '\0';
+		failed = 0;
+		ok = serve_assemble(w, asm_find_format(format), kind[0] == 'p', len, one_pass != 0, max_errors, &failed) == 0;
+		record_request(w->srv, elapsed(&t0), failed, 0);
+		if (!ok) return -1;
+	}
+	while (in->pos < in->len); /*poll cannot see requests already read ahead*/
+	return 0;
+}
+
+static void close_conn(srv_conn * c){
+	close(c->in.fd);
+	free(c);
+}
+
+/* **********worker_main*****************
+ Take connections off the ready queue and answer them, until the dispatcher has stopped and
+ the queue is empty
+************************************************ */
+static void * worker_main(void * arg){
+	srv_worker * w = arg;
+	srv_server * srv = w->srv;
+	for (;;) {
+		int keep;
+		pthread_mutex_lock(&srv->lock);
+		while (!srv->ready && !srv->done) pthread_cond_wait(&srv->ready_cond, &srv->lock);
+		w->conn = srv->ready;
+		if (w->conn) srv->ready = w->conn->next;
+		pthread_mutex_unlock(&srv->lock);
+		if (!w->conn) break;
+		keep = serve_connection(w) == 0;
+		pthread_mutex_lock(&srv->lock);
+		keep = keep && !srv->stopping;
+		if (keep) {
+			w->conn->next = srv->back;
+			srv->back = w->conn;
+		}
+		pthread_mutex_unlock(&srv->lock);
+		if (keep) wake_dispatcher(srv);
+		else close_conn(w->conn);
+		w->conn = NULL;
+	}
+	return NULL;
+}
+
+/*Add c to the dispatcher's idle connections, closing it if memory runs out*/
+static void add_idle(srv_conn *** idle, int * nidle, int * cap, srv_conn * c){
+	if (*nidle == *cap) {
+		int ncap = *cap ? *cap * 2 : 64;
+		srv_conn ** grown = realloc(*idle, ncap * sizeof(srv_conn *));
+		if (!grown) {
+			close_conn(c);
+			return;
+		}
+		*idle = grown;
+		*cap = ncap;
+	}
+	(*idle)[(*nidle)++] = c;
+}
+
+/* **********dispatch*****************
+ Body of srv_serve: accept connections and poll the idle ones. A connection that has sent a
+ request, or hung up, goes on the ready queue for the workers. Return after a shutdown request
+************************************************ */
+static void dispatch(srv_server * srv){
+	srv_conn ** idle = NULL;
+	srv_conn * c;
+	struct pollfd * fds = NULL;
+	int nidle = 0, idle_cap = 0, fds_cap = 0, i, n, stopping = 0;
+	while (!stopping) {
+		if (nidle + 2 > fds_cap) {
+			struct pollfd * grown = realloc(fds, (idle_cap + 2) * sizeof(struct pollfd));
+			if (!grown) break; /*out of memory: stop serving*/
+			fds = grown;
+			fds_cap = idle_cap + 2;
+		}
+		fds[0].fd = srv->listen_fd;
+		fds[1].fd = srv->wake[0];
+		for (i = 0; i < nidle; i++) fds[i + 2].fd = idle[i]->in.fd;
+		for (i = 0; i < nidle + 2; i++) fds[i].events = POLLIN;
+		if (poll(fds, nidle + 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		pthread_mutex_lock(&srv->lock);
+		for (i = n = 0; i < nidle; i++) {
+			c = idle[i];
+			if (!fds[i + 2].revents) {
+				idle[n++] = c;
+				continue;
+			}
+			c->next = NULL;
+			if (srv->ready) srv->ready_tail->next = c;
+			else srv->ready = c;
+			srv->ready_tail = c;
+			pthread_cond_signal(&srv->ready_cond);
+		}
+		nidle = n;
+		if (fds[1].revents) {
+			char drain[64];
+			while (read(srv->wake[0], drain, sizeof(drain)) == sizeof(drain));
+			while ((c = srv->back)) {
+				srv->back = c->next;
+				add_idle(&idle, &nidle, &idle_cap, c);
+			}
+		}
+		stopping = srv->stopping;
+		pthread_mutex_unlock(&srv->lock);
+		if (fds[0].revents && !stopping) {
+			int fd = accept(srv->listen_fd, NULL, NULL);
+			c = fd >= 0 ? malloc(sizeof(srv_conn)) : NULL;
+			if (c) {
+				c->in.fd = fd;
+				c->in.pos = c->in.len = 0;
+				add_idle(&idle, &nidle, &idle_cap, c);
+			}
+			else if (fd >= 0) close(fd);
+		}
+	}
+	pthread_mutex_lock(&srv->lock);
+	srv->stopping = 1; /*connections still with a worker are closed, not handed back*/
+	srv->done = 1;
+	while ((c = srv->back)) {
+		srv->back = c->next;
+		close_conn(c);
+	}
+	pthread_cond_broadcast(&srv->ready_cond);
+	pthread_mutex_unlock(&srv->lock);
+	for (i = 0; i < nidle; i++) close_conn(idle[i]);
+	free(idle);
+	free(fds);
+}
+
+int srv_serve(const char * sock_path, int nworkers, FILE * log){
+	srv_server srv;
+	struct sockaddr_un addr;
+	int i, fd;
+	if (nworkers <= 0) nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1) nworkers = 1;
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+		if (log) fprintf(log, "Error: socket path too long, %s\n", sock_path);
+		return 4;
+	}
+	fd = srv_connect(sock_path);
+	if (fd >= 0) {
+		close(fd);
+		if (log) fprintf(log, "Error: a server is already listening on %s\n", sock_path);
+		return 4;
+	}
+	unlink(sock_path); /*left over from a server that did not stop cleanly*/
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+	memset(&srv, 0, sizeof(srv));
+	srv.path = sock_path;
+	srv.nworkers = nworkers;
+	srv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv.listen_fd < 0 || bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+		|| listen(srv.listen_fd, SOMAXCONN) != 0) {
+		if (log) fprintf(log, "Error: cannot listen on %s\n", sock_path);
+		if (srv.listen_fd >= 0) close(srv.listen_fd);
+		return 4;
+	}
+	signal(SIGPIPE, SIG_IGN); /*a client that hangs up is seen as a failed write*/
+	if (pipe(srv.wake) != 0) {
+		if (log) fprintf(log, "Error: cannot listen on %s\n", sock_path);
+		close(srv.listen_fd);
+		unlink(sock_path);
+		return 4;
+	}
+	fcntl(srv.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(srv.wake[1], F_SETFL, O_NONBLOCK); /*a full pipe already wakes the dispatcher*/
+	srv.workers = calloc(nworkers, sizeof(srv_worker));
+	if (!srv.workers) {
+		if (log) fprintf(log, "Error: out of memory\n");
+		close(srv.listen_fd);
+		close(srv.wake[0]);
+		close(srv.wake[1]);
+		unlink(sock_path);
+		return 4;
+	}
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.ready_cond, NULL);
+	pthread_mutex_init(&srv.stats_lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &srv.started);
+	for (i = 0; i < nworkers; i++) {
+		srv.workers[i].srv = &srv;
+		srv.workers[i].id = i;
+		srv.workers[i].ctx = asm_ctx_create();
+		if (!srv.workers[i].ctx) {
+			if (log) fprintf(log, "Error: out of memory\n");
+			exit(4);
+		}
+	}
+	if (log) {
+		fprintf(log, "Listening on %s with %d workers\n", sock_path, nworkers);
+		fflush(log);
+	}
+	/*the calling thread dispatches*/
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&srv.workers[i].thread, NULL, worker_main, &srv.workers[i]) != 0) {
+			if (log) fprintf(log, "Error: cannot start worker thread\n");
+			exit(4);
+		}
+	}
+	dispatch(&srv);
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(srv.workers[i].thread, NULL);
+	}
+	close(srv.listen_fd);
+	close(srv.wake[0]);
+	close(srv.wake[1]);
+	unlink(sock_path);
+	if (log) fprintf(log, "Stopped after %llu requests\n", (unsigned long long)srv.stats.requests);
+	for (i = 0; i < nworkers; i++) {
+		asm_ctx_destroy(srv.workers[i].ctx);
+		free(srv.workers[i].words);
+		free(srv.workers[i].payload);
+		free(srv.workers[i].src);
+		free(srv.workers[i].out);
+	}
+	pthread_mutex_destroy(&srv.lock);
+	pthread_cond_destroy(&srv.ready_cond);
+	pthread_mutex_destroy(&srv.stats_lock);
+	free(srv.workers);
+	return 0;
+}
+
+int srv_connect(const char * sock_path){
+	struct sockaddr_un addr;
+	int fd;
+	if (strlen(sock_path) >= sizeof(addr.sun_path)) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* **********read_reply*****************
+ Parse the reply to the request just sent on fd into *reply. Return 0 on success
+************************************************ */
+static int read_reply(int fd, srv_reply * reply){
+	conn_reader * r = malloc(sizeof(conn_reader));
+	char line[SRV_HEADER_MAX + ASM_MAX_MSG];
+	int i, ok = 0;
+	memset(reply, 0, sizeof(*reply));
+	reply->code = ASM_ERR_OTHER;
+	if (!r) return -1;
+	r->fd = fd;
+	r->pos = r->len = 0;
+	if (conn_line(r, line, sizeof(line)) < 0
+		|| sscanf(line, "%d %d %zu", &reply->code, &reply->nerrors, &reply->body_len) != 3
+		|| reply->nerrors < 0 || reply->body_len > SRV_MAX_PAYLOAD * (size_t)16) goto done;
+	reply->errors = calloc(reply->nerrors + 1, sizeof(asm_error));
+	reply->body = malloc(reply->body_len + 1);
+	if (!reply->errors || !reply->body) goto done;
+	for (i = 0; i < reply->nerrors; i++) {
+		asm_error * e = &reply->errors[i];
+		int at = 0;
+		if (conn_line(r, line, sizeof(line)) < 0
+			|| sscanf(line, "%d:%d: exit %d: %n", &e->line, &e->column, &e->code, &at) != 3 || !at) goto done;
+		snprintf(e->message, sizeof(e->message), "%s\n", line + at);
+	}
+	if (conn_read(r, reply->body, reply->body_len) != 0) goto done;
+	reply->body[reply->body_len] = '\0';
+	ok = 1;
+done:
+	free(r);
+	if (!ok) {
+		srv_reply_free(reply);
+		reply->code = ASM_ERR_OTHER;
+	}
+	return ok ? 0 : -1;
+}
+
+int srv_assemble(int fd, const char * format, int by_path, const char * payload, size_t len, int one_pass,
+				 int max_errors, srv_reply * reply){
+	char header[SRV_HEADER_MAX];
+	int n = snprintf(header, sizeof(header), "assemble %s %s %zu %d %d\n", format, by_path ? "path" : "inline",
+					 len, one_pass != 0, max_errors);
+	if (n >= (int)sizeof(header) || send_all(fd, header, n) != 0 || send_all(fd, payload, len) != 0) {
+		memset(reply, 0, sizeof(*reply));
+		reply->code = ASM_ERR_OTHER;
+		return -1;
+	}
+	return read_reply(fd, reply);
+}
+
+int srv_command(int fd, const char * command, srv_reply * reply){
+	char header[SRV_HEADER_MAX];
+	int n = snprintf(header, sizeof(header), "%s\n", command);
+	if (n >= (int)sizeof(header) || send_all(fd, header, n) != 0) {
+		memset(reply, 0, sizeof(*reply));
+		reply->code = ASM_ERR_OTHER;
+		return -1;
+	}
+	return read_reply(fd, reply);
+}
+
+void srv_reply_free(srv_reply * reply){
+	free(reply->errors);
+	free(reply->body);
+	reply->errors = NULL;
+	reply->body = NULL;
+	reply->nerrors = 0;
+	reply->body_len = 0;
+}
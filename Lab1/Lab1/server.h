@@ -0,0 +1,69 @@
+/*
+server.h
+
+ Assembler daemon. Listens on a Unix domain socket and assembles requests on a pool of workers,
+ each keeping its context and buffers from one request to the next, so a caller pays neither
+ process startup nor a cold symbol table per program.
+
+ Dispatch is per request, not per connection: the thread that called srv_serve polls the
+ listening socket and every idle connection, and queues a connection for the workers only once
+ a request has arrived on it. A worker answers that request (and any others the client already
+ sent), then hands the connection back to be polled. Idle connections hold no worker, so a
+ request waits only while every worker is busy with other requests. A client that sends part
+ of a request and stalls does hold its worker until the rest comes or it hangs up.
+
+ Protocol, one request after another on a connection. A request is one header line of words
+ separated by spaces, then its payload:
+   assemble <format> <inline|path> <payload bytes> <one-pass 0|1> <max errors>
+              the payload is the source, or the path of the source file as the server sees it.
+              .include paths are relative to that file, inline to the server's working directory
+   stats      latency percentiles and counts as text
+   shutdown   stop accepting, close the idle connections and the others after the request each
+              is on, and return from srv_serve
+ A reply is the line "<code> <errors> <body bytes>", then one line per error,
+ "<line>:<column>: exit <code>: <message>", then the body: the image in the requested format,
+ or the text of stats. code is ASM_OK or ASM_ERR_*, the same as the command line exit code.
+
+*/
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "assembler.h"
+
+#define SRV_MAX_PAYLOAD (64 << 20) /* largest source accepted inline */
+
+/* **********srv_serve*****************
+ Serve requests on sock_path with nworkers worker threads (0 for one per core) until a shutdown
+ request, dispatching on the calling thread.
+ A stale socket file is replaced. log gets one line per start and stop, NULL for none.
+ Return 0, or 4 if the socket cannot be set up
+************************************************ */
+int srv_serve(const char * sock_path, int nworkers, FILE * log);
+
+/*Reply to one request, owned by the caller and released with srv_reply_free*/
+typedef struct {
+	int code; /*ASM_OK or ASM_ERR_*; ASM_ERR_OTHER if the server could not be reached*/
+	int nerrors;
+	asm_error * errors;
+	char * body; /*image in the requested format, or the stats text*/
+	size_t body_len;
+}srv_reply;
+
+/*Connect to a running server, -1 if there is none*/
+int srv_connect(const char * sock_path);
+
+/* **********srv_assemble*****************
+ Send one assemble request on fd: payload is the source (by_path 0) or its path (by_path 1).
+ Return 0 once *reply holds the server's answer, -1 if the connection failed
+************************************************ */
+int srv_assemble(int fd, const char * format, int by_path, const char * payload, size_t len, int one_pass,
+				 int max_errors, srv_reply * reply);
+
+/*stats or shutdown request on fd. Return 0 on success*/
+int srv_command(int fd, const char * command, srv_reply * reply);
+
+void srv_reply_free(srv_reply * reply);
+
+#endif
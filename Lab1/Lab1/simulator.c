@@ -0,0 +1,280 @@
+/*
+simulator.c
+
+ LC-3b functional simulator. Every instruction word is decoded once per process into a 64K entry
+ table (handler, register numbers, sign extended and scaled immediate, cycles), and the run loop
+ dispatches through a computed goto on the handler, so executing an instruction is one table load
+ and one indirect jump.
+
+*/
+#include <stdio.h> /* standard input/output library */
+#include <string.h> /* String operations library */
+#include <pthread.h> /* decode table, built once */
+#include "simulator.h"
+
+#define FETCH_CYCLES (3 + SIM_MEM_CYCLES) /* states 18, 33 (memory), 35 and 32 (decode) */
+
+/*Handlers of the run loop. Operate forms and branches get a handler per variant so the loop
+ never tests a mode bit*/
+enum{H_ADD, H_ADDI, H_AND, H_ANDI, H_XOR, H_XORI, H_BR, H_BRA, H_NOP, H_JMP, H_JSR, H_JSRR, H_LDB, H_LDW,
+	H_LEA, H_LSHF, H_RSHFL, H_RSHFA, H_STB, H_STW, H_TRAP, H_RTI, H_ILLEGAL, NUM_HANDLERS};
+
+/*Cycles of each handler through the LC-3b state machine, fetch included. A taken conditional
+ branch takes one more*/
+static const uint8_t CYCLES[NUM_HANDLERS] = {
+	FETCH_CYCLES + 1, FETCH_CYCLES + 1, FETCH_CYCLES + 1, FETCH_CYCLES + 1, FETCH_CYCLES + 1, FETCH_CYCLES + 1, /* operate */
+	FETCH_CYCLES + 1, FETCH_CYCLES + 2, FETCH_CYCLES + 1, /* br, br always, br never */
+	FETCH_CYCLES + 1, FETCH_CYCLES + 2, FETCH_CYCLES + 2, /* jmp, jsr, jsrr */
+	FETCH_CYCLES + 2 + SIM_MEM_CYCLES, FETCH_CYCLES + 2 + SIM_MEM_CYCLES, /* ldb, ldw */
+	FETCH_CYCLES + 1, FETCH_CYCLES + 1, FETCH_CYCLES + 1, FETCH_CYCLES + 1, /* lea, shifts */
+	FETCH_CYCLES + 2 + SIM_MEM_CYCLES, FETCH_CYCLES + 2 + SIM_MEM_CYCLES, /* stb, stw */
+	FETCH_CYCLES + 2 + SIM_MEM_CYCLES, /* trap */
+	FETCH_CYCLES + 2 * (1 + SIM_MEM_CYCLES) + 2, /* rti: two stack reads */
+	0 /* illegal */
+};
+
+/*One decoded instruction word*/
+typedef struct {
+	uint8_t op; /*H_* */
+	uint8_t a; /*DR, or SR of a store*/
+	uint8_t b; /*SR1 or BaseR*/
+	uint8_t c; /*SR2, or the nzp mask of a branch*/
+	int16_t imm; /*imm5, amount4 or offset, offsets scaled to bytes; byte address of a trap vector*/
+	uint8_t cycles;
+	uint8_t pad;
+}sim_decoded;
+
+static sim_decoded DECODE[0x10000];
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+#define SEXT(w, bits) ((int16_t)((w) << (16 - (bits))) >> (16 - (bits))) /* sign extend the low bits of w */
+
+/* **********decode_word*****************
+ Decode one instruction word into its table entry
+************************************************ */
+static void decode_word(uint16_t w, sim_decoded * e){
+	e->a = (w >> 9) & 7;
+	e->b = (w >> 6) & 7;
+	e->c = w & 7;
+	e->imm = 0;
+	switch (w >> 12) {
+		case 0x1: case 0x5: case 0x9: /* add, and, xor */
+			e->op = (w >> 12) == 0x1 ? H_ADD : (w >> 12) == 0x5 ? H_AND : H_XOR;
+			if (w & 0x20) {
+				e->op++; /*immediate form follows the register form*/
+				e->imm = SEXT(w, 5);
+			}
+			break;
+		case 0x0: /* br */
+			e->c = (w >> 9) & 7;
+			e->op = e->c == 0 ? H_NOP : e->c == 7 ? H_BRA : H_BR;
+			e->imm = SEXT(w, 9) * 2;
+			break;
+		case 0xC: /* jmp, ret */
+			e->op = H_JMP;
+			break;
+		case 0x4: /* jsr, jsrr */
+			e->op = (w & 0x800) ? H_JSR : H_JSRR;
+			e->imm = (w & 0x800) ? SEXT(w, 11) * 2 : 0;
+			break;
+		case 0x2: /* ldb */
+			e->op = H_LDB;
+			e->imm = SEXT(w, 6);
+			break;
+		case 0x3: /* stb */
+			e->op = H_STB;
+			e->imm = SEXT(w, 6);
+			break;
+		case 0x6: /* ldw */
+			e->op = H_LDW;
+			e->imm = SEXT(w, 6) * 2;
+			break;
+		case 0x7: /* stw */
+			e->op = H_STW;
+			e->imm = SEXT(w, 6) * 2;
+			break;
+		case 0xE: /* lea */
+			e->op = H_LEA;
+			e->imm = SEXT(w, 9) * 2;
+			break;
+		case 0xD: /* lshf, rshfl, rshfa */
+			e->op = !(w & 0x10) ? H_LSHF : (w & 0x20) ? H_RSHFA : H_RSHFL;
+			e->imm = w & 0xF;
+			break;
+		case 0xF: /* trap, halt */
+			e->op = H_TRAP;
+			e->imm = (w & 0xFF) << 1;
+			break;
+		case 0x8: /* rti */
+			e->op = H_RTI;
+			break;
+		default: /* 1010, 1011 */
+			e->op = H_ILLEGAL;
+			break;
+	}
+	e->cycles = CYCLES[e->op];
+	e->pad = 0;
+}
+
+static void build_decode(void){
+	int w;
+	for (w = 0; w < 0x10000; w++) decode_word((uint16_t)w, &DECODE[w]);
+}
+
+void sim_load(sim_machine * m, const uint16_t * words, size_t nwords){
+	size_t i;
+	memset(m, 0, sizeof(*m));
+	m->cc = 2;
+	if (nwords == 0) return;
+	m->pc = words[0] & ~1;
+	for (i = 1; i < nwords; i++) {
+		m->mem[((m->pc >> 1) + i - 1) & 0x7FFF] = words[i];
+	}
+}
+
+#define CC_OF(v) ((v) & 0x8000 ? 4 : (v) ? 1 : 2) /* N, Z or P of a result */
+
+/*Dispatch the instruction at pc, or stop at a limit*/
+#define NEXT() do { \
+	if (insts >= inst_end || cycles >= cycle_end) goto limit; \
+	e = &DECODE[mem[pc >> 1]]; \
+	pc += 2; \
+	insts++; \
+	cycles += e->cycles; \
+	goto *GO[e->op]; \
+} while (0)
+
+/*Transfer control, x0000 halts*/
+#define JUMP(target) do { \
+	pc = (target); \
+	if (pc == 0) goto halt; \
+	NEXT(); \
+} while (0)
+
+int sim_run(sim_machine * m, uint64_t max_insts, uint64_t max_cycles){
+	static const void * const GO[NUM_HANDLERS] = {&&add, &&addi, &&and, &&andi, &&xor, &&xori, &&br, &&bra, &&nop,
+		&&jmp, &&jsr, &&jsrr, &&ldb, &&ldw, &&lea, &&lshf, &&rshfl, &&rshfa, &&stb, &&stw, &&trap, &&rti, &&illegal};
+	uint16_t * mem = m->mem;
+	uint16_t * r = m->reg;
+	uint16_t pc = m->pc, addr, target;
+	unsigned cc = m->cc, s;
+	uint64_t insts = m->insts, cycles = m->cycles;
+	uint64_t inst_end = max_insts ? insts + max_insts : UINT64_MAX;
+	uint64_t cycle_end = max_cycles ? cycles + max_cycles : UINT64_MAX;
+	const sim_decoded * e;
+	int why;
+	pthread_once(&decode_once, build_decode);
+	NEXT();
+
+add:
+	r[e->a] = r[e->b] + r[e->c];
+	cc = CC_OF(r[e->a]);
+	NEXT();
+addi:
+	r[e->a] = r[e->b] + e->imm;
+	cc = CC_OF(r[e->a]);
+	NEXT();
+and:
+	r[e->a] = r[e->b] & r[e->c];
+	cc = CC_OF(r[e->a]);
+	NEXT();
+andi:
+	r[e->a] = r[e->b] & e->imm;
+	cc = CC_OF(r[e->a]);
+	NEXT();
+xor:
+	r[e->a] = r[e->b] ^ r[e->c];
+	cc = CC_OF(r[e->a]);
+	NEXT();
+xori:
+	r[e->a] = r[e->b] ^ e->imm;
+	cc = CC_OF(r[e->a]);
+	NEXT();
+br:
+	if (cc & e->c) {
+		cycles++;
+		JUMP(pc + e->imm);
+	}
+	NEXT();
+bra:
+	JUMP(pc + e->imm);
+nop:
+	NEXT();
+jmp:
+	JUMP(r[e->b]);
+jsr:
+	r[7] = pc;
+	JUMP(pc + e->imm);
+jsrr:
+	target = r[e->b];
+	r[7] = pc;
+	JUMP(target);
+ldb:
+	addr = r[e->b] + e->imm;
+	r[e->a] = (int8_t)(mem[addr >> 1] >> ((addr & 1) << 3));
+	cc = CC_OF(r[e->a]);
+	NEXT();
+ldw:
+	addr = r[e->b] + e->imm;
+	r[e->a] = mem[addr >> 1];
+	cc = CC_OF(r[e->a]);
+	NEXT();
+lea:
+	r[e->a] = pc + e->imm;
+	NEXT();
+lshf:
+	r[e->a] = r[e->b] << e->imm;
+	cc = CC_OF(r[e->a]);
+	NEXT();
+rshfl:
+	r[e->a] = r[e->b] >> e->imm;
+	cc = CC_OF(r[e->a]);
+	NEXT();
+rshfa:
+	r[e->a] = (int16_t)r[e->b] >> e->imm;
+	cc = CC_OF(r[e->a]);
+	NEXT();
+stb:
+	addr = r[e->b] + e->imm;
+	s = (addr & 1) << 3;
+	mem[addr >> 1] = (mem[addr >> 1] & (0xFF00 >> s)) | ((r[e->a] & 0xFF) << s);
+	NEXT();
+stw:
+	addr = r[e->b] + e->imm;
+	mem[addr >> 1] = r[e->a];
+	NEXT();
+trap:
+	r[7] = pc;
+	JUMP(mem[e->imm >> 1]);
+rti:
+	target = mem[r[6] >> 1];
+	cc = mem[(uint16_t)(r[6] + 2) >> 1] & 7;
+	r[6] += 4;
+	JUMP(target);
+illegal:
+	pc -= 2;
+	insts--;
+	why = SIM_ILLEGAL;
+	goto stop;
+halt:
+	why = SIM_HALTED;
+	goto stop;
+limit:
+	why = insts >= inst_end ? SIM_INST_LIMIT : SIM_CYCLE_LIMIT;
+stop:
+	m->pc = pc;
+	m->cc = cc;
+	m->insts = insts;
+	m->cycles = cycles;
+	return why;
+}
+
+void sim_print_state(const sim_machine * m, FILE * out){
+	int i;
+	fprintf(out, "Instruction Count : %llu\n", (unsigned long long)m->insts);
+	fprintf(out, "Cycle Count       : %llu\n", (unsigned long long)m->cycles);
+	fprintf(out, "PC                : 0x%.4x\n", m->pc);
+	fprintf(out, "CCs: N = %d  Z = %d  P = %d\n", (m->cc >> 2) & 1, (m->cc >> 1) & 1, m->cc & 1);
+	fprintf(out, "Registers:\n");
+	for (i = 0; i < 8; i++) fprintf(out, "%d: 0x%.4x\n", i, m->reg[i]);
+}
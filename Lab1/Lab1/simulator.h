@@ -0,0 +1,49 @@
+/*
+simulator.h
+
+ LC-3b functional simulator. Runs an assembled word image in process, so a test harness can
+ assemble, execute and check a program without writing or parsing the hex text.
+
+*/
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_MEM_CYCLES 5 /* cycles of one memory access */
+
+/*Why sim_run stopped*/
+enum{SIM_HALTED, /*jumped, branched or trapped to x0000, which is where HALT goes with no trap table*/
+	SIM_INST_LIMIT, /*executed max_insts instructions*/
+	SIM_CYCLE_LIMIT, /*used up max_cycles*/
+	SIM_ILLEGAL /*opcode 1010 or 1011, pc is left on the instruction*/
+};
+
+/*Architectural state of one machine. Privilege modes and interrupts are not modelled*/
+typedef struct {
+	uint16_t reg[8];
+	uint16_t pc;
+	uint8_t cc; /*condition codes: N = 4, Z = 2, P = 1*/
+	uint64_t insts; /*instructions executed since sim_load*/
+	uint64_t cycles; /*cycles of the LC-3b state machine since sim_load*/
+	uint16_t mem[0x8000]; /*64K bytes as little-endian words*/
+}sim_machine;
+
+/* **********sim_load*****************
+ Reset the machine and load an image: words[0] is the .orig address, the rest is stored from
+ there on. pc starts at the origin with Z set, like the lab simulator
+************************************************ */
+void sim_load(sim_machine * m, const uint16_t * words, size_t nwords);
+
+/* **********sim_run*****************
+ Execute from m->pc until the program halts or this call has run max_insts instructions or
+ max_cycles cycles, 0 for no limit. m->insts and m->cycles keep counting from sim_load. Return SIM_*
+************************************************ */
+int sim_run(sim_machine * m, uint64_t max_insts, uint64_t max_cycles);
+
+/*Registers, pc, condition codes and counts in the lab simulator's rdump layout*/
+void sim_print_state(const sim_machine * m, FILE * out);
+
+#endif